@@ -7,6 +7,11 @@
  * Ricoh RP2A07 - PAL version
  *
  * The NTSC and PAL versions contained different clock dividers and different hard-coded sample rates for delta modulation
+ *
+ * With the sound thread the APU is split in two. The frame counter, the length counters and the DMC
+ * stay on the CPU thread as the timing model that $4015 reads, IRQs and DMC fetches need. The pulse,
+ * triangle and noise channels and the expansion chips run on the worker, which gets the register
+ * writes, frame counter clocks, channel gates and DMC levels queued at the cycle they happen.
  */
 
 #include "apu.h"
@@ -20,8 +25,14 @@
 #include "../nes/mapper.h"
 #include "../nes/nesemu.h"
 #include "../jemu.h"
+#include "blip.h"
+#include "mixer.h"
+#include "../state.h"
+#include "soundthread.h"
 
-#define FRAC_BITS			16
+#define SOUND_BATCH		4096	/* CPU cycles queued to the sound thread without an event */
+#define FRAME_QUARTER	0x01
+#define FRAME_HALF		0x02
 
 static int cpuClock = NES_NTSC_MASTER / NTSC_CPU_CLOCK_DIV; //TODO: PAL support
 static const uint16_t frameClock[5] = {7457, 14913, 22371, 29829, 37281}; //shifted up by 1 to work
@@ -49,13 +60,36 @@ static const float tnd_table[203] =  {
         0.7026, 0.7048, 0.7070, 0.7091, 0.7113, 0.7134, 0.7156, 0.7177, 0.7198, 0.7219, 0.7240, 0.7261, 0.7282,
         0.7303, 0.7323, 0.7344, 0.7364, 0.7384, 0.7405, 0.7425, 0.7445
 };
-static float pulseMixSample = 0, tndMixSample = 0, expSample = 0;
+struct expansion {
+	void (*step)(uint32_t);
+	uint16_t divider;	/* CPU cycles per native clock */
+	uint16_t phase;		/* CPU cycles into the current native clock */
+	float gain;
+	float level;		/* last scaled output handed to the buffer */
+};
+
+static struct blipBuffer apuBuffer;
+static struct expansion expansions[APU_MAX_EXPANSIONS], *stepping = NULL;
+static int expansionCount = 0;
+static float apuLevel = 0, apuGain = 1;
+static uint32_t apuTime = 0;
 static uint8_t frameCounter = 0, sweep1Counter = 0, sweep2Counter = 0, env1Decay = 0, env2Decay = 0, envNoiseDecay = 0,
 					triLinear = 0, dmcBitsLeft = 8, dmcShift = 0, pulse1Mute = 0, pulse2Mute = 0;
 static int8_t triSeq = 0, triBuff = 0;
-static uint16_t triTemp, noiseTemp, framecc = 0, pulse1Sample = 0, pulse2Sample = 0, triSample = 0, tmpcnt = 0, noiseSample = 0, sampleCounter = 0;
+static uint16_t triTemp, noiseTemp, framecc = 0, pulse1Sample = 0, pulse2Sample = 0, triSample = 0, noiseSample = 0;
 static int16_t pulse1Temp = 0, pulse2Temp = 0, pulse1Change = 0, pulse2Change = 0;
-static int bufferSize;
+static int bufferSize, apuSource;
+/* timing model side: length halt flags, last gates handed to the channels and cycles they still have to run */
+static uint8_t lengthHalt = 0, postedGates = 0;
+static int channelCycles = 0;
+/* channel side: low nibble plays (enabled with length left), high nibble enabled; mirrored DMC output */
+static uint8_t channelGates = 0, dmcLevel = 0, noiseOdd = 0;
+static inline uint16_t timing_idle(uint16_t), channels_idle(uint16_t);
+static inline uint8_t current_gates(void);
+static inline void skip_timing(uint16_t), skip_channels(uint16_t), update_sweep_mute(void), channel_samples(void), step_channels(void),
+	step_dmc(void), mix_output(void), end_channels(void), run_expansions(void), frame_clock(uint8_t), length_clock(void), sweep_clock(void),
+	update_gates(void), sync_channels(void), channel_event(void (*)(uint8_t), uint8_t), channel_write(uint16_t, uint8_t),
+	write_channel_register(uint16_t, uint8_t), clock_channels(uint8_t), set_gates(uint8_t), set_dmc_level(uint8_t), seed_noise(uint8_t);
 
 uint8_t apuStatus, apuFrameCounter, pulse1Length = 0, pulse2Length = 0, pulse1Control = 0, pulse2Control = 0,
 		     sweep1Divide = 0, sweep1Reload = 0, env1Start = 0, env2Start = 0, envNoiseStart = 0, env1Divide = 0,
@@ -69,7 +103,6 @@ uint16_t triTimer = 0, noiseShift, noiseTimer,
 static float *sampleBuffer = NULL;
 uint32_t apucc = 0;
 
-static uint32_t sampleRate, originalSampleRate;
 const uint8_t lengthTable[0x20] = {
          10, 254,  20,   2,  40,   4,  80,   6, 160,   8,  60,  10,  14,  12,  26,  14,
          12,  16,  24,  18,  48,  20,  96,  22, 192,  24,  72,  26,  16,  28,  32,  30
@@ -91,15 +124,76 @@ void init_apu(int buffer) {
 	if(sampleBuffer != NULL)
 		free(sampleBuffer);
 	sampleBuffer = malloc(bufferSize * sizeof(float));
+	init_blip(&apuBuffer, bufferSize << 1);
+	apuSource = mixer_add_source();
+	apuLevel = 0;
+	apuTime = 0;
+	apuGain = 1;
+	expansionCount = 0;
+	channelCycles = 0;
+	sync_channels();
+}
+
+/* Expansion audio: a mapper registers its chip with a step function that runs n native
+ * clocks, the CPU cycles per native clock and its mix gain. The chips are run in one go
+ * at the end of every run_apu, so register writes land between steps. */
+void apu_add_expansion(void (*step)(uint32_t), uint16_t divider, float gain) {
+	if (expansionCount == APU_MAX_EXPANSIONS) {
+		printf("Error: too many expansion sound chips\n");
+		exit(EXIT_FAILURE);
+	}
+	struct expansion *exp = &expansions[expansionCount++];
+	exp->step = step;
+	exp->divider = divider;
+	exp->phase = 0;
+	exp->gain = gain;
+	exp->level = 0;
+	apuGain = 0.5; /* leave headroom for the cartridge */
+}
+
+/* called from a step function, clock counts native clocks since the step began */
+void apu_expansion_output(uint32_t clock, int level) {
+	float value = level * stepping->gain;
+	if (value != stepping->level && !audioSkip) {
+		uint32_t time = clock * stepping->divider;
+		blip_add_delta(&apuBuffer, (time > stepping->phase) ? (time - stepping->phase) : 0, value - stepping->level);
+		stepping->level = value;
+	}
+}
+
+void run_expansions() {
+	for (int i = 0; i < expansionCount; i++) {
+		stepping = &expansions[i];
+		uint32_t cycles = stepping->phase + apuTime;
+		if (cycles >= stepping->divider)
+			(*stepping->step)(cycles / stepping->divider);
+		stepping->phase = cycles % stepping->divider;
+	}
 }
 
 void set_timings_apu(int div, int clock) {
-	originalSampleRate = sampleRate = ((uint64_t)clock << FRAC_BITS) / div;
-	sampleCounter = 0;
+	set_timings_blip(&apuBuffer, clock, div);
 }
 
 void run_apu(uint16_t ntimes) { /* apu cycle times */
+	uint16_t skip;
+	uint8_t clocks;
+	if (!soundThreadRunning)
+		noiseOdd = (_6502_M2 % 2);
 	while (ntimes) {
+		/* Stretches without any timer or sequencer event are handled in one go */
+		skip = timing_idle(ntimes);
+		if (!soundThreadRunning)
+			skip = channels_idle(skip);
+		if (skip) {
+			skip_timing(skip);
+			if (soundThreadRunning)
+				channelCycles += skip;
+			else
+				skip_channels(skip);
+			ntimes -= skip;
+			continue;
+		}
 		if (frameWrite) {
 			if (!frameWriteDelay) {
 				frameCounter = 0;
@@ -108,8 +202,7 @@ void run_apu(uint16_t ntimes) { /* apu cycle times */
 					frameInt = 0;
 				}
 				if (apuFrameCounter&0x80) {
-					quarter_frame();
-					half_frame();
+					frame_clock(FRAME_QUARTER | FRAME_HALF);
 				}
 				frameWrite = 0;
 			} else
@@ -122,14 +215,17 @@ void run_apu(uint16_t ntimes) { /* apu cycle times */
 		}
 
 		if (framecc == frameClock[frameCounter]) {
+			clocks = 0;
 			if ((!(apuFrameCounter&0x80)) || ((apuFrameCounter&0x80) && frameCounter != 3)) {
-				quarter_frame();
+				clocks |= FRAME_QUARTER;
 			}
 			if ((apuFrameCounter & 0x80) && (frameCounter == 1 || frameCounter == 4)) {
-				half_frame();
+				clocks |= FRAME_HALF;
 		  } else if ((!(apuFrameCounter & 0x80)) && (frameCounter%2)) {
-				half_frame();
+				clocks |= FRAME_HALF;
 		  }
+			if (clocks)
+				frame_clock(clocks);
 			frameCounter++;
 		}
 		if ((!(apuFrameCounter&0xc0)) && framecc >= 29828 && framecc <= 29830) {
@@ -139,149 +235,304 @@ void run_apu(uint16_t ntimes) { /* apu cycle times */
 			frameCounter = 0;
 			framecc = 0;
 		}
-		pulse1Change = (sweep1&8) ? -((pulse1Timer>>sweep1Shift)+1) : (pulse1Timer>>sweep1Shift);
-		pulse2Change = (sweep2&8) ? -(pulse2Timer>>sweep2Shift) : (pulse2Timer>>sweep2Shift);
-		if ((pulse1Change + pulse1Timer) > 0x7ff || pulse1Timer < 8)
-			pulse1Mute = 1;
-		else
-			pulse1Mute = 0;
+		if (soundThreadRunning) {
+			step_dmc();
+			channelCycles++;
+		} else {
+			update_sweep_mute();
+			channel_samples();
+			step_channels();
+			step_dmc();
+			mix_output();
+			apuTime++;
+		}
+		ntimes--;
+		framecc++;
+		if (apucc == cpuClock)
+			apucc = 0;
+		apucc++;
+	}
+	if (!soundThreadRunning)
+		end_channels();
+	else if (channelCycles >= SOUND_BATCH) {
+		sound_post(&channelCycles, NULL, 0);
+		channelCycles = 0;
+	}
+}
 
-		if ((pulse2Change + pulse2Timer) > 0x7ff || pulse2Timer < 8)
-			pulse2Mute = 1;
-		else
-			pulse2Mute = 0;
+/* sound thread side of run_apu, the channels catch up with the cycles the timing model queued */
+void run_apu_channels(int cycles) {
+	uint16_t skip;
+	/* the CPU clock is ahead, the worker's own clock stands in for its parity */
+	uint8_t odd = (cycles & 1);
+	while (cycles) {
+		skip = channels_idle((cycles > UINT16_MAX) ? UINT16_MAX : cycles);
+		if (skip) {
+			skip_channels(skip);
+			cycles -= skip;
+			continue;
+		}
+		update_sweep_mute();
+		channel_samples();
+		step_channels();
+		mix_output();
+		apuTime++;
+		cycles--;
+	}
+	end_channels();
+	noiseOdd ^= odd;
+}
 
-		if (pulse1Length && (apuStatus&1)) {
-			if (pulse1Timer >= 8 && !pulse1Mute) {
-				pulse1Sample = (pulse1Control&0x10) ? (dutySequence[(pulse1Control>>6)&3][pulse1Duty>>1] * pulse1Control&0xf) : (dutySequence[(pulse1Control>>6)&3][pulse1Duty>>1] * env1Decay);
-			} else
-				pulse1Sample = 0;
-			if (pulse1Temp < 0) {
-				pulse1Temp = pulse1Timer;
-				pulse1Duty--;
-				if (pulse1Duty < 0)
-					pulse1Duty = 15;
-			}
-			pulse1Temp--;
-		} else
-			pulse1Sample = 0;
+void end_channels() {
+	run_expansions();
+	/* skipped time never reaches the buffer, the output levels stay where they were */
+	if (audioSkip) {
+		apuTime = 0;
+		return;
+	}
+	blip_end_frame(&apuBuffer, apuTime);
+	apuTime = 0;
+	if (blip_samples_avail(&apuBuffer) >= bufferSize) {
+		blip_read_samples(&apuBuffer, sampleBuffer, bufferSize);
+		mixer_write(apuSource, sampleBuffer, bufferSize);
+		blip_set_ratio(&apuBuffer, mixerRatio);
+	}
+}
 
-		if (pulse2Length && (apuStatus&2)) {
-			if (pulse2Timer >= 8 && !pulse2Mute) {
-				pulse2Sample = (pulse2Control&0x10) ? (dutySequence[(pulse2Control>>6)&3][pulse2Duty>>1] * pulse2Control&0xf) : (dutySequence[(pulse2Control>>6)&3][pulse2Duty>>1] * env2Decay);
-			} else
-				pulse2Sample = 0;
-			if (pulse2Temp < 0) {
-				pulse2Temp = pulse2Timer;
-				pulse2Duty--;
-				if (pulse2Duty < 0)
-					pulse2Duty = 15;
-			}
-			pulse2Temp--;
-		} else
-			pulse2Sample = 0;
-
-		pulseMixSample += pulse_table[pulse1Sample+pulse2Sample];
-
-		if (triLength && triLinear && (apuStatus&4)) {
-				triSample = triSequence[triSeq];
-				triBuff = triSample;
-			if (!triTemp) {
-				triTemp = triTimer;
-				triSeq--;
-				if (triSeq < 0)
-					triSeq = 31;
-			}
-			triTemp--;
-		} else
-			triSample = triBuff;
+/* Number of upcoming cycles (at most max) in which no sequencer step, DMC timer or pending write fires */
+uint16_t timing_idle(uint16_t max) {
+	uint16_t n = max, dist;
+	if (dmcRestart)
+		return 0;
+	if (frameWrite && frameWriteDelay < n)
+		n = frameWriteDelay;
+	if (frameCounter < 5) {
+		dist = frameClock[frameCounter] - framecc;
+		if (dist < n)
+			n = dist;
+	}
+	if (!(apuFrameCounter&0xc0)) {
+		if (framecc >= 29828 && framecc <= 29830)
+			return 0;
+		dist = 29828 - framecc;
+		if (dist < n)
+			n = dist;
+	}
+	dist = frameReset[(apuFrameCounter & 0x80)>>7] - framecc;
+	if (dist < n)
+		n = dist;
+	if (dmcTemp < n)
+		n = dmcTemp;
+	return n;
+}
 
-		if (noiseLength && (apuStatus&8)) {
-			if (!(noiseShift&1)) {
-				noiseSample = (noiseControl&0x10) ? (noiseControl&0xf) : envNoiseDecay;
-			} else
-				noiseSample = 0;
-			if (!noiseTemp) {
-				noiseTemp = noiseTimer;
-				noiseShift = ((noiseShift>>1) | ((noiseMode ? ((noiseShift&1) ^ ((noiseShift>>1)&1)) : ((noiseShift&1) ^ ((noiseShift>>1)&1)))<<14));
-			}
-			else if (_6502_M2%2)
-				noiseTemp--;
-		} else
-			noiseSample = 0;
+/* Number of upcoming cycles (at most max) in which no channel timer fires */
+uint16_t channels_idle(uint16_t max) {
+	uint16_t n = max;
+	if (channelGates & 1) {
+		if (pulse1Temp < 0)
+			return 0;
+		if (pulse1Temp + 1 < n)
+			n = pulse1Temp + 1;
+	}
+	if (channelGates & 2) {
+		if (pulse2Temp < 0)
+			return 0;
+		if (pulse2Temp + 1 < n)
+			n = pulse2Temp + 1;
+	}
+	if ((channelGates & 4) && triLinear && triTemp < n)
+		n = triTemp;
+	if (channelGates & 8) {
+		if (!noiseTemp)
+			return 0;
+		if (noiseOdd && noiseTemp < n)
+			n = noiseTemp;
+	}
+	return n;
+}
 
-		if (dmcRestart) {
-			dmcRestart = 0;
-			dmcBytesLeft = dmcLength;
-			dmcCurAdd = dmcAddress;
+void skip_timing(uint16_t n) {
+	if (frameWrite)
+		frameWriteDelay -= n;
+	for (uint16_t i = 0; i < n; i++)
+		irq_cpu_clocked();
+	if (dmcInt || frameInt) {
+		irqPulled = 1;
+	}
+	dmcTemp -= n;
+	framecc += n;
+	apucc = ((apucc + n - 1) % cpuClock) + 1;
+}
+
+void skip_channels(uint16_t n) {
+	update_sweep_mute();
+	channel_samples();
+	mix_output();
+	if (channelGates & 1)
+		pulse1Temp -= n;
+	if (channelGates & 2)
+		pulse2Temp -= n;
+	if ((channelGates & 4) && triLinear)
+		triTemp -= n;
+	if ((channelGates & 8) && noiseOdd)
+		noiseTemp -= n;
+	apuTime += n;
+}
+
+void update_sweep_mute() {
+	pulse1Change = (sweep1&8) ? -((pulse1Timer>>sweep1Shift)+1) : (pulse1Timer>>sweep1Shift);
+	pulse2Change = (sweep2&8) ? -(pulse2Timer>>sweep2Shift) : (pulse2Timer>>sweep2Shift);
+	if ((pulse1Change + pulse1Timer) > 0x7ff || pulse1Timer < 8)
+		pulse1Mute = 1;
+	else
+		pulse1Mute = 0;
+
+	if ((pulse2Change + pulse2Timer) > 0x7ff || pulse2Timer < 8)
+		pulse2Mute = 1;
+	else
+		pulse2Mute = 0;
+}
+
+void channel_samples() {
+	if ((channelGates & 1) && pulse1Timer >= 8 && !pulse1Mute)
+		pulse1Sample = (pulse1Control&0x10) ? (dutySequence[(pulse1Control>>6)&3][pulse1Duty>>1] * pulse1Control&0xf) : (dutySequence[(pulse1Control>>6)&3][pulse1Duty>>1] * env1Decay);
+	else
+		pulse1Sample = 0;
+
+	if ((channelGates & 2) && pulse2Timer >= 8 && !pulse2Mute)
+		pulse2Sample = (pulse2Control&0x10) ? (dutySequence[(pulse2Control>>6)&3][pulse2Duty>>1] * pulse2Control&0xf) : (dutySequence[(pulse2Control>>6)&3][pulse2Duty>>1] * env2Decay);
+	else
+		pulse2Sample = 0;
+
+	if ((channelGates & 4) && triLinear) {
+		triSample = triSequence[triSeq];
+		triBuff = triSample;
+	} else
+		triSample = triBuff;
+
+	if ((channelGates & 8) && !(noiseShift&1))
+		noiseSample = (noiseControl&0x10) ? (noiseControl&0xf) : envNoiseDecay;
+	else
+		noiseSample = 0;
+}
+
+void step_channels() {
+	if (channelGates & 1) {
+		if (pulse1Temp < 0) {
+			pulse1Temp = pulse1Timer;
+			pulse1Duty--;
+			if (pulse1Duty < 0)
+				pulse1Duty = 15;
 		}
-			if (!dmcTemp) {
-				dmcTemp = dmcRate;
-				if (!dmcBitsLeft) {
-					if (dmcBytesLeft) {
-						dmcBitsLeft = 7;
-						dmc_fill_buffer();
-						dmcSilence = 0;
-					} else
-						dmcSilence = 1;
-				} else
-					dmcBitsLeft--;
-				if (!dmcSilence) {
-					if (!((dmcOutput + ((dmcShift&1) ? 2 : -2)) & 0x80))
-						dmcOutput += ((dmcShift&1) ? 2 : -2);
-				}
-				dmcShift = (dmcShift>>1);
-			}
-			dmcTemp--;
+		pulse1Temp--;
+	}
 
-		tndMixSample += tnd_table[3 * triSample + 2 * noiseSample + dmcOutput];
+	if (channelGates & 2) {
+		if (pulse2Temp < 0) {
+			pulse2Temp = pulse2Timer;
+			pulse2Duty--;
+			if (pulse2Duty < 0)
+				pulse2Duty = 15;
+		}
+		pulse2Temp--;
+	}
 
-		if (expSound)
-			expSample += (expansion_sound() / 60);
+	if ((channelGates & 4) && triLinear) {
+		if (!triTemp) {
+			triTemp = triTimer;
+			triSeq--;
+			if (triSeq < 0)
+				triSeq = 31;
+		}
+		triTemp--;
+	}
 
-		tmpcnt++;
-		if (tmpcnt == (sampleRate >> FRAC_BITS)) {
-			if (expSound)
-				sampleBuffer[sampleCounter++] = ((pulseMixSample/tmpcnt) + (tndMixSample/tmpcnt) + (expSample/tmpcnt)) / 2;
-			else
-				sampleBuffer[sampleCounter++] = (pulseMixSample/tmpcnt) + (tndMixSample/tmpcnt);
-			if (sampleCounter == bufferSize){
-				output_sound(sampleBuffer, sampleCounter);
-				sampleCounter = 0;
-			}
-			pulseMixSample = 0;
-			tndMixSample = 0;
-			expSample = 0;
-			sampleRate = (originalSampleRate + sampleRate - (tmpcnt << FRAC_BITS));
-			tmpcnt = 0;
+	if (channelGates & 8) {
+		if (!noiseTemp) {
+			noiseTemp = noiseTimer;
+			noiseShift = ((noiseShift>>1) | ((noiseMode ? ((noiseShift&1) ^ ((noiseShift>>1)&1)) : ((noiseShift&1) ^ ((noiseShift>>1)&1)))<<14));
 		}
-		ntimes--;
-		framecc++;
-		if (apucc == cpuClock)
-			apucc = 0;
-		apucc++;
+		else if (noiseOdd)
+			noiseTemp--;
 	}
 }
 
-void half_frame () {
+/* The DMC stays with the timing model, it fetches from CPU memory and raises IRQs */
+void step_dmc() {
+	uint8_t level = dmcOutput;
+	if (dmcRestart) {
+		dmcRestart = 0;
+		dmcBytesLeft = dmcLength;
+		dmcCurAdd = dmcAddress;
+	}
+	if (!dmcTemp) {
+		dmcTemp = dmcRate;
+		if (!dmcBitsLeft) {
+			if (dmcBytesLeft) {
+				dmcBitsLeft = 7;
+				dmc_fill_buffer();
+				dmcSilence = 0;
+			} else
+				dmcSilence = 1;
+		} else
+			dmcBitsLeft--;
+		if (!dmcSilence) {
+			if (!((dmcOutput + ((dmcShift&1) ? 2 : -2)) & 0x80))
+				dmcOutput += ((dmcShift&1) ? 2 : -2);
+		}
+		dmcShift = (dmcShift>>1);
+	}
+	dmcTemp--;
+	if (dmcOutput != level)
+		channel_event(&set_dmc_level, dmcOutput);
+}
+
+/* Only changes of the mixed output are passed on */
+void mix_output() {
+	float level = (pulse_table[pulse1Sample+pulse2Sample] + tnd_table[3 * triSample + 2 * noiseSample + dmcLevel]) * apuGain;
+	if (level != apuLevel && !audioSkip) {
+		blip_add_delta(&apuBuffer, apuTime, level - apuLevel);
+		apuLevel = level;
+	}
+}
+
+/* The length counters belong to the timing model, envelopes and sweeps to the channels */
+void frame_clock(uint8_t clocks) {
+	if (clocks & FRAME_HALF)
+		length_clock();
+	channel_event(&clock_channels, clocks);
+}
+
+void clock_channels(uint8_t clocks) {
+	if (clocks & FRAME_QUARTER)
+		quarter_frame();
+	if (clocks & FRAME_HALF)
+		sweep_clock();
+}
+
+void length_clock() {
 	if (pulse1Length) {
-		if (!((pulse1Control>>5)&1)) {
+		if (!(lengthHalt & 1)) {
 			pulse1Length--;
 		}
 	}
 	if (pulse2Length) {
-		if (!((pulse2Control>>5)&1))
+		if (!(lengthHalt & 2))
 			pulse2Length--;
 	}
 	if (triLength) {
-		if (!((triControl>>7)&1))
+		if (!(lengthHalt & 4))
 			triLength--;
 	}
 	if (noiseLength) {
-		if (!((noiseControl>>5)&1))
+		if (!(lengthHalt & 8))
 			noiseLength--;
 	}
+	update_gates();
+}
 
+void sweep_clock() {
 	if (!sweep1Counter && (sweep1&0x80) && !pulse1Mute && sweep1Shift) {
 		pulse1Timer += pulse1Change;
 	}
@@ -300,8 +551,6 @@ void half_frame () {
 		sweep2Reload = 0;
 	} else
 		sweep2Counter--;
-
-
 }
 
 void dmc_fill_buffer () {
@@ -378,38 +627,306 @@ void quarter_frame () {
 		triLinReload = 0;
 }
 
-/*
-float createLowpass (final int order, final float fc, float fs) {
-    float cutoff = fc / fs;
-    float fir[order + 1];
-    float factor = 2.0 * cutoff;
-    int half = order >> 1;
-    for(int i = 0; i < fir.length; i++)
-    {
-        fir[i] = factor * sinc(factor * (i - half));
-    }
-    return fir;
-}
-
-float sinc(float x)
-{
-    if(x != 0)
-    {
-        float xpi = Math.PI * x;
-        return Math.sin(xpi) / xpi;
-    }
-    return 1.0;
-}
-
-float[] windowBlackman(float fir)
-{
-    int m = fir.length - 1;
-    for(int i = 0; i < fir.length; i++)
-    {
-        fir[i] *= 0.42
-            - 0.5 * Math.cos(2.0 * Math.PI * i / m)
-            + 0.08 * Math.cos(4.0 * Math.PI * i / m);
-    }
-    return fir;
-}
-*/
+/* CPU side of the $4000-$4017 writes, the channel part follows on the channels' timeline */
+void write_apu_register(uint16_t address, uint8_t value) {
+	switch (address) {
+	case 0x4000: /* Pulse 1 duty, envel., volume */
+		lengthHalt = (lengthHalt & ~1) | ((value & 0x20) ? 1 : 0);
+		break;
+	case 0x4003: /* Pulse 1 length counter, timer high */
+		if (apuStatus & 1)
+			pulse1Length = lengthTable[((value >> 3) & 0x1f)];
+		update_gates();
+		break;
+	case 0x4004: /* Pulse 2 duty, envel., volume */
+		lengthHalt = (lengthHalt & ~2) | ((value & 0x20) ? 2 : 0);
+		break;
+	case 0x4007: /* Pulse 2 length counter, timer high */
+		if (apuStatus & 2)
+			pulse2Length = lengthTable[((value >> 3) & 0x1f)];
+		update_gates();
+		break;
+	case 0x4008: /* Triangle misc. */
+		lengthHalt = (lengthHalt & ~4) | ((value & 0x80) ? 4 : 0);
+		break;
+	case 0x400b: /* Triangle length, timer high */
+		if (apuStatus & 4)
+			triLength = lengthTable[((value >> 3) & 0x1f)];
+		update_gates();
+		break;
+	case 0x400c: /* Noise misc. */
+		lengthHalt = (lengthHalt & ~8) | ((value & 0x20) ? 8 : 0);
+		break;
+	case 0x400f: /* Noise length counter */
+		if (apuStatus & 8)
+			noiseLength = lengthTable[((value >> 3) & 0x1f)];
+		update_gates();
+		break;
+	case 0x4010: /* DMC IRQ, loop, freq. */
+		dmcControl = value;
+		dmcRate = dmcRateTable[currentMachine->audioCard][(dmcControl & 0xf)];
+		dmcTemp = dmcRate;
+		if (!(dmcControl & 0x80)) {
+			dmcInt = 0;
+		}
+		break;
+	case 0x4011: /* DMC load counter */
+		dmcOutput = (value & 0x7f);
+		channel_event(&set_dmc_level, dmcOutput);
+		break;
+	case 0x4012: /* DMC sample address */
+		dmcAddress = (0xc000 + (value << 6));
+		dmcCurAdd = dmcAddress;
+		break;
+	case 0x4013: /* DMC sample length */
+		dmcLength = ((value << 4) + 1);
+		break;
+	case 0x4015: /* APU status */
+		dmcInt = 0;
+		apuStatus = value;
+		if (!(apuStatus & 0x01))
+			pulse1Length = 0;
+		if (!(apuStatus & 0x02))
+			pulse2Length = 0;
+		if (!(apuStatus & 0x04))
+			triLength = 0;
+		if (!(apuStatus & 0x08))
+			noiseLength = 0;
+		if (!(apuStatus & 0x10)) {
+			dmcBytesLeft = 0;
+			dmcSilence = 1;
+		} else if (apuStatus & 0x10) {
+			if (!dmcBytesLeft)
+				dmcRestart = 1;
+		}
+		update_gates();
+		break;
+	case 0x4017: /* APU frame counter */
+		frameWrite = 1;
+		frameWriteDelay = 2 + (apucc % 2);
+		apuFrameCounter = value;
+		break;
+	}
+	if (address < 0x4010)
+		channel_write(address, value);
+}
+
+void write_channel_register(uint16_t address, uint8_t value) {
+	switch (address) {
+	case 0x4000: /* Pulse 1 duty, envel., volume */
+		pulse1Control = value;
+		env1Divide = (pulse1Control & 0xf);
+		break;
+	case 0x4001: /* Pulse 1 sweep, period, negate, shift */
+		sweep1 = value;
+		sweep1Divide = ((sweep1 >> 4) & 7);
+		sweep1Shift = (sweep1 & 7);
+		sweep1Reload = 1;
+		break;
+	case 0x4002: /* Pulse 1 timer low */
+		pulse1Timer = (pulse1Timer & 0x700) | value;
+		break;
+	case 0x4003: /* Pulse 1 length counter, timer high */
+		pulse1Timer = (pulse1Timer & 0xff) | ((value & 7) << 8);
+		env1Start = 1;
+		pulse1Duty = 0;
+		break;
+	case 0x4004: /* Pulse 2 duty, envel., volume */
+		pulse2Control = value;
+		env2Divide = (pulse2Control & 0xf);
+		break;
+	case 0x4005: /* Pulse 2 sweep, period, negate, shift */
+		sweep2 = value;
+		sweep2Divide = ((sweep2 >> 4) & 7);
+		sweep2Shift = (sweep2 & 7);
+		sweep2Reload = 1;
+		break;
+	case 0x4006: /* Pulse 2 timer low */
+		pulse2Timer = (pulse2Timer & 0x700) | value;
+		break;
+	case 0x4007: /* Pulse 2 length counter, timer high */
+		pulse2Timer = (pulse2Timer & 0xff) | ((value & 7) << 8);
+		env2Start = 1;
+		pulse2Duty = 0;
+		break;
+	case 0x4008: /* Triangle misc. */
+		triControl = value;
+		break;
+	case 0x400a: /* Triangle timer low */
+		triTimer = (triTimer & 0x700) | value;
+		break;
+	case 0x400b: /* Triangle length, timer high */
+		if (channelGates & 0x40)
+			triLinReload = 1;
+		triTimer = (triTimer & 0xff) | ((value & 7) << 8);
+		break;
+	case 0x400c: /* Noise misc. */
+		noiseControl = value;
+		envNoiseDivide = (noiseControl & 0xf);
+		break;
+	case 0x400e: /* Noise loop, period */
+		noiseTimer = noiseTable[(value & 0xf)];
+		noiseMode = (value & 0x80);
+		break;
+	case 0x400f: /* Noise length counter */
+		if (channelGates & 0x80)
+			envNoiseStart = 1;
+		break;
+	}
+}
+
+/* Expansion chips run with the channels, so their sound registers are written the same way */
+void apu_expansion_write(void (*write)(uint16_t, uint8_t), uint16_t address, uint8_t value) {
+	if (soundThreadRunning) {
+		sound_post_register(&channelCycles, write, address, value);
+		channelCycles = 0;
+	} else
+		(*write)(address, value);
+}
+
+void channel_write(uint16_t address, uint8_t value) {
+	apu_expansion_write(&write_channel_register, address, value);
+}
+
+/* hands a change to the channels, on the sound thread it is queued behind the cycles run so far */
+void channel_event(void (*event)(uint8_t), uint8_t value) {
+	if (soundThreadRunning) {
+		sound_post(&channelCycles, event, value);
+		channelCycles = 0;
+	} else
+		(*event)(value);
+}
+
+uint8_t current_gates() {
+	return ((apuStatus & 0x0f) << 4) | (pulse1Length && (apuStatus & 1)) | ((pulse2Length && (apuStatus & 2)) << 1)
+			| ((triLength && (apuStatus & 4)) << 2) | ((noiseLength && (apuStatus & 8)) << 3);
+}
+
+void update_gates() {
+	uint8_t gates = current_gates();
+	if (gates != postedGates) {
+		postedGates = gates;
+		channel_event(&set_gates, gates);
+	}
+}
+
+void set_gates(uint8_t gates) {
+	channelGates = gates;
+}
+
+void set_dmc_level(uint8_t level) {
+	dmcLevel = level;
+}
+
+void seed_noise(uint8_t seed) {
+	noiseShift = seed;
+}
+
+/* power on: channels silenced, the noise shift register seeded */
+void reset_apu() {
+	apuStatus = 0;
+	dmcOutput = 0;
+	update_gates();
+	channel_event(&set_dmc_level, dmcOutput);
+	channel_event(&seed_noise, 1);
+}
+
+/* lets the sound thread catch up with the timing model and go idle, the channels can be touched afterwards */
+void apu_flush() {
+	if (!soundThreadRunning)
+		return;
+	sound_post(&channelCycles, NULL, 0);
+	channelCycles = 0;
+	sound_flush();
+}
+
+/* with the channels idle, what each side keeps of the other is derived from the registers again */
+void sync_channels() {
+	lengthHalt = ((pulse1Control & 0x20) ? 1 : 0) | ((pulse2Control & 0x20) ? 2 : 0) | ((triControl & 0x80) ? 4 : 0)
+			| ((noiseControl & 0x20) ? 8 : 0);
+	postedGates = channelGates = current_gates();
+	dmcLevel = dmcOutput;
+}
+
+/* Channel and sequencer state; the output levels stay as they are so the
+ * sample stream continues without a jump */
+void apu_state(struct stateBuffer *state) {
+	STATE(state, apuStatus);
+	STATE(state, apuFrameCounter);
+	STATE(state, pulse1Length);
+	STATE(state, pulse2Length);
+	STATE(state, pulse1Control);
+	STATE(state, pulse2Control);
+	STATE(state, sweep1Divide);
+	STATE(state, sweep1Reload);
+	STATE(state, sweep1Shift);
+	STATE(state, sweep1);
+	STATE(state, sweep2Divide);
+	STATE(state, sweep2Reload);
+	STATE(state, sweep2Shift);
+	STATE(state, sweep2);
+	STATE(state, env1Start);
+	STATE(state, env2Start);
+	STATE(state, envNoiseStart);
+	STATE(state, env1Divide);
+	STATE(state, env2Divide);
+	STATE(state, envNoiseDivide);
+	STATE(state, triLength);
+	STATE(state, triLinReload);
+	STATE(state, triControl);
+	STATE(state, noiseLength);
+	STATE(state, noiseMode);
+	STATE(state, noiseControl);
+	STATE(state, dmcOutput);
+	STATE(state, dmcControl);
+	STATE(state, dmcInt);
+	STATE(state, frameInt);
+	STATE(state, frameWriteDelay);
+	STATE(state, frameWrite);
+	STATE(state, dmcRestart);
+	STATE(state, dmcSilence);
+	STATE(state, pulse1Duty);
+	STATE(state, pulse2Duty);
+	STATE(state, pulse1Timer);
+	STATE(state, pulse2Timer);
+	STATE(state, triTimer);
+	STATE(state, noiseShift);
+	STATE(state, noiseTimer);
+	STATE(state, dmcRate);
+	STATE(state, dmcAddress);
+	STATE(state, dmcCurAdd);
+	STATE(state, dmcLength);
+	STATE(state, dmcBytesLeft);
+	STATE(state, dmcTemp);
+	STATE(state, apucc);
+	STATE(state, frameCounter);
+	STATE(state, sweep1Counter);
+	STATE(state, sweep2Counter);
+	STATE(state, env1Decay);
+	STATE(state, env2Decay);
+	STATE(state, envNoiseDecay);
+	STATE(state, triLinear);
+	STATE(state, dmcBitsLeft);
+	STATE(state, dmcShift);
+	STATE(state, pulse1Mute);
+	STATE(state, pulse2Mute);
+	STATE(state, triSeq);
+	STATE(state, triBuff);
+	STATE(state, triTemp);
+	STATE(state, noiseTemp);
+	STATE(state, framecc);
+	STATE(state, pulse1Sample);
+	STATE(state, pulse2Sample);
+	STATE(state, triSample);
+	STATE(state, noiseSample);
+	STATE(state, pulse1Temp);
+	STATE(state, pulse2Temp);
+	STATE(state, pulse1Change);
+	STATE(state, pulse2Change);
+	for (int i = 0; i < expansionCount; i++)
+		STATE(state, expansions[i].phase);
+	if (state->loading) {
+		channelCycles = 0;
+		sync_channels();
+	}
+}
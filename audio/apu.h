@@ -2,6 +2,8 @@
 #define APU_H_
 #include <stdint.h>
 
+#define APU_MAX_EXPANSIONS	2
+
 typedef enum apu_version {
 	APU_NTSC = 0,
 	APU_PAL	= 1
@@ -19,6 +21,12 @@ extern const uint16_t noiseTable[0x10], dmcRateTable[0x02][0x10];
 extern const uint8_t lengthTable[0x20];
 extern uint32_t frameIrqDelay, apucc, frameIrqTime;
 extern const int samplesPerSecond;
-void run_apu(uint16_t), dmc_fill_buffer(void), quarter_frame(void), half_frame(void), init_apu(int), set_timings_apu(int, int);
+struct stateBuffer;
+void apu_state(struct stateBuffer *);
+void run_apu(uint16_t), dmc_fill_buffer(void), quarter_frame(void), init_apu(int), set_timings_apu(int, int), reset_apu(void),
+	 write_apu_register(uint16_t, uint8_t), apu_add_expansion(void (*)(uint32_t), uint16_t, float), apu_expansion_output(uint32_t, int),
+	 apu_expansion_write(void (*)(uint16_t, uint8_t), uint16_t, uint8_t), apu_flush(void);
+/* the sound thread's chip when the channels run there */
+void run_apu_channels(int);
 
 #endif
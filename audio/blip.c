@@ -0,0 +1,104 @@
+/* Band-limited synthesis buffer
+ *
+ * Sound chips only report when their output level changes. Every change is
+ * added as a windowed sinc impulse at its exact sub-sample position, and the
+ * impulses are integrated back into a waveform when samples are read out.
+ * This replaces point sampling/box averaging, which aliases badly for the
+ * square waves most of the emulated chips produce.
+ *
+ * TODO:
+ * -stereo
+ */
+
+#include "blip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TIME_BITS	32
+#define CUTOFF		0.90	/* fraction of the output Nyquist frequency */
+
+static float kernel[BLIP_PHASES][BLIP_TAPS];
+static uint8_t kernelReady = 0;
+static inline void init_kernel(void);
+
+void init_blip(struct blipBuffer *buffer, int size){
+	if(!kernelReady)
+		init_kernel();
+	if(buffer->samples)
+		free(buffer->samples);
+	buffer->size = size;
+	buffer->samples = calloc(size + BLIP_TAPS, sizeof(float));
+	if(!buffer->samples){
+		printf("Error: could not allocate blip buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	buffer->offset = 0;
+	buffer->integrator = 0;
+}
+
+void close_blip(struct blipBuffer *buffer){
+	free(buffer->samples);
+	buffer->samples = NULL;
+}
+
+void set_timings_blip(struct blipBuffer *buffer, double clock, double rate){
+	buffer->nominal = buffer->factor = (uint64_t)((rate / clock) * ((uint64_t)1 << TIME_BITS));
+}
+
+/* stretches the output rate by ratio, for small corrections only */
+void blip_set_ratio(struct blipBuffer *buffer, double ratio){
+	buffer->factor = (uint64_t)(buffer->nominal * ratio);
+}
+
+/* time is counted in input clocks since the last blip_end_frame */
+void blip_add_delta(struct blipBuffer *buffer, uint32_t time, float delta){
+	uint64_t position = buffer->offset + (uint64_t)time * buffer->factor;
+	uint32_t index = (position >> TIME_BITS);
+	float *kern = kernel[(position >> (TIME_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+	if(index >= buffer->size) /* not read out in time */
+		return;
+	float *out = &buffer->samples[index];
+	for(int i = 0; i < BLIP_TAPS; i++)
+		out[i] += delta * kern[i];
+}
+
+void blip_end_frame(struct blipBuffer *buffer, uint32_t time){
+	buffer->offset += (uint64_t)time * buffer->factor;
+}
+
+int blip_samples_avail(struct blipBuffer *buffer){
+	return (buffer->offset >> TIME_BITS);
+}
+
+int blip_read_samples(struct blipBuffer *buffer, float *out, int count){
+	int avail = blip_samples_avail(buffer);
+	if(count > avail)
+		count = avail;
+	for(int i = 0; i < count; i++){
+		buffer->integrator += buffer->samples[i];
+		out[i] = buffer->integrator;
+	}
+	memmove(buffer->samples, &buffer->samples[count], (buffer->size + BLIP_TAPS - count) * sizeof(float));
+	memset(&buffer->samples[buffer->size + BLIP_TAPS - count], 0, count * sizeof(float));
+	buffer->offset -= ((uint64_t)count << TIME_BITS);
+	return count;
+}
+
+/* Blackman windowed sinc, one set of taps per sub-sample phase, each normalized to unity gain */
+void init_kernel(){
+	for(int p = 0; p < BLIP_PHASES; p++){
+		double sum = 0, taps[BLIP_TAPS];
+		for(int i = 0; i < BLIP_TAPS; i++){
+			double t = (i - (BLIP_TAPS / 2 - 1)) - ((double)p / BLIP_PHASES);
+			double x = M_PI * CUTOFF * t;
+			double window = 0.42 + 0.5 * cos(M_PI * t / (BLIP_TAPS / 2)) + 0.08 * cos(2 * M_PI * t / (BLIP_TAPS / 2));
+			taps[i] = (x ? sin(x) / x : 1.0) * window;
+			sum += taps[i];
+		}
+		for(int i = 0; i < BLIP_TAPS; i++)
+			kernel[p][i] = (float)(taps[i] / sum);
+	}
+	kernelReady = 1;
+}
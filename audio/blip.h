@@ -0,0 +1,24 @@
+#ifndef BLIP_H_
+#define BLIP_H_
+
+#include <stdint.h>
+
+#define BLIP_PHASE_BITS	6
+#define BLIP_PHASES		(1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS		16
+
+struct blipBuffer {
+	float *samples;		/* band-limited impulses, integrated when read */
+	int size;			/* output samples that can be pending */
+	uint64_t factor;	/* output samples per input clock, 32.32 fixed point */
+	uint64_t nominal;	/* factor before rate control */
+	uint64_t offset;	/* position of input clock 0, 32.32 fixed point */
+	float integrator;
+};
+
+/* clock and rate only need to share a unit, set_timings_blip uses their ratio */
+void init_blip(struct blipBuffer *, int), close_blip(struct blipBuffer *), set_timings_blip(struct blipBuffer *, double, double),
+	 blip_add_delta(struct blipBuffer *, uint32_t, float), blip_end_frame(struct blipBuffer *, uint32_t), blip_set_ratio(struct blipBuffer *, double);
+int blip_samples_avail(struct blipBuffer *), blip_read_samples(struct blipBuffer *, float *, int);
+
+#endif /* BLIP_H_ */
@@ -0,0 +1,195 @@
+/* Audio mixer
+ *
+ * Chips hand over blocks at the output rate whenever their resamplers fill up,
+ * so the streams arrive in different chunk sizes. Each source is staged
+ * until all sources that are producing have a sample for the same position,
+ * then the sum goes into a single producer/single consumer ring. The audio
+ * callback pulls from the ring on its own thread, no locks are taken.
+ */
+
+#include "mixer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEVIATION	0.005	/* rate control stays within this fraction of the nominal rate */
+#define FILL_SMOOTHING	0.05
+
+struct source {
+	float *staging;
+	int count;
+	uint8_t active;		/* has written, only active sources hold back the mix */
+};
+
+atomic_uint mixerUnderruns = 0, mixerOverruns = 0;
+double mixerRatio = 1;
+float mixerFill = 0;
+uint8_t audioSkip = 0;
+static struct source sources[MIXER_MAX_SOURCES];
+static int sourceCount = 0, stagingSize = 0;
+static float *ring = NULL, *mixBuffer = NULL, lastSample = 0, mixGain = 1;
+static uint8_t primed = 0; /* consumer side, set once the ring has filled up to the target */
+static unsigned ringSize = 0, ringTarget = 0; /* fill the rate control steers to and playback restarts at */
+static atomic_uint ringHead = 0, ringTail = 0; /* written by producer / consumer only */
+static inline void mix_sources(int), ring_write(float *, int), update_ratio(unsigned);
+
+/* size is the largest block a source writes at once */
+void init_mixer(int size){
+	close_mixer();
+	stagingSize = size << 1;
+	for(ringSize = 1; ringSize < (unsigned)(size << 2); ringSize <<= 1);
+	/* the device pulls half a block per callback, a block on top covers a late frame */
+	ringTarget = size;
+	ring = calloc(ringSize, sizeof(float));
+	mixBuffer = malloc(stagingSize * sizeof(float));
+	if(!ring || !mixBuffer){
+		printf("Error: could not allocate mixer buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	atomic_store(&ringHead, 0);
+	atomic_store(&ringTail, 0);
+	atomic_store(&mixerUnderruns, 0);
+	atomic_store(&mixerOverruns, 0);
+	lastSample = 0;
+	primed = 0;
+	mixerRatio = 1;
+	mixerFill = ringTarget;
+}
+
+void close_mixer(){
+	for(int i = 0; i < sourceCount; i++)
+		free(sources[i].staging);
+	sourceCount = 0;
+	mixGain = 1;
+	free(ring);
+	free(mixBuffer);
+	ring = mixBuffer = NULL;
+}
+
+int mixer_add_source(){
+	if(sourceCount == MIXER_MAX_SOURCES){
+		printf("Error: too many mixer sources\n");
+		exit(EXIT_FAILURE);
+	}
+	struct source *src = &sources[sourceCount];
+	src->staging = malloc(stagingSize * sizeof(float));
+	if(!src->staging){
+		printf("Error: could not allocate mixer buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	src->count = 0;
+	src->active = 0;
+	/* every source can reach full scale at once, the sum has to fit as well */
+	mixGain = 1.0f / (sourceCount + 1);
+	return sourceCount++;
+}
+
+void mixer_write(int source, float *buffer, int count){
+	struct source *src = &sources[source];
+	src->active = 1;
+	if(src->count + count > stagingSize){
+		/* the other sources stopped producing, mix without them */
+		mix_sources(src->count);
+	}
+	memcpy(&src->staging[src->count], buffer, count * sizeof(float));
+	src->count += count;
+
+	int ready = stagingSize;
+	for(int i = 0; i < sourceCount; i++){
+		if(sources[i].active && sources[i].count < ready)
+			ready = sources[i].count;
+	}
+	if(ready)
+		mix_sources(ready);
+}
+
+/* sums count samples of every source scaled by the headroom, sources running short contribute silence */
+void mix_sources(int count){
+	memset(mixBuffer, 0, count * sizeof(float));
+	for(int i = 0; i < sourceCount; i++){
+		struct source *src = &sources[i];
+		int n = (src->count < count) ? src->count : count;
+		for(int j = 0; j < n; j++)
+			mixBuffer[j] += src->staging[j];
+		src->count -= n;
+		memmove(src->staging, &src->staging[n], src->count * sizeof(float));
+	}
+	for(int j = 0; j < count; j++){
+		mixBuffer[j] *= mixGain;
+		if(mixBuffer[j] > 1)
+			mixBuffer[j] = 1;
+		else if(mixBuffer[j] < -1)
+			mixBuffer[j] = -1;
+	}
+	ring_write(mixBuffer, count);
+}
+
+void ring_write(float *buffer, int count){
+	unsigned head = atomic_load_explicit(&ringHead, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ringTail, memory_order_acquire);
+	unsigned space = ringSize - (head - tail);
+	update_ratio(head - tail);
+	if((unsigned)count > space){
+		atomic_fetch_add(&mixerOverruns, 1);
+		count = space;
+	}
+	for(int i = 0; i < count; i++)
+		ring[(head + i) & (ringSize - 1)] = buffer[i];
+	atomic_store_explicit(&ringHead, head + count, memory_order_release);
+}
+
+/* called from the audio thread */
+void mixer_read(float *buffer, int count){
+	unsigned tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ringHead, memory_order_acquire);
+	unsigned avail = head - tail;
+	if(!primed && avail < ringTarget){
+		for(int i = 0; i < count; i++)
+			buffer[i] = lastSample;
+		return;
+	}
+	primed = 1;
+	int n = ((unsigned)count > avail) ? (int)avail : count;
+	for(int i = 0; i < n; i++)
+		buffer[i] = ring[(tail + i) & (ringSize - 1)];
+	atomic_store_explicit(&ringTail, tail + n, memory_order_release);
+	if(n)
+		lastSample = buffer[n - 1];
+	if(n < count){
+		/* hold the last level instead of dropping to zero, avoids a click */
+		atomic_fetch_add(&mixerUnderruns, 1);
+		primed = 0;
+		for(int i = n; i < count; i++)
+			buffer[i] = lastSample;
+	}
+}
+
+/* takes what is in the ring without priming, for consumers that are not paced by a device */
+int mixer_drain(float *buffer, int count){
+	unsigned tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ringHead, memory_order_acquire);
+	int n = ((unsigned)count > head - tail) ? (int)(head - tail) : count;
+	for(int i = 0; i < n; i++)
+		buffer[i] = ring[(tail + i) & (ringSize - 1)];
+	atomic_store_explicit(&ringTail, tail + n, memory_order_release);
+	return n;
+}
+
+/* Dynamic rate control: the host audio clock and the emulated clock never match
+ * exactly, so chips produce slightly more or fewer samples than the device
+ * consumes. Steering the resampling ratio by the ring fill keeps the ring near
+ * the target fill without dropping or repeating blocks. */
+void update_ratio(unsigned fill){
+	float target = ringTarget;
+	mixerFill += (fill - mixerFill) * FILL_SMOOTHING;
+	mixerRatio = 1 - MAX_DEVIATION * ((mixerFill - target) / target);
+	if(mixerRatio > 1 + MAX_DEVIATION)
+		mixerRatio = 1 + MAX_DEVIATION;
+	else if(mixerRatio < 1 - MAX_DEVIATION)
+		mixerRatio = 1 - MAX_DEVIATION;
+}
+
+/* samples waiting in the ring */
+int mixer_fill(){
+	return atomic_load(&ringHead) - atomic_load(&ringTail);
+}
@@ -0,0 +1,19 @@
+#ifndef MIXER_H_
+#define MIXER_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define MIXER_MAX_SOURCES	4
+
+extern atomic_uint mixerUnderruns, mixerOverruns;
+extern double mixerRatio;	/* output rate correction chips apply to their resamplers */
+extern float mixerFill;		/* smoothed ring fill, in samples */
+extern uint8_t audioSkip;	/* frames are run ahead, chips neither output nor advance their buffers */
+
+/* every chip adds a source at init and writes its resampled output to it,
+ * the mixer sums all sources sample by sample into a ring the audio callback drains */
+void init_mixer(int), close_mixer(void), mixer_write(int, float *, int), mixer_read(float *, int);
+int mixer_add_source(void), mixer_fill(void), mixer_drain(float *, int);
+
+#endif /* MIXER_H_ */
@@ -0,0 +1,147 @@
+/* Polyphase FIR resampler
+ *
+ * Takes one input sample per chip clock and produces output at the host rate
+ * through a Blackman windowed sinc low pass. The filter is precomputed for
+ * RESAMPLER_PHASES sub-sample offsets, so every output sample is a single dot
+ * product over the most recent inputs. Each chip owns its own instance.
+ *
+ * TODO:
+ * -stereo
+ */
+
+#include "resampler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#define TIME_BITS	32
+#define CUTOFF		0.90	/* fraction of the output Nyquist frequency */
+#define TAP_ALIGN	8		/* taps are padded to a whole number of vectors */
+
+static inline float dot_product(const float *, const float *, int);
+static inline void build_kernel(struct resampler *, double);
+
+void init_resampler(struct resampler *resampler, int size, Resampler_Quality quality){
+	close_resampler(resampler);
+	resampler->size = size;
+	resampler->quality = quality;
+	resampler->samples = malloc(size * sizeof(float));
+	if(!resampler->samples){
+		printf("Error: could not allocate resampler buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	resampler->count = 0;
+	resampler->taps = 0;
+	resampler->nominal = resampler->step = (uint64_t)1 << TIME_BITS;
+	resampler->time = 0;
+}
+
+void close_resampler(struct resampler *resampler){
+	free(resampler->samples);
+	free(resampler->history);
+	free(resampler->kernel);
+	resampler->samples = resampler->history = resampler->kernel = NULL;
+}
+
+void set_timings_resampler(struct resampler *resampler, double clock, double rate){
+	double ratio = clock / rate;
+	resampler->nominal = resampler->step = (uint64_t)(ratio * ((uint64_t)1 << TIME_BITS));
+	build_kernel(resampler, (ratio > 1 ? (1 / ratio) : 1) * CUTOFF);
+}
+
+/* stretches the output rate by ratio, small enough to keep the kernel as it is */
+void resampler_set_ratio(struct resampler *resampler, double ratio){
+	resampler->step = (uint64_t)(resampler->nominal / ratio);
+}
+
+void resampler_add_sample(struct resampler *resampler, float sample){
+	int taps = resampler->taps;
+	resampler->history[resampler->head] = resampler->history[resampler->head + taps] = sample;
+	if(++resampler->head == taps)
+		resampler->head = 0;
+	resampler->time += (uint64_t)1 << TIME_BITS;
+	while(resampler->time >= resampler->step){
+		resampler->time -= resampler->step;
+		if(resampler->count == resampler->size) /* not read out in time */
+			continue;
+		/* time is now how far the newest input lies past the output sample */
+		float *kern = &resampler->kernel[(resampler->time >> (TIME_BITS - RESAMPLER_PHASE_BITS)) * taps];
+		resampler->samples[resampler->count++] = dot_product(kern, &resampler->history[resampler->head], taps);
+	}
+}
+
+int resampler_samples_avail(struct resampler *resampler){
+	return resampler->count;
+}
+
+int resampler_read_samples(struct resampler *resampler, float *out, int count){
+	if(count > resampler->count)
+		count = resampler->count;
+	memcpy(out, resampler->samples, count * sizeof(float));
+	resampler->count -= count;
+	memmove(resampler->samples, &resampler->samples[count], resampler->count * sizeof(float));
+	return count;
+}
+
+float dot_product(const float *a, const float *b, int n){
+#ifdef __AVX__
+	__m256 sum = _mm256_setzero_ps();
+	for(int i = 0; i < n; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i])));
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	return _mm_cvtss_f32(half);
+#elif defined(__SSE__)
+	__m128 sum = _mm_setzero_ps();
+	for(int i = 0; i < n; i += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0;
+	for(int i = 0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+#endif
+}
+
+/* cutoff is relative to the input Nyquist frequency, the kernel widens as it drops */
+void build_kernel(struct resampler *resampler, double cutoff){
+	int taps = (int)ceil(2 * resampler->quality / cutoff);
+	taps = (taps + TAP_ALIGN - 1) & ~(TAP_ALIGN - 1);
+	if(taps != resampler->taps){
+		free(resampler->history);
+		free(resampler->kernel);
+		resampler->history = calloc(taps * 2, sizeof(float));
+		resampler->kernel = malloc(RESAMPLER_PHASES * taps * sizeof(float));
+		if(!resampler->history || !resampler->kernel){
+			printf("Error: could not allocate resampler kernel\n");
+			exit(EXIT_FAILURE);
+		}
+		resampler->taps = taps;
+		resampler->head = 0;
+	}
+	double *coeffs = malloc(taps * sizeof(double));
+	for(int p = 0; p < RESAMPLER_PHASES; p++){
+		double sum = 0;
+		for(int i = 0; i < taps; i++){
+			/* distance of tap i (oldest first) from the output sample, in input samples */
+			double t = (i - (taps - 1) / 2.0) + ((double)p / RESAMPLER_PHASES);
+			double x = M_PI * cutoff * t;
+			double window = 0.42 + 0.5 * cos(M_PI * t / (taps / 2)) + 0.08 * cos(2 * M_PI * t / (taps / 2));
+			coeffs[i] = (fabs(t) < taps / 2) ? ((x ? sin(x) / x : 1.0) * window) : 0;
+			sum += coeffs[i];
+		}
+		for(int i = 0; i < taps; i++)
+			resampler->kernel[p * taps + i] = (float)(coeffs[i] / sum);
+	}
+	free(coeffs);
+}
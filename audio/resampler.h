@@ -0,0 +1,36 @@
+#ifndef RESAMPLER_H_
+#define RESAMPLER_H_
+
+#include <stdint.h>
+
+#define RESAMPLER_PHASE_BITS	6
+#define RESAMPLER_PHASES		(1 << RESAMPLER_PHASE_BITS)
+
+/* zero crossings of the sinc kept on each side, more is sharper and slower */
+typedef enum resampler_quality {
+	RESAMPLER_LOW = 4,
+	RESAMPLER_MEDIUM = 8,
+	RESAMPLER_HIGH = 16
+} Resampler_Quality;
+
+struct resampler {
+	float *kernel;		/* RESAMPLER_PHASES sets of taps, each normalized to unity gain */
+	float *history;		/* input ring stored twice, so the last taps are always contiguous */
+	float *samples;		/* filtered output waiting to be read */
+	int taps;
+	int head;
+	int count;			/* output samples pending */
+	int size;			/* output samples that can be pending */
+	Resampler_Quality quality;
+	uint64_t step;		/* input samples per output sample, 32.32 fixed point */
+	uint64_t nominal;	/* step before rate control */
+	uint64_t time;		/* input consumed since the last output, 32.32 fixed point */
+};
+
+/* clock and rate only need to share a unit, set_timings_resampler uses their ratio */
+void init_resampler(struct resampler *, int, Resampler_Quality), close_resampler(struct resampler *),
+	 set_timings_resampler(struct resampler *, double, double), resampler_set_ratio(struct resampler *, double),
+	 resampler_add_sample(struct resampler *, float);
+int resampler_samples_avail(struct resampler *), resampler_read_samples(struct resampler *, float *, int);
+
+#endif /* RESAMPLER_H_ */
@@ -8,56 +8,59 @@
  *
  * TODO:
  * -some writes may reset other regs..
- * -possibly use lookup tables for speed
  * -output should be unsigned, with a highpass filter applied (makes difference for samples)
  * (see discussion: https://forums.nesdev.com/viewtopic.php?f=23&t=15562)
  * sn76489.c
  *
  */
 
-#define FRAC_BITS			16
-
 #include "sn79489.h"
 #include <stdio.h>
 #include <stdint.h>
 #include "../my_sdl.h"
 #include "../sms/smsemu.h"
 #include "../video/vdp.h"
+#include "blip.h"
+#include "mixer.h"
+#include "../state.h"
+
+#define PSG_SCALE	(1.0f / (4 * 32767))	/* four channels at full volume reach 1.0 */
 
-float *sn79489_SampleBuffer, sn79489_Sample = 0;
-static uint32_t sampleRate, originalSampleRate;
-const float volume_table[16]={ .32767, .26028, .20675, .16422, .13045, .10362, .08231, .06568, //could be made integer?
-    .05193, .04125, .03277, .02603, .02067, .01642, .01304, 0 };
+float *sn79489_SampleBuffer;
+static struct blipBuffer psgBuffer;
+static const int16_t volume_table[16]={ 32767, 26028, 20675, 16422, 13045, 10362, 8231, 6568, /* 2dB steps, 1.15 fixed point */
+    5193, 4125, 3277, 2603, 2067, 1642, 1304, 0 };
 uint8_t noiseVolume, noiseRegister, currentReg, noisePhase, sn79489_mute;
-float noiseOutput;
+int16_t noiseOutput, noiseLevel;
 uint16_t noiseCounter, noiseShifter, noiseReload;
-static int origSampleCounter = 0, bufferSize;
-int psgAccumulatedCycles = 0, sn79489_SampleCounter = 0, audioCyclesToRun = 0;
+static int bufferSize, psgSource;
 struct ToneChannel tone0, tone1, tone2;
 static inline int parity(int);
-static inline void run_tone_channel(struct ToneChannel *);
+static inline void run_tone_channel(struct ToneChannel *, uint32_t), run_noise_channel(uint32_t), set_level(int16_t *, int16_t, uint32_t), lfsr_step(void), lfsr_skip(uint32_t);
 
 void init_sn79489(int buffer){
 	bufferSize = buffer;
 	if(sn79489_SampleBuffer)
 		free(sn79489_SampleBuffer);
 	sn79489_SampleBuffer = malloc(bufferSize * sizeof(float));
+	init_blip(&psgBuffer, bufferSize << 1);
+	psgSource = mixer_add_source();
 	tone0.volume = tone1.volume = tone2.volume = noiseVolume = 0xf;
 	tone0.reg = tone1.reg = tone2.reg = noiseReload = tone0.phase = tone1.phase = tone2.phase = 0;
 	tone0.output = tone1.output = tone2.output = noiseOutput = 0;
+	tone0.level = tone1.level = tone2.level = noiseLevel = 0;
 	noiseShifter = 0x8000;
 }
 
 void set_timings_sn79489(int div, int clock){
-	originalSampleRate = sampleRate = ((uint64_t)clock << FRAC_BITS) / div;
-	origSampleCounter = 0;
+	set_timings_blip(&psgBuffer, clock, div);
 }
 
 void close_sn79489(){
 	//move to smsemu
 	free(sn79489_SampleBuffer);
+	close_blip(&psgBuffer);
 }
-
 void write_sn79489(uint8_t value){
 	if(value & 0x80)
 		currentReg = (value & 0x70);
@@ -113,56 +116,129 @@ void write_sn79489(uint8_t value){
 	}
 }
 
-void run_tone_channel(struct ToneChannel *channel){
-	if(channel->counter){
-		channel->counter--;
-		if(!channel->counter){
-			channel->counter = channel->reg;
-			channel->phase ^= 1;
-		}
-		channel->output = (channel->phase ? volume_table[channel->volume] : 0);
-	} else{
+/* Output only changes on flips, so each channel jumps from one flip to the next
+ * and hands level changes to the band-limited buffer at their exact clock.
+ * A counter at zero spends one clock reloading without updating the output. */
+void run_tone_channel(struct ToneChannel *channel, uint32_t cycles){
+	uint32_t time = 0;
+	if(!channel->counter){
+		channel->counter = channel->reg;
+		if(!channel->counter)
+			return;
+		time = 1;
+		if(time == cycles)
+			return;
+	}
+	set_level(&channel->level, (channel->output = (channel->phase ? volume_table[channel->volume] : 0)), time);
+	while(time + channel->counter <= cycles){
+		time += channel->counter;
+		channel->phase ^= 1;
+		set_level(&channel->level, (channel->output = (channel->phase ? volume_table[channel->volume] : 0)), time - 1);
 		channel->counter = channel->reg;
+		if(!channel->counter)
+			return;
 	}
+	channel->counter -= (cycles - time);
 }
 
-void run_sn79489(){
-while(audioCyclesToRun){
-	run_tone_channel(&tone0);
-	run_tone_channel(&tone1);
-	run_tone_channel(&tone2);
-	if(noiseCounter){
-		noiseCounter--;
-		if(!noiseCounter){
-			noisePhase ^= 1;
-			noiseCounter = noiseReload;
-			if(noisePhase){
-				noiseOutput = ((noiseShifter & 0x01) ? volume_table[noiseVolume] : 0);
-				noiseShifter = ((noiseShifter >> 1) | (((noiseRegister & 0x04) ? parity(noiseShifter & 0x09) : (noiseShifter & 0x01)) << 15));
-			}
+void run_noise_channel(uint32_t cycles){
+	uint32_t time = 0, flips, edges;
+	if(!noiseCounter){
+		noiseCounter = noiseReload;
+		if(!noiseCounter)
+			return;
+		time = 1;
+	}
+	if(!noiseLevel && noiseReload && (sn79489_mute || !volume_table[noiseVolume]) && (time + noiseCounter <= cycles)){
+		/* silent, only the shift register has to keep up */
+		flips = 1 + (cycles - time - noiseCounter) / noiseReload;
+		edges = (flips + !noisePhase) >> 1;
+		noiseCounter = noiseReload - (cycles - time - noiseCounter) % noiseReload;
+		noisePhase ^= (flips & 1);
+		if(edges){
+			lfsr_skip(edges - 1);
+			noiseOutput = ((noiseShifter & 0x01) ? volume_table[noiseVolume] : 0);
+			lfsr_step();
 		}
+		return;
 	}
-	else
+	while(time + noiseCounter <= cycles){
+		time += noiseCounter;
+		noisePhase ^= 1;
 		noiseCounter = noiseReload;
-	if(!sn79489_mute)
-		sn79489_Sample += ((tone0.output + tone1.output + tone2.output + noiseOutput) / (4*volume_table[0])); /* TODO: less hackish */
-	else
-		sn79489_Sample += 0;
-
-	//move this to smsemu?
-	origSampleCounter++;
-	if(origSampleCounter == (sampleRate >> FRAC_BITS)){
-		sn79489_SampleBuffer[sn79489_SampleCounter++] = (float)(sn79489_Sample / origSampleCounter);
-		if(sn79489_SampleCounter == bufferSize){
-			output_sound(sn79489_SampleBuffer, sn79489_SampleCounter);
-			sn79489_SampleCounter = 0;
+		if(noisePhase){
+			set_level(&noiseLevel, (noiseOutput = ((noiseShifter & 0x01) ? volume_table[noiseVolume] : 0)), time - 1);
+			lfsr_step();
 		}
-		sampleRate = originalSampleRate + sampleRate - (origSampleCounter << FRAC_BITS);
-		sn79489_Sample = 0;
-		origSampleCounter = 0;
+		if(!noiseCounter)
+			return;
 	}
-	audioCyclesToRun--;
+	noiseCounter -= (cycles - time);
 }
+
+void set_level(int16_t *level, int16_t output, uint32_t time){
+	if(audioSkip)
+		return;
+	if(sn79489_mute)
+		output = 0;
+	if(output != *level){
+		blip_add_delta(&psgBuffer, time, (output - *level) * PSG_SCALE);
+		*level = output;
+	}
+}
+
+void lfsr_step(){
+	noiseShifter = ((noiseShifter >> 1) | (((noiseRegister & 0x04) ? parity(noiseShifter & 0x09) : (noiseShifter & 0x01)) << 15));
+}
+
+/* Eight steps at once: the bits fed back during them all come from the low byte and bits 8-10 */
+void lfsr_skip(uint32_t steps){
+	for(; steps >= 8; steps -= 8)
+		noiseShifter = ((noiseShifter >> 8) | ((((noiseRegister & 0x04) ? (noiseShifter ^ (noiseShifter >> 3)) : noiseShifter) & 0xff) << 8));
+	while(steps--)
+		lfsr_step();
+}
+
+void run_sn79489(int cycles){
+	if(!cycles)
+		return;
+	/* muting applies from the start of the run, as the chip state is */
+	set_level(&tone0.level, tone0.output, 0);
+	set_level(&tone1.level, tone1.output, 0);
+	set_level(&tone2.level, tone2.output, 0);
+	set_level(&noiseLevel, noiseOutput, 0);
+	run_tone_channel(&tone0, cycles);
+	run_tone_channel(&tone1, cycles);
+	run_tone_channel(&tone2, cycles);
+	run_noise_channel(cycles);
+	if(audioSkip)
+		return;
+	blip_end_frame(&psgBuffer, cycles);
+	if(blip_samples_avail(&psgBuffer) >= bufferSize){
+		blip_read_samples(&psgBuffer, sn79489_SampleBuffer, bufferSize);
+		mixer_write(psgSource, sn79489_SampleBuffer, bufferSize);
+		blip_set_ratio(&psgBuffer, mixerRatio);
+	}
+}
+
+/* Registers and counters; each channel keeps its output level so the sample stream has no jump */
+void sn79489_state(struct stateBuffer *state){
+	struct ToneChannel *tones[3] = { &tone0, &tone1, &tone2 };
+	for(int i = 0; i < 3; i++){
+		STATE(state, tones[i]->reg);
+		STATE(state, tones[i]->counter);
+		STATE(state, tones[i]->phase);
+		STATE(state, tones[i]->volume);
+		STATE(state, tones[i]->output);
+	}
+	STATE(state, currentReg);
+	STATE(state, noiseRegister);
+	STATE(state, noiseVolume);
+	STATE(state, noisePhase);
+	STATE(state, noiseOutput);
+	STATE(state, noiseCounter);
+	STATE(state, noiseShifter);
+	STATE(state, noiseReload);
 }
 
 int parity(int val){
@@ -0,0 +1,134 @@
+/* Sound worker thread
+ *
+ * Optional mode that clocks the sound chips on their own thread. The emulation
+ * thread only counts chip clocks and queues register writes, each entry
+ * stamped with the clocks that passed since the one before. The worker replays
+ * the queue in order, so a write lands on its exact chip clock instead of on
+ * the next synchronization point, and mixing happens off the CPU thread.
+ *
+ * Only chips without readable state can be moved here. The NES APU is split:
+ * the frame counter, length counters and DMC stay on the CPU thread, where
+ * $4015 reads, IRQs and DMC fetches happen, and only the channels and the
+ * expansion chips move to the worker.
+ */
+
+#include "soundthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "SDL.h"
+
+enum { SOUND_RUN, SOUND_FLUSH, SOUND_STOP };
+
+struct soundEvent {
+	int cycles[SOUND_MAX_CHIPS];	/* chip clocks to run before the write */
+	void (*write)(uint8_t);
+	void (*writeRegister)(uint16_t, uint8_t);
+	uint16_t address;
+	uint8_t value;
+	uint8_t type;
+};
+
+uint8_t soundThreadRunning = 0;
+static struct soundEvent queue[SOUND_QUEUE_SIZE];
+static unsigned queueHead = 0, queueTail = 0; /* owned by producer / worker */
+static void (*chips[SOUND_MAX_CHIPS])(int);
+static int chipCount = 0;
+static SDL_Thread *worker = NULL;
+static SDL_sem *filled = NULL, *space = NULL, *idle = NULL;
+static int run_worker(void *);
+static inline void push_event(const int *, void (*)(uint8_t), void (*)(uint16_t, uint8_t), uint16_t, uint8_t, uint8_t);
+
+int sound_add_chip(void (*run)(int)){
+	if(chipCount == SOUND_MAX_CHIPS){
+		printf("Error: too many sound chips for the worker thread\n");
+		exit(EXIT_FAILURE);
+	}
+	chips[chipCount] = run;
+	return chipCount++;
+}
+
+void init_sound_thread(){
+	queueHead = queueTail = 0;
+	filled = SDL_CreateSemaphore(0);
+	space = SDL_CreateSemaphore(SOUND_QUEUE_SIZE);
+	idle = SDL_CreateSemaphore(0);
+	if(!filled || !space || !idle){
+		printf("Error: could not create sound thread semaphores: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	worker = SDL_CreateThread(run_worker, "sound", NULL);
+	if(!worker){
+		printf("Error: could not create sound thread: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	soundThreadRunning = 1;
+}
+
+/* lets the worker drain the queue, pending writes are still applied */
+void close_sound_thread(){
+	if(soundThreadRunning){
+		push_event(NULL, NULL, NULL, 0, 0, SOUND_STOP);
+		SDL_WaitThread(worker, NULL);
+		SDL_DestroySemaphore(filled);
+		SDL_DestroySemaphore(space);
+		SDL_DestroySemaphore(idle);
+		worker = NULL;
+		filled = space = idle = NULL;
+		soundThreadRunning = 0;
+	}
+	chipCount = 0;
+}
+
+/* blocks until the worker has caught up, chip state can be touched afterwards */
+void sound_flush(){
+	if(!soundThreadRunning)
+		return;
+	push_event(NULL, NULL, NULL, 0, 0, SOUND_FLUSH);
+	SDL_SemWait(idle);
+}
+
+/* called from the emulation thread only, write may be NULL to just advance time */
+void sound_post(const int *cycles, void (*write)(uint8_t), uint8_t value){
+	push_event(cycles, write, NULL, 0, value, SOUND_RUN);
+}
+
+void sound_post_register(const int *cycles, void (*write)(uint16_t, uint8_t), uint16_t address, uint8_t value){
+	push_event(cycles, NULL, write, address, value, SOUND_RUN);
+}
+
+void push_event(const int *cycles, void (*write)(uint8_t), void (*writeRegister)(uint16_t, uint8_t), uint16_t address, uint8_t value, uint8_t type){
+	struct soundEvent *event;
+	SDL_SemWait(space); /* worker is a full queue behind, wait for it */
+	event = &queue[queueHead & (SOUND_QUEUE_SIZE - 1)];
+	for(int i = 0; i < chipCount; i++)
+		event->cycles[i] = cycles ? cycles[i] : 0;
+	event->write = write;
+	event->writeRegister = writeRegister;
+	event->address = address;
+	event->value = value;
+	event->type = type;
+	queueHead++;
+	SDL_SemPost(filled);
+}
+
+int run_worker(void *data){
+	struct soundEvent event;
+	while(1){
+		SDL_SemWait(filled);
+		event = queue[queueTail & (SOUND_QUEUE_SIZE - 1)];
+		queueTail++;
+		SDL_SemPost(space);
+		for(int i = 0; i < chipCount; i++){
+			if(event.cycles[i])
+				(*chips[i])(event.cycles[i]);
+		}
+		if(event.write)
+			(*event.write)(event.value);
+		else if(event.writeRegister)
+			(*event.writeRegister)(event.address, event.value);
+		if(event.type == SOUND_FLUSH)
+			SDL_SemPost(idle);
+		else if(event.type == SOUND_STOP)
+			return 0;
+	}
+}
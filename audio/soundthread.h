@@ -0,0 +1,17 @@
+#ifndef SOUNDTHREAD_H_
+#define SOUNDTHREAD_H_
+
+#include <stdint.h>
+
+#define SOUND_MAX_CHIPS		2
+#define SOUND_QUEUE_SIZE	4096	/* entries, power of two */
+
+/* chips are registered with their run function, sound_post hands the worker the clocks
+ * each chip advances (in registration order) followed by an optional register write;
+ * sound_post_register does the same for chips that take the address with the write */
+void init_sound_thread(void), close_sound_thread(void), sound_flush(void), sound_post(const int *, void (*)(uint8_t), uint8_t),
+	 sound_post_register(const int *, void (*)(uint16_t, uint8_t), uint16_t, uint8_t);
+int sound_add_chip(void (*)(int));
+extern uint8_t soundThreadRunning;
+
+#endif /* SOUNDTHREAD_H_ */
@@ -7,11 +7,14 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-//#include <math.h>
+#include <string.h>
 #include "../my_sdl.h"
 #include"../sms/smsemu.h"
+#include "resampler.h"
+#include "mixer.h"
+#include "ym2413_tables.h"
+#include "../state.h"
 
-#define FRAC_BITS				16
 #define INSTRUMENT_CHANNELS		6
 #define RHYTHM_CHANNELS			3
 #define TOTAL_CHANNELS			(INSTRUMENT_CHANNELS + RHYTHM_CHANNELS)
@@ -19,7 +22,8 @@
 #define ATTENUATION_MAX			127
 #define ATTENUATION_MIN			0
 #define	ATTENUATION_SILENT		124
-#define M_PI					(3.14159265358979323846)
+#define MOD(channel)			(channel)
+#define CAR(channel)			((channel) + TOTAL_CHANNELS)
 
 static uint8_t instruments[0x10][0x8] =	{ /* Inaccurate, based on MAME code */
 	{0x49, 0x4c, 0x4c, 0x12, 0x00, 0x00, 0x00, 0x00 },  /* 0. Custom 			*/
@@ -56,75 +60,70 @@ percussions[0x3][0x8] = { /* Dumped from VRC7 */
 	{0x05, 0x01, 0x00, 0x00, 0xf8, 0xaa, 0x59, 0x55 },  /* Tom-tom, Top Cymbal 	*/
 },
 mul[0x10] = {1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30},
-egAdvance[4][8] = {
-	{ 0, 1, 0, 1, 0, 1, 0, 1 }, //  4 out of 8
-	{ 0, 1, 0, 1, 1, 1, 0, 1 }, //  5 out of 8
-	{ 0, 1, 1, 1, 0, 1, 1, 1 }, //  6 out of 8
-	{ 0, 1, 1, 1, 1, 1, 1, 1 }, //  7 out of 8
-},
 keyScaleLevel[16] = { 112, 64, 48, 38, 32, 26, 22, 18, 16, 12, 10, 8, 6, 4, 2, 0 };
 
-float ym2413_Sample, *ym2413_SampleBuffer = NULL;
-static uint32_t sampleRate, originalSampleRate;
+float *ym2413_SampleBuffer = NULL;
+static struct resampler fmResampler;
 uint8_t muteControl = 0, instrumentSet[TOTAL_CHANNELS], ym2413reg, instChannels, rhythmControl, ym2413_mute;
-int fmCyclesToRun = 0, ym2413_SampleCounter = 0, fmAccumulatedCycles = 0;
-static int logSine[256], expTab[256], origSampleCounter = 0, bufferSize;
+static int bufferSize, fmSource;
 static uint32_t counter = 0, noise;
-static Channel *channels[TOTAL_CHANNELS] = {NULL};
+static Operators ops;
+static Channels chs;
 
 void setup_user_instrument(uint8_t), load_instrument(uint8_t, uint8_t*), load_rhythm(), unload_rhythm(), calculate_phase(uint8_t,uint8_t), calculate_envelope(uint8_t,uint8_t), lfsr(),
 		load_instrument_0(uint8_t, uint8_t*), load_instrument_1(uint8_t, uint8_t*), load_instrument_2(uint8_t, uint8_t*), load_instrument_3(uint8_t, uint8_t*),
 		load_instrument_4(uint8_t, uint8_t*), load_instrument_5(uint8_t, uint8_t*), load_instrument_6(uint8_t, uint8_t*), load_instrument_7(uint8_t, uint8_t*);
 uint16_t getLogSine(uint16_t, uint8_t);
 int16_t getExp(uint16_t), calculate_operator(uint8_t, uint8_t, int, int);
-int calculate_attenuation(Operator *, uint8_t, int);
+int calculate_attenuation(uint8_t, uint8_t, int);
+static inline void run_operators(uint8_t, uint8_t, uint16_t, const int *, const int *, int16_t *);
 
-void init_ym2413(int buffer){
+void init_ym2413(int buffer, int quality){
 	bufferSize = buffer;
 	free(ym2413_SampleBuffer);
 	ym2413_SampleBuffer = malloc(bufferSize * sizeof(float));
+	init_resampler(&fmResampler, bufferSize << 1, quality);
+	fmSource = mixer_add_source();
 	noise = 0x800000;
 	rhythmControl = 0;
 	instChannels = TOTAL_CHANNELS;
+	memset(&ops, 0, sizeof(ops));
+	memset(&chs, 0, sizeof(chs));
 	for(int i = 0; i < TOTAL_CHANNELS; i++){//TODO: below are just hand picked sensible defaults, what are actual init values?
-		free(channels[i]);
-		channels[i] = malloc(sizeof(Channel));
-		channels[i]->car.egState = SUSTAIN;
-		channels[i]->mod.egState = SUSTAIN;
-		channels[i]->keyPressed = 0;
-		channels[i]->mod.p0 = channels[i]->mod.p1 = channels[i]->mod.phase = channels[i]->car.phase = channels[i]->mod.feedback = 0;
-		channels[i]->mod.totalLevel = 63;
-		channels[i]->mod.feedback = 0;
-		channels[i]->mod.envelope = 127;
-		channels[i]->car.envelope = 127;
+		ops.egState[CAR(i)] = SUSTAIN;
+		ops.egState[MOD(i)] = SUSTAIN;
+		chs.totalLevel[i] = 63;
+		ops.envelope[MOD(i)] = 127;
+		ops.envelope[CAR(i)] = 127;
 	}
-    for (int i = 0; i < 256; ++i) {
-        logSine[i] = round(-log2(sin((i + 0.5) * (M_PI / 2) / 256.0)) * 256.0);//12bit range
-        expTab[i] = round(exp2(i / 256.0) * 1024.0) - 1024;//10bit range
-    }
+}
+
+/* user instrument, registers and every operator; the fixed instruments never change */
+void ym2413_state(struct stateBuffer *state){
+	STATE(state, instruments[0]);
+	STATE(state, instrumentSet);
+	STATE(state, ym2413reg);
+	STATE(state, instChannels);
+	STATE(state, rhythmControl);
+	STATE(state, muteControl);
+	STATE(state, counter);
+	STATE(state, noise);
+	STATE(state, ops);
+	STATE(state, chs);
 }
 
 void set_timings_ym2413(int div, int clock){
-	originalSampleRate = sampleRate = ((uint64_t)clock << FRAC_BITS) / div;
-	origSampleCounter = 0;
+	set_timings_resampler(&fmResampler, clock, div);
 }
 
 uint16_t getLogSine(uint16_t val, uint8_t wf){
-// complete waveform period is 10 bit, reconstructed from an 8 bit length table
+// complete waveform period is 10 bit, see sine_generator.m
 // input format: --nm pppp pppp (n=negative; m=mirror; p=phase)
-//TODO: generate 10 bit length table at startup for speed
-	uint16_t result = logSine[(val & 0x100) ? ((val & 0xff) ^ 0xff) : (val & 0xff)];
-	if (val & 0x200) { //is negative
-		if (wf)
-			result = 0xfff; // zero (absolute value)
-		result |= 0x8000; // negate
-	}
-	return result;
+	return ymLogSine[wf][val & 0x3ff];
 }
 
 int16_t getExp(uint16_t val){
-	int t = ((expTab[(val & 0xff) ^ 0xff] << 1) | 0x0800);
-	int result = (t >> ((val & 0x7f00) >> 8));
+	int result = (ymExp[val & 0xff] >> ((val & 0x7f00) >> 8));
 	if (val & 0x8000) //is negative
 		result = ~result;//ones complement
 	return result;
@@ -161,17 +160,17 @@ void write_ym2413_data(uint8_t value){
 				}
 				// set rhythm keys on/off
 					if((rhythmControl & 0x01) && !(oldKeys & 0x01))//high hat
-						channels[7]->mod.egState = DAMP;
+						ops.egState[MOD(7)] = DAMP;
 					if((rhythmControl & 0x02) && !(oldKeys & 0x02))//top cymbal
-						channels[8]->car.egState = DAMP;
+						ops.egState[CAR(8)] = DAMP;
 					if((rhythmControl & 0x04) && !(oldKeys & 0x04))//tom tom
-						channels[8]->mod.egState = DAMP;
+						ops.egState[MOD(8)] = DAMP;
 					if((rhythmControl & 0x08) && !(oldKeys & 0x08))//snare drum
-						channels[7]->car.egState = DAMP;
+						ops.egState[CAR(7)] = DAMP;
 					if((rhythmControl & 0x10) && !(oldKeys & 0x10)){//base drum
-						channels[6]->car.egState = DAMP;
-						channels[6]->mod.egState = DAMP;
-						channels[6]->keyPressed = (rhythmControl & 0x10);
+						ops.egState[CAR(6)] = DAMP;
+						ops.egState[MOD(6)] = DAMP;
+						chs.keyPressed[6] = (rhythmControl & 0x10);
 					}
 			}
 			else if(switched){ // unload rhythm
@@ -183,24 +182,24 @@ void write_ym2413_data(uint8_t value){
 		break;
 	case 0x10: /* Reg 10-18: F-number (low bits) */
 		channel = ((ym2413reg & 0xf) % 9);
-		channels[channel]->fNumber = ((channels[channel]->fNumber & 0x0100) | value);
+		chs.fNumber[channel] = ((chs.fNumber[channel] & 0x0100) | value);
 		break;
 	case 0x20: /* Reg 20-28: Block/F-number; key; sustain mode */
 		channel = ((ym2413reg & 0xf) % 9);
-		channels[channel]->fNumber = ((channels[channel]->fNumber & 0x00ff) | ((value & 0x01) << 8));
-		channels[channel]->keyCode = (value & 0x07);
-		channels[channel]->block = ((value & 0x0e) >> 1);
-		if((channels[channel]->keyPressed ^ (value & 0x10)) && !channels[channel]->keyPressed){
-			channels[channel]->car.egState = DAMP;
-			channels[channel]->mod.egState = DAMP;
+		chs.fNumber[channel] = ((chs.fNumber[channel] & 0x00ff) | ((value & 0x01) << 8));
+		chs.keyCode[channel] = (value & 0x07);
+		chs.block[channel] = ((value & 0x0e) >> 1);
+		if((chs.keyPressed[channel] ^ (value & 0x10)) && !chs.keyPressed[channel]){
+			ops.egState[CAR(channel)] = DAMP;
+			ops.egState[MOD(channel)] = DAMP;
 		}
-		channels[channel]->keyPressed = (value & 0x10);
-		channels[channel]->sustainMode = (value & 0x20);
+		chs.keyPressed[channel] = (value & 0x10);
+		chs.sustainMode[channel] = (value & 0x20);
 		break;
 	case 0x30: /* Reg 30-38: Instrument selection and volume */
 		channel = ((ym2413reg & 0xf) % 9);
 		instrumentSet[channel] = value;
-		channels[channel]->vol = (value & 0x0f);// -3dB per step
+		chs.vol[channel] = (value & 0x0f);// -3dB per step
 		if(channel < instChannels)
 			load_instrument(channel, &instruments[value>>4][0]);
 		break;
@@ -283,44 +282,44 @@ case 7:
 }
 
 void load_instrument_0(uint8_t channel, uint8_t *instrument){
-	channels[channel]->mod.multi = mul[instrument[0] & 0x0f];
-	channels[channel]->mod.ksrShift = instrument[0] & 0x10;
-	channels[channel]->mod.egType = instrument[0] & 0x20;
-	channels[channel]->mod.vibrato = instrument[0] & 0x40;
-	channels[channel]->mod.am = instrument[0] & 0x80;
+	ops.multi[MOD(channel)] = mul[instrument[0] & 0x0f];
+	ops.ksrShift[MOD(channel)] = instrument[0] & 0x10;
+	ops.egType[MOD(channel)] = instrument[0] & 0x20;
+	ops.vibrato[MOD(channel)] = instrument[0] & 0x40;
+	ops.am[MOD(channel)] = instrument[0] & 0x80;
 }
 void load_instrument_1(uint8_t channel, uint8_t *instrument){
-	channels[channel]->car.multi = mul[instrument[1] & 0x0f];
-	channels[channel]->car.ksrShift = instrument[1] & 0x10;
-	channels[channel]->car.egType = instrument[1] & 0x20;
-	channels[channel]->car.vibrato = instrument[1] & 0x40;
-	channels[channel]->car.am = instrument[1] & 0x80;
+	ops.multi[CAR(channel)] = mul[instrument[1] & 0x0f];
+	ops.ksrShift[CAR(channel)] = instrument[1] & 0x10;
+	ops.egType[CAR(channel)] = instrument[1] & 0x20;
+	ops.vibrato[CAR(channel)] = instrument[1] & 0x40;
+	ops.am[CAR(channel)] = instrument[1] & 0x80;
 }
 void load_instrument_2(uint8_t channel, uint8_t *instrument){
-	channels[channel]->mod.ksl = instrument[2] >> 6;
-	channels[channel]->mod.totalLevel = instrument[2] & 0x3f; /* amount of modulation */
+	ops.ksl[MOD(channel)] = instrument[2] >> 6;
+	chs.totalLevel[channel] = instrument[2] & 0x3f; /* amount of modulation */
 }
 void load_instrument_3(uint8_t channel, uint8_t *instrument){
-	channels[channel]->car.ksl = instrument[3] >> 6;
-	channels[channel]->mod.wave = (instrument[3] & 0x08) ? 1 : 0;
-	channels[channel]->car.wave = (instrument[3] & 0x10) ? 1 : 0;
-	channels[channel]->mod.feedback = (instrument[3] & 0x07);
+	ops.ksl[CAR(channel)] = instrument[3] >> 6;
+	ops.wave[MOD(channel)] = (instrument[3] & 0x08) ? 1 : 0;
+	ops.wave[CAR(channel)] = (instrument[3] & 0x10) ? 1 : 0;
+	chs.feedback[channel] = (instrument[3] & 0x07);
 }
 void load_instrument_4(uint8_t channel, uint8_t *instrument){
-	channels[channel]->mod.attackRate = (instrument[4] >> 4);
-	channels[channel]->mod.decayRate = (instrument[4] & 0xf);
+	ops.attackRate[MOD(channel)] = (instrument[4] >> 4);
+	ops.decayRate[MOD(channel)] = (instrument[4] & 0xf);
 }
 void load_instrument_5(uint8_t channel, uint8_t *instrument){
-	channels[channel]->car.attackRate = (instrument[5] >> 4);
-	channels[channel]->car.decayRate = (instrument[5] & 0xf);
+	ops.attackRate[CAR(channel)] = (instrument[5] >> 4);
+	ops.decayRate[CAR(channel)] = (instrument[5] & 0xf);
 }
 void load_instrument_6(uint8_t channel, uint8_t *instrument){
-	channels[channel]->mod.sustainLevel = (instrument[6] >> 4);
-	channels[channel]->mod.releaseRate = (instrument[6] & 0xf);
+	ops.sustainLevel[MOD(channel)] = (instrument[6] >> 4);
+	ops.releaseRate[MOD(channel)] = (instrument[6] & 0xf);
 }
 void load_instrument_7(uint8_t channel, uint8_t *instrument){
-	channels[channel]->car.sustainLevel = (instrument[7] >> 4);
-	channels[channel]->car.releaseRate = (instrument[7] & 0xf);
+	ops.sustainLevel[CAR(channel)] = (instrument[7] >> 4);
+	ops.releaseRate[CAR(channel)] = (instrument[7] & 0xf);
 }
 
 void load_instrument(uint8_t channel, uint8_t *instrument){
@@ -345,8 +344,8 @@ uint8_t isRhythm = 0;
 if((rhythmControl & 0x20) && channel >=7)
 		isRhythm = 1;
 	//EG step size is -.375dB (-48/128)
-Operator *op = isCarrier ? &channels[channel]->car : &channels[channel]->mod;
-uint8_t keyOn = channels[channel]->keyPressed;
+uint8_t o = isCarrier ? CAR(channel) : MOD(channel);
+uint8_t keyOn = chs.keyPressed[channel];
 if(isRhythm){
 	switch(channel << isCarrier){
 	case 7://high hat
@@ -364,132 +363,96 @@ if(isRhythm){
 	}
 }
 
-uint8_t isMax = (op->envelope >> 2) == ATTENUATION_SILENT >> 2;
+uint8_t isMax = (ops.envelope[o] >> 2) == ATTENUATION_SILENT >> 2;
 
 /* update EG phase */
-if(op->egState == DAMP && isMax && (isRhythm || isCarrier)){
+if(ops.egState[o] == DAMP && isMax && (isRhythm || isCarrier)){
 	//should this be handled below, when advancing the envelope based on rate?
-	if(op->attackRate == 15){
-		op->egState = DECAY;
-		op->envelope = ATTENUATION_MIN;	//otherwise it will be silent
+	if(ops.attackRate[o] == 15){
+		ops.egState[o] = DECAY;
+		ops.envelope[o] = ATTENUATION_MIN;	//otherwise it will be silent
 		if(!isRhythm){
-			channels[channel]->mod.envelope = ATTENUATION_MIN;
+			ops.envelope[MOD(channel)] = ATTENUATION_MIN;
 		}
 	}
 	else
-		op->egState = ATTACK;
-	op->phase = 0;
+		ops.egState[o] = ATTACK;
+	ops.phase[o] = 0;
 	if(!isRhythm){
-		channels[channel]->mod.egState = op->egState;
-		channels[channel]->mod.phase = op->phase;
+		ops.egState[MOD(channel)] = ops.egState[o];
+		ops.phase[MOD(channel)] = ops.phase[o];
 	}
-} else if(op->egState == ATTACK && op->envelope == ATTENUATION_MIN)
-	op->egState = DECAY;
-  else if(op->egState == DECAY && (op->envelope >> 3) == op->sustainLevel)
-	op->egState = SUSTAIN;
+} else if(ops.egState[o] == ATTACK && ops.envelope[o] == ATTENUATION_MIN)
+	ops.egState[o] = DECAY;
+  else if(ops.egState[o] == DECAY && (ops.envelope[o] >> 3) == ops.sustainLevel[o])
+	ops.egState[o] = SUSTAIN;
 
 /* get rate */
 uint8_t baseRate;
 uint8_t isAttack;
 if(!keyOn && (isRhythm || isCarrier)){// only for carrier AND rhythm ops
-	if(op->egType)
-		baseRate = op->releaseRate;
-	else if(channels[channel]->sustainMode)
+	if(ops.egType[o])
+		baseRate = ops.releaseRate[o];
+	else if(chs.sustainMode[channel])
 		baseRate = 5; //RS
 	else
 		baseRate = 7; //RR'
 	isAttack = 0;
 } else{
-	switch(op->egState){
+	switch(ops.egState[o]){
 	case DAMP:
 		baseRate = 12;
 		isAttack = 0;
 		break;
 	case ATTACK:
-		baseRate = op->attackRate;
+		baseRate = ops.attackRate[o];
 		isAttack = 1;
 		break;
 	case DECAY:
-		baseRate = op->decayRate;
+		baseRate = ops.decayRate[o];
 		isAttack = 0;
 		break;
 	case SUSTAIN:
-		baseRate = op->egType ? 0 : op->releaseRate; // is this correct for rhythm?
+		baseRate = ops.egType[o] ? 0 : ops.releaseRate[o]; // is this correct for rhythm?
 		isAttack = 0;
 		break;
 	}
 }
 //Effective rate is based on Table III-2 and formula [RATE = 4 x R + Rks] in manual:
-uint8_t key = ((channels[channel]->block << 1) | (channels[channel]->fNumber >> 8));
-uint8_t rate = (((baseRate << 2) + (op->ksr ? key : (key >> 2))));//0-63
+uint8_t key = ((chs.block[channel] << 1) | (chs.fNumber[channel] >> 8));
+uint8_t rate = (((baseRate << 2) + (ops.ksr[o] ? key : (key >> 2))));//0-63
 if(rate > RATE_MAX)
 	rate = RATE_MAX;
-uint8_t *egStep = egAdvance[rate & 3];
+uint8_t step;
 if(isAttack){
-	switch(rate >> 2){
-	//very slow and fast rates give infinite envelope:
-	case 0:
-	case 15:
-		op->envelope = ATTENUATION_MIN; // corner case: organ modulator stuck in ATTACK (mod attack = 15 but car attack = 7)
-		break;
-	//special case for fast rates:
-	case 12://rate 48+
-	case 13://rate 52+
-	case 14: ;//rate 56+
-		int m = (16 - (rate >> 2));
-		m -= (egStep[counter & 0xc] >> 1);
-		op->envelope = (op->envelope - (op->envelope >> m) - 1);
-		break;
-	//normal behavior:
-	default: ;
-		uint8_t shift = (13 - (rate >> 2));
-		int mask = (((1 << shift) -1) & ~3);
-		if(!(counter & mask)){
-			if(egStep[(counter >> shift) & 7])
-				op->envelope = (op->envelope - (op->envelope >> 4) - 1);
-		}
-		break;
+	if(!(counter & ymEgAttackMask[rate])){
+		step = ymEgAttack[rate][(counter >> ymEgAttackShift[rate]) & 0xf];
+		if(step == EG_ATTACK_INSTANT) // very slow and fast rates give infinite envelope
+			ops.envelope[o] = ATTENUATION_MIN; // corner case: organ modulator stuck in ATTACK (mod attack = 15 but car attack = 7)
+		else if(step)
+			ops.envelope[o] = (ops.envelope[o] - (ops.envelope[o] >> step) - 1);
 	}
-	if(op->envelope < ATTENUATION_MIN){
-		op->envelope = ATTENUATION_MIN;
+	if(ops.envelope[o] < ATTENUATION_MIN){
+		ops.envelope[o] = ATTENUATION_MIN;
 	}
 } else{
-	switch(rate >> 2){
-	//exceptions for very slow or fast rates:
-	case 0://rates 0-3 gives infinite envelope
-		break;
-	case 13://rates 52+
-		op->envelope += (egStep[((counter & 0xc) >> 1) | (counter & 1)] + 1);
-		break;
-	case 14://rates 56+
-		op->envelope += (egStep[(counter & 0xc) >> 1] + 1);
-		break;
-	case 15://rates 60+
-		op->envelope += 2;
-		break;
-	//normal behavior:
-	default: ;
-		uint8_t shift = 13 - (rate / 4);
-		int mask = (1 << shift) - 1;
-		if (!(counter & mask))
-			op->envelope += egStep[(counter >> shift) & 7];
-		break;
-	}
-	if(op->envelope > ATTENUATION_MAX)
-		op->envelope = ATTENUATION_MAX;
+	if(!(counter & ymEgDecayMask[rate]))
+		ops.envelope[o] += ymEgDecay[rate][(counter >> ymEgDecayShift[rate]) & 0xf];
+	if(ops.envelope[o] > ATTENUATION_MAX)
+		ops.envelope[o] = ATTENUATION_MAX;
 }
 }
 
 void calculate_phase(uint8_t channel, uint8_t isCarrier){
+	uint8_t o = isCarrier ? CAR(channel) : MOD(channel);
 	int vib = 0;
-	Operator *op = isCarrier ? &channels[channel]->car : &channels[channel]->mod;
-	if(op->vibrato)
-		vib = pmTable[channels[channel]->fNumber >> 6][(counter >> 10) & 7]; // update only when written to?
+	if(ops.vibrato[o])
+		vib = pmTable[chs.fNumber[channel] >> 6][(counter >> 10) & 7]; // update only when written to?
 
 	//the formula: (((2fnum + pmLFO) * mlTab[ML]) << block) / 4
 	//the result of this phase calculation is 10.9 fixed point values:
-	op->phaseIncrement = (((((channels[channel]->fNumber << 1) + vib) * op->multi) << channels[channel]->block) >> 2);
-	op->phase += op->phaseIncrement;
+	ops.phaseIncrement[o] = (((((chs.fNumber[channel] << 1) + vib) * ops.multi[o]) << chs.block[channel]) >> 2);
+	ops.phase[o] += ops.phaseIncrement[o];
 }
 
 static const uint8_t amTable[210] = {
@@ -509,62 +472,107 @@ static const uint8_t amTable[210] = {
     0, 0, 0, 0 };
 
 int16_t calculate_operator(uint8_t channel, uint8_t isCarrier, int phase, int level){
-	Operator *op = isCarrier ? &channels[channel]->car : &channels[channel]->mod;
+	uint8_t o = isCarrier ? CAR(channel) : MOD(channel);
 	calculate_envelope(channel, isCarrier);
 	calculate_phase(channel, isCarrier);
-	if((op->envelope & ATTENUATION_SILENT) == ATTENUATION_SILENT)
+	if((ops.envelope[o] & ATTENUATION_SILENT) == ATTENUATION_SILENT)
 		return 0;
-	int attenuation = calculate_attenuation(op,channel,level);
-	int p = (op->phase >> 9) + phase;
-	return getExp(getLogSine(p, op->wave) + (attenuation << 4));
+	ops.attenuation[o] = calculate_attenuation(o, channel, level);
+	return getExp(getLogSine((ops.phase[o] >> 9) + phase, ops.wave[o]) + (ops.attenuation[o] << 4));
 }
 
-int calculate_attenuation(Operator *op, uint8_t channel, int level){
+int calculate_attenuation(uint8_t o, uint8_t channel, int level){
 	int ksl = 0, am = 0;
-	if(op->am)
+	if(ops.am[o])
 		am = amTable[(counter >> 6) % 210];
-	if(op->ksl){
-		ksl = (((channels[channel]->block << 4) - keyScaleLevel[channels[channel]->fNumber >> 5]) >> (3 - op->ksl));
+	if(ops.ksl[o]){
+		ksl = (((chs.block[channel] << 4) - keyScaleLevel[chs.fNumber[channel] >> 5]) >> (3 - ops.ksl[o]));
 		if(ksl < 0)
 			ksl = 0;
 	}
-	int attenuation = (op->envelope + level + ksl + am);
+	int attenuation = (ops.envelope[o] + level + ksl + am);
 	if(attenuation > ATTENUATION_MAX)
 		attenuation = ATTENUATION_MAX;
 	return attenuation;
 }
 
-void run_ym2413(){
+/* Runs the modulators or the carriers of channels 0 to count - 1 as one batch.
+ * Each stage is its own loop over the contiguous operator arrays, so phase and
+ * attenuation vectorize and only the envelope state machine stays branchy.
+ * Operators outside mask are not clocked, as masked channels never were. */
+void run_operators(uint8_t isCarrier, uint8_t count, uint16_t mask, const int *phaseIn, const int *levelIn, int16_t *out){
+	uint8_t base = isCarrier ? CAR(0) : MOD(0);
+	int vibStep = (counter >> 10) & 7, am = amTable[(counter >> 6) % 210];
+	for(int c = 0; c < count; c++){
+		if(mask & (1 << c))
+			calculate_envelope(c, isCarrier);
+	}
+	for(int c = 0; c < count; c++){
+		int o = base + c;
+		int vib = ops.vibrato[o] ? pmTable[chs.fNumber[c] >> 6][vibStep] : 0;
+		uint32_t increment = (((((chs.fNumber[c] << 1) + vib) * ops.multi[o]) << chs.block[c]) >> 2);
+		if(mask & (1 << c)){
+			ops.phaseIncrement[o] = increment;
+			ops.phase[o] += increment;
+		}
+	}
+	for(int c = 0; c < count; c++){
+		int o = base + c;
+		int ksl = ops.ksl[o] ? (((chs.block[c] << 4) - keyScaleLevel[chs.fNumber[c] >> 5]) >> (3 - ops.ksl[o])) : 0;
+		int attenuation = ops.envelope[o] + levelIn[c] + (ksl < 0 ? 0 : ksl) + (ops.am[o] ? am : 0);
+		ops.attenuation[o] = (attenuation > ATTENUATION_MAX) ? ATTENUATION_MAX : attenuation;
+	}
+	for(int c = 0; c < count; c++){
+		int o = base + c;
+		if(!(mask & (1 << c)) || (ops.envelope[o] & ATTENUATION_SILENT) == ATTENUATION_SILENT)
+			out[c] = 0;
+		else
+			out[c] = getExp(getLogSine((ops.phase[o] >> 9) + phaseIn[c], ops.wave[o]) + (ops.attenuation[o] << 4));
+	}
+}
+
+void run_ym2413(int cycles){
 	/* calculate phase, calculate envelope, calculate attenuation, output sample */
 	int16_t tmp_sample = 0;
-	int16_t m;
+	int16_t m, out[TOTAL_CHANNELS];
+	int phaseIn[TOTAL_CHANNELS] = {0}, levelIn[TOTAL_CHANNELS] = {0};
 	uint8_t sdBit, hhRes;
 	uint16_t phase;
-	while(fmCyclesToRun){
+	while(cycles--){
 		lfsr();
+		/* all modulators first, then all the carriers they feed */
 		for(uint8_t channel = 0;channel < instChannels;channel++){
-			m = (calculate_operator(channel, 0, (channels[channel]->mod.feedback ? ((channels[channel]->mod.p0 + channels[channel]->mod.p1) >> (8-channels[channel]->mod.feedback)) : 0), channels[channel]->mod.totalLevel << 1) >> 1);
-			channels[channel]->mod.p1 = channels[channel]->mod.p0;
-			channels[channel]->mod.p0 = m;
-			//output is 9bit (-255 - 255) so we shift right 4 (is the output signed now?)
-			if(channelMask & (1 << channel))
-				tmp_sample += (calculate_operator(channel, 1, (m << 1), (channels[channel]->vol << 3)) >> 4);
+			phaseIn[channel] = (chs.feedback[channel] ? ((chs.p0[channel] + chs.p1[channel]) >> (8-chs.feedback[channel])) : 0);
+			levelIn[channel] = chs.totalLevel[channel] << 1;
+		}
+		run_operators(0, instChannels, 0x1ff, phaseIn, levelIn, out);
+		for(uint8_t channel = 0;channel < instChannels;channel++){
+			m = out[channel] >> 1;
+			chs.p1[channel] = chs.p0[channel];
+			chs.p0[channel] = m;
+			phaseIn[channel] = (m << 1);
+			levelIn[channel] = chs.vol[channel] << 3;
+		}
+		run_operators(1, instChannels, channelMask, phaseIn, levelIn, out);
+		//output is 9bit (-255 - 255) so we shift right 4 (is the output signed now?)
+		for(uint8_t channel = 0;channel < instChannels;channel++){
+			tmp_sample += (out[channel] >> 4);
 		}
 			if(rhythmControl & 0x20){
 				//base drum
-				m = (calculate_operator(6, 0, (channels[6]->mod.feedback ? ((channels[6]->mod.p0 + channels[6]->mod.p1) >> (8-channels[6]->mod.feedback)) : 0), channels[6]->mod.totalLevel << 1) >> 1);
-				channels[6]->mod.p1 = channels[6]->mod.p0;
-				channels[6]->mod.p0 = m;
+				m = (calculate_operator(6, 0, (chs.feedback[6] ? ((chs.p0[6] + chs.p1[6]) >> (8-chs.feedback[6])) : 0), chs.totalLevel[6] << 1) >> 1);
+				chs.p1[6] = chs.p0[6];
+				chs.p0[6] = m;
 				//should be twice normal output?
 				if(rhythmMask & (1 << 0))
-				tmp_sample += (calculate_operator(6, 1, (m << 1), (channels[6]->vol << 3)) >> 3);
+				tmp_sample += (calculate_operator(6, 1, (m << 1), (chs.vol[6] << 3)) >> 3);
 
 				//hi hat
-				hhRes = (((channels[8]->car.phase >> 9) >> 5) | ((channels[8]->car.phase >> 9) >> 3)) & 1;
+				hhRes = (((ops.phase[CAR(8)] >> 9) >> 5) | ((ops.phase[CAR(8)] >> 9) >> 3)) & 1;
 				if (hhRes)
 					phase = (0x200|(0xd0>>2));
 				else{
-					hhRes = ((((channels[7]->mod.phase >> 9) >> 7) ^ ((channels[7]->mod.phase >> 9) >> 2)) | ((channels[7]->mod.phase >> 9) >> 3)) & 1;
+					hhRes = ((((ops.phase[MOD(7)] >> 9) >> 7) ^ ((ops.phase[MOD(7)] >> 9) >> 2)) | ((ops.phase[MOD(7)] >> 9) >> 3)) & 1;
 					phase = (hhRes ? (0x200|(0xd0>>2)) : 0xd0);
 				}
 				if ((phase & 0x200) && noise)
@@ -576,7 +584,7 @@ void run_ym2413(){
 
 				//snare drum
 				//get base freq from hi hat channel:
-				sdBit = (((channels[7]->mod.phase >> 9) >> 8) & 1);
+				sdBit = (((ops.phase[MOD(7)] >> 9) >> 8) & 1);
 				phase = sdBit ? 0x200 : 0x100;
 				if (noise & 1)
 					phase ^= 0x100;
@@ -588,35 +596,24 @@ void run_ym2413(){
 				tmp_sample += (calculate_operator(8, 0, 0, (instrumentSet[8] & 0xf0) >> 1) >> 3);
 
 				//top cymbal
-				hhRes = (((channels[8]->car.phase >> 9) >> 5) | ((channels[8]->car.phase >> 9) >> 3)) & 1;
+				hhRes = (((ops.phase[CAR(8)] >> 9) >> 5) | ((ops.phase[CAR(8)] >> 9) >> 3)) & 1;
 				if (hhRes)
 					phase = 0x300;
 				else{
-					hhRes = ((((channels[7]->mod.phase >> 9) >> 7) ^ ((channels[7]->mod.phase >> 9) >> 2)) | ((channels[7]->mod.phase >> 9) >> 3)) & 1;
+					hhRes = ((((ops.phase[MOD(7)] >> 9) >> 7) ^ ((ops.phase[MOD(7)] >> 9) >> 2)) | ((ops.phase[MOD(7)] >> 9) >> 3)) & 1;
 					phase = (hhRes ? 0x300 : 0x100);
 				}
 				if(rhythmMask & (1 << 4))
 				tmp_sample += (calculate_operator(8, 1, phase, (instrumentSet[8] & 0x0f) << 3) >> 3);
 				}
-			if(!ym2413_mute)
-				ym2413_Sample += tmp_sample; //global sample accumulator instead
-			else
-				ym2413_Sample += 0;
+			if(!audioSkip)
+				resampler_add_sample(&fmResampler, ym2413_mute ? 0 : (float)tmp_sample / (TOTAL_CHANNELS * 127));
 			tmp_sample = 0; // move out
-			origSampleCounter++; // make global
-
-		//move all of this out of here:
-		if(origSampleCounter >= (sampleRate >> FRAC_BITS)){// can this be simplified with fixed point?
-			ym2413_SampleBuffer[ym2413_SampleCounter++] = (ym2413_Sample / (origSampleCounter * TOTAL_CHANNELS * 127));
-			if(ym2413_SampleCounter == bufferSize){
-				output_sound(ym2413_SampleBuffer, ym2413_SampleCounter);
-				ym2413_SampleCounter = 0;
-			}
-			sampleRate = originalSampleRate + sampleRate - (origSampleCounter << FRAC_BITS);
-			ym2413_Sample = 0;
-			origSampleCounter = 0;
-		}
 		counter++;
-		fmCyclesToRun--;
+	}
+	if(resampler_samples_avail(&fmResampler) >= bufferSize){
+		resampler_read_samples(&fmResampler, ym2413_SampleBuffer, bufferSize);
+		mixer_write(fmSource, ym2413_SampleBuffer, bufferSize);
+		resampler_set_ratio(&fmResampler, mixerRatio);
 	}
 }
@@ -10,47 +10,49 @@ enum state{
 	DECAY = 2,
 	SUSTAIN = 3,
 };
-typedef struct operator{
-	uint8_t multi;
-	uint8_t ksrShift;
-	uint8_t egType;
-	uint8_t vibrato;
-	uint8_t am;
-	uint8_t ksl;
-	uint8_t ksr;
-	uint8_t wave;
-	uint32_t phase;
-	uint32_t phaseIncrement; /* 10.9 fixed point */
+#define YM2413_OPERATORS	18
+
+/* Operator n is the modulator of channel n, operator n + 9 its carrier */
+typedef struct operators{
+	uint32_t phase[YM2413_OPERATORS];
+	uint32_t phaseIncrement[YM2413_OPERATORS]; /* 10.9 fixed point */
+	int16_t envelope[YM2413_OPERATORS];
+	int16_t attenuation[YM2413_OPERATORS];
+	uint8_t egState[YM2413_OPERATORS];
+	uint8_t multi[YM2413_OPERATORS];
+	uint8_t ksrShift[YM2413_OPERATORS];
+	uint8_t egType[YM2413_OPERATORS];
+	uint8_t vibrato[YM2413_OPERATORS];
+	uint8_t am[YM2413_OPERATORS];
+	uint8_t ksl[YM2413_OPERATORS];
+	uint8_t ksr[YM2413_OPERATORS];
+	uint8_t wave[YM2413_OPERATORS];
 
 	// ENVELOPE GENERATOR
-	uint8_t attackRate;
-	uint8_t decayRate;
-	uint8_t sustainLevel;
-	uint8_t releaseRate;
-	enum state egState;
-	int16_t envelope;
-
-	uint8_t totalLevel; // mod only
-	uint8_t feedback; // mod only
-	int16_t p0; //mod only
-	int16_t p1; //mod only
-}Operator;
-
-typedef struct channel{
-	uint8_t keyPressed;
-	uint8_t sustainMode;
-	uint16_t fNumber;
-	uint8_t block;
-	uint8_t keyCode;
-	uint8_t vol;
-	uint8_t instr;
-	Operator mod;
-	Operator car;
-} Channel;
+	uint8_t attackRate[YM2413_OPERATORS];
+	uint8_t decayRate[YM2413_OPERATORS];
+	uint8_t sustainLevel[YM2413_OPERATORS];
+	uint8_t releaseRate[YM2413_OPERATORS];
+}Operators;
+
+typedef struct channels{
+	uint16_t fNumber[9];
+	int16_t p0[9]; // modulator feedback history
+	int16_t p1[9];
+	uint8_t keyPressed[9];
+	uint8_t sustainMode[9];
+	uint8_t block[9];
+	uint8_t keyCode[9];
+	uint8_t vol[9];
+	uint8_t instr[9];
+	uint8_t totalLevel[9]; // modulator only
+	uint8_t feedback[9]; // modulator only
+} Channels;
+
+struct stateBuffer;
 
 extern uint8_t ym2413_mute;
-extern int fmCyclesToRun, ym2413_SampleCounter, fmAccumulatedCycles;
 extern float *ym2413_SampleBuffer;
-void write_ym2413_register(uint8_t), write_ym2413_data(uint8_t), run_ym2413(void), init_ym2413(int), set_timings_ym2413(int, int);
+void write_ym2413_register(uint8_t), write_ym2413_data(uint8_t), run_ym2413(int), init_ym2413(int, int), set_timings_ym2413(int, int), ym2413_state(struct stateBuffer *);
 
 #endif
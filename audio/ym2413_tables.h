@@ -0,0 +1,331 @@
+/* Generated by sine_generator.m, do not edit */
+
+#ifndef YM2413_TABLES_H_
+#define YM2413_TABLES_H_
+
+#include <stdint.h>
+
+#define EG_ATTACK_INSTANT	255
+
+/* -log2(sin) over a full 10 bit period in 4.8 fixed point, bit 15 set for the negative half.
+ * Waveform 1 is the half-rectified sine, its negative half is silent. */
+static const uint16_t ymLogSine[2][1024] = {
+{
+	2137, 1731, 1543, 1419, 1326, 1252, 1190, 1137, 1091, 1050, 1013, 979, 949, 920, 894, 869,
+	846, 825, 804, 785, 767, 749, 732, 717, 701, 687, 672, 659, 646, 633, 621, 609,
+	598, 587, 576, 566, 556, 546, 536, 527, 518, 509, 501, 492, 484, 476, 468, 461,
+	453, 446, 439, 432, 425, 418, 411, 405, 399, 392, 386, 380, 375, 369, 363, 358,
+	352, 347, 341, 336, 331, 326, 321, 316, 311, 307, 302, 297, 293, 289, 284, 280,
+	276, 271, 267, 263, 259, 255, 251, 248, 244, 240, 236, 233, 229, 226, 222, 219,
+	215, 212, 209, 205, 202, 199, 196, 193, 190, 187, 184, 181, 178, 175, 172, 169,
+	167, 164, 161, 159, 156, 153, 151, 148, 146, 143, 141, 138, 136, 134, 131, 129,
+	127, 125, 122, 120, 118, 116, 114, 112, 110, 108, 106, 104, 102, 100, 98, 96,
+	94, 92, 91, 89, 87, 85, 83, 82, 80, 78, 77, 75, 74, 72, 70, 69,
+	67, 66, 64, 63, 62, 60, 59, 57, 56, 55, 53, 52, 51, 49, 48, 47,
+	46, 45, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 31, 30,
+	29, 28, 27, 26, 25, 24, 23, 23, 22, 21, 20, 20, 19, 18, 17, 17,
+	16, 15, 15, 14, 13, 13, 12, 12, 11, 10, 10, 9, 9, 8, 8, 7,
+	7, 7, 6, 6, 5, 5, 5, 4, 4, 4, 3, 3, 3, 2, 2, 2,
+	2, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 2,
+	2, 2, 2, 3, 3, 3, 4, 4, 4, 5, 5, 5, 6, 6, 7, 7,
+	7, 8, 8, 9, 9, 10, 10, 11, 12, 12, 13, 13, 14, 15, 15, 16,
+	17, 17, 18, 19, 20, 20, 21, 22, 23, 23, 24, 25, 26, 27, 28, 29,
+	30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 45, 46,
+	47, 48, 49, 51, 52, 53, 55, 56, 57, 59, 60, 62, 63, 64, 66, 67,
+	69, 70, 72, 74, 75, 77, 78, 80, 82, 83, 85, 87, 89, 91, 92, 94,
+	96, 98, 100, 102, 104, 106, 108, 110, 112, 114, 116, 118, 120, 122, 125, 127,
+	129, 131, 134, 136, 138, 141, 143, 146, 148, 151, 153, 156, 159, 161, 164, 167,
+	169, 172, 175, 178, 181, 184, 187, 190, 193, 196, 199, 202, 205, 209, 212, 215,
+	219, 222, 226, 229, 233, 236, 240, 244, 248, 251, 255, 259, 263, 267, 271, 276,
+	280, 284, 289, 293, 297, 302, 307, 311, 316, 321, 326, 331, 336, 341, 347, 352,
+	358, 363, 369, 375, 380, 386, 392, 399, 405, 411, 418, 425, 432, 439, 446, 453,
+	461, 468, 476, 484, 492, 501, 509, 518, 527, 536, 546, 556, 566, 576, 587, 598,
+	609, 621, 633, 646, 659, 672, 687, 701, 717, 732, 749, 767, 785, 804, 825, 846,
+	869, 894, 920, 949, 979, 1013, 1050, 1091, 1137, 1190, 1252, 1326, 1419, 1543, 1731, 2137,
+	34905, 34499, 34311, 34187, 34094, 34020, 33958, 33905, 33859, 33818, 33781, 33747, 33717, 33688, 33662, 33637,
+	33614, 33593, 33572, 33553, 33535, 33517, 33500, 33485, 33469, 33455, 33440, 33427, 33414, 33401, 33389, 33377,
+	33366, 33355, 33344, 33334, 33324, 33314, 33304, 33295, 33286, 33277, 33269, 33260, 33252, 33244, 33236, 33229,
+	33221, 33214, 33207, 33200, 33193, 33186, 33179, 33173, 33167, 33160, 33154, 33148, 33143, 33137, 33131, 33126,
+	33120, 33115, 33109, 33104, 33099, 33094, 33089, 33084, 33079, 33075, 33070, 33065, 33061, 33057, 33052, 33048,
+	33044, 33039, 33035, 33031, 33027, 33023, 33019, 33016, 33012, 33008, 33004, 33001, 32997, 32994, 32990, 32987,
+	32983, 32980, 32977, 32973, 32970, 32967, 32964, 32961, 32958, 32955, 32952, 32949, 32946, 32943, 32940, 32937,
+	32935, 32932, 32929, 32927, 32924, 32921, 32919, 32916, 32914, 32911, 32909, 32906, 32904, 32902, 32899, 32897,
+	32895, 32893, 32890, 32888, 32886, 32884, 32882, 32880, 32878, 32876, 32874, 32872, 32870, 32868, 32866, 32864,
+	32862, 32860, 32859, 32857, 32855, 32853, 32851, 32850, 32848, 32846, 32845, 32843, 32842, 32840, 32838, 32837,
+	32835, 32834, 32832, 32831, 32830, 32828, 32827, 32825, 32824, 32823, 32821, 32820, 32819, 32817, 32816, 32815,
+	32814, 32813, 32811, 32810, 32809, 32808, 32807, 32806, 32805, 32804, 32803, 32802, 32801, 32800, 32799, 32798,
+	32797, 32796, 32795, 32794, 32793, 32792, 32791, 32791, 32790, 32789, 32788, 32788, 32787, 32786, 32785, 32785,
+	32784, 32783, 32783, 32782, 32781, 32781, 32780, 32780, 32779, 32778, 32778, 32777, 32777, 32776, 32776, 32775,
+	32775, 32775, 32774, 32774, 32773, 32773, 32773, 32772, 32772, 32772, 32771, 32771, 32771, 32770, 32770, 32770,
+	32770, 32769, 32769, 32769, 32769, 32769, 32769, 32769, 32768, 32768, 32768, 32768, 32768, 32768, 32768, 32768,
+	32768, 32768, 32768, 32768, 32768, 32768, 32768, 32768, 32769, 32769, 32769, 32769, 32769, 32769, 32769, 32770,
+	32770, 32770, 32770, 32771, 32771, 32771, 32772, 32772, 32772, 32773, 32773, 32773, 32774, 32774, 32775, 32775,
+	32775, 32776, 32776, 32777, 32777, 32778, 32778, 32779, 32780, 32780, 32781, 32781, 32782, 32783, 32783, 32784,
+	32785, 32785, 32786, 32787, 32788, 32788, 32789, 32790, 32791, 32791, 32792, 32793, 32794, 32795, 32796, 32797,
+	32798, 32799, 32800, 32801, 32802, 32803, 32804, 32805, 32806, 32807, 32808, 32809, 32810, 32811, 32813, 32814,
+	32815, 32816, 32817, 32819, 32820, 32821, 32823, 32824, 32825, 32827, 32828, 32830, 32831, 32832, 32834, 32835,
+	32837, 32838, 32840, 32842, 32843, 32845, 32846, 32848, 32850, 32851, 32853, 32855, 32857, 32859, 32860, 32862,
+	32864, 32866, 32868, 32870, 32872, 32874, 32876, 32878, 32880, 32882, 32884, 32886, 32888, 32890, 32893, 32895,
+	32897, 32899, 32902, 32904, 32906, 32909, 32911, 32914, 32916, 32919, 32921, 32924, 32927, 32929, 32932, 32935,
+	32937, 32940, 32943, 32946, 32949, 32952, 32955, 32958, 32961, 32964, 32967, 32970, 32973, 32977, 32980, 32983,
+	32987, 32990, 32994, 32997, 33001, 33004, 33008, 33012, 33016, 33019, 33023, 33027, 33031, 33035, 33039, 33044,
+	33048, 33052, 33057, 33061, 33065, 33070, 33075, 33079, 33084, 33089, 33094, 33099, 33104, 33109, 33115, 33120,
+	33126, 33131, 33137, 33143, 33148, 33154, 33160, 33167, 33173, 33179, 33186, 33193, 33200, 33207, 33214, 33221,
+	33229, 33236, 33244, 33252, 33260, 33269, 33277, 33286, 33295, 33304, 33314, 33324, 33334, 33344, 33355, 33366,
+	33377, 33389, 33401, 33414, 33427, 33440, 33455, 33469, 33485, 33500, 33517, 33535, 33553, 33572, 33593, 33614,
+	33637, 33662, 33688, 33717, 33747, 33781, 33818, 33859, 33905, 33958, 34020, 34094, 34187, 34311, 34499, 34905,
+},
+{
+	2137, 1731, 1543, 1419, 1326, 1252, 1190, 1137, 1091, 1050, 1013, 979, 949, 920, 894, 869,
+	846, 825, 804, 785, 767, 749, 732, 717, 701, 687, 672, 659, 646, 633, 621, 609,
+	598, 587, 576, 566, 556, 546, 536, 527, 518, 509, 501, 492, 484, 476, 468, 461,
+	453, 446, 439, 432, 425, 418, 411, 405, 399, 392, 386, 380, 375, 369, 363, 358,
+	352, 347, 341, 336, 331, 326, 321, 316, 311, 307, 302, 297, 293, 289, 284, 280,
+	276, 271, 267, 263, 259, 255, 251, 248, 244, 240, 236, 233, 229, 226, 222, 219,
+	215, 212, 209, 205, 202, 199, 196, 193, 190, 187, 184, 181, 178, 175, 172, 169,
+	167, 164, 161, 159, 156, 153, 151, 148, 146, 143, 141, 138, 136, 134, 131, 129,
+	127, 125, 122, 120, 118, 116, 114, 112, 110, 108, 106, 104, 102, 100, 98, 96,
+	94, 92, 91, 89, 87, 85, 83, 82, 80, 78, 77, 75, 74, 72, 70, 69,
+	67, 66, 64, 63, 62, 60, 59, 57, 56, 55, 53, 52, 51, 49, 48, 47,
+	46, 45, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 31, 30,
+	29, 28, 27, 26, 25, 24, 23, 23, 22, 21, 20, 20, 19, 18, 17, 17,
+	16, 15, 15, 14, 13, 13, 12, 12, 11, 10, 10, 9, 9, 8, 8, 7,
+	7, 7, 6, 6, 5, 5, 5, 4, 4, 4, 3, 3, 3, 2, 2, 2,
+	2, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 2,
+	2, 2, 2, 3, 3, 3, 4, 4, 4, 5, 5, 5, 6, 6, 7, 7,
+	7, 8, 8, 9, 9, 10, 10, 11, 12, 12, 13, 13, 14, 15, 15, 16,
+	17, 17, 18, 19, 20, 20, 21, 22, 23, 23, 24, 25, 26, 27, 28, 29,
+	30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 45, 46,
+	47, 48, 49, 51, 52, 53, 55, 56, 57, 59, 60, 62, 63, 64, 66, 67,
+	69, 70, 72, 74, 75, 77, 78, 80, 82, 83, 85, 87, 89, 91, 92, 94,
+	96, 98, 100, 102, 104, 106, 108, 110, 112, 114, 116, 118, 120, 122, 125, 127,
+	129, 131, 134, 136, 138, 141, 143, 146, 148, 151, 153, 156, 159, 161, 164, 167,
+	169, 172, 175, 178, 181, 184, 187, 190, 193, 196, 199, 202, 205, 209, 212, 215,
+	219, 222, 226, 229, 233, 236, 240, 244, 248, 251, 255, 259, 263, 267, 271, 276,
+	280, 284, 289, 293, 297, 302, 307, 311, 316, 321, 326, 331, 336, 341, 347, 352,
+	358, 363, 369, 375, 380, 386, 392, 399, 405, 411, 418, 425, 432, 439, 446, 453,
+	461, 468, 476, 484, 492, 501, 509, 518, 527, 536, 546, 556, 566, 576, 587, 598,
+	609, 621, 633, 646, 659, 672, 687, 701, 717, 732, 749, 767, 785, 804, 825, 846,
+	869, 894, 920, 949, 979, 1013, 1050, 1091, 1137, 1190, 1252, 1326, 1419, 1543, 1731, 2137,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+	36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863, 36863,
+}
+};
+
+/* 2^(-x) for the fractional attenuation bits, 11 bit mantissa with the implied one */
+static const uint16_t ymExp[256] = {
+	4084, 4074, 4062, 4052, 4040, 4030, 4020, 4008, 3998, 3986, 3976, 3966, 3954, 3944, 3932, 3922,
+	3912, 3902, 3890, 3880, 3870, 3860, 3848, 3838, 3828, 3818, 3808, 3796, 3786, 3776, 3766, 3756,
+	3746, 3736, 3726, 3716, 3706, 3696, 3686, 3676, 3666, 3656, 3646, 3636, 3626, 3616, 3606, 3596,
+	3588, 3578, 3568, 3558, 3548, 3538, 3530, 3520, 3510, 3500, 3492, 3482, 3472, 3464, 3454, 3444,
+	3434, 3426, 3416, 3408, 3398, 3388, 3380, 3370, 3362, 3352, 3344, 3334, 3326, 3316, 3308, 3298,
+	3290, 3280, 3272, 3262, 3254, 3246, 3236, 3228, 3218, 3210, 3202, 3192, 3184, 3176, 3168, 3158,
+	3150, 3142, 3132, 3124, 3116, 3108, 3100, 3090, 3082, 3074, 3066, 3058, 3050, 3040, 3032, 3024,
+	3016, 3008, 3000, 2992, 2984, 2976, 2968, 2960, 2952, 2944, 2936, 2928, 2920, 2912, 2904, 2896,
+	2888, 2880, 2872, 2866, 2858, 2850, 2842, 2834, 2826, 2818, 2812, 2804, 2796, 2788, 2782, 2774,
+	2766, 2758, 2752, 2744, 2736, 2728, 2722, 2714, 2706, 2700, 2692, 2684, 2678, 2670, 2664, 2656,
+	2648, 2642, 2634, 2628, 2620, 2614, 2606, 2600, 2592, 2584, 2578, 2572, 2564, 2558, 2550, 2544,
+	2536, 2530, 2522, 2516, 2510, 2502, 2496, 2488, 2482, 2476, 2468, 2462, 2456, 2448, 2442, 2436,
+	2428, 2422, 2416, 2410, 2402, 2396, 2390, 2384, 2376, 2370, 2364, 2358, 2352, 2344, 2338, 2332,
+	2326, 2320, 2314, 2308, 2300, 2294, 2288, 2282, 2276, 2270, 2264, 2258, 2252, 2246, 2240, 2234,
+	2228, 2222, 2216, 2210, 2204, 2198, 2192, 2186, 2180, 2174, 2168, 2162, 2156, 2150, 2144, 2138,
+	2132, 2128, 2122, 2116, 2110, 2104, 2098, 2092, 2088, 2082, 2076, 2070, 2064, 2060, 2054, 2048,
+};
+
+/* Envelope steps per effective rate (0-63): a step is taken when the EG counter is clear
+ * under the mask, the entry is picked by the counter bits from the shift upwards. */
+static const uint8_t ymEgDecayShift[64] = {
+	0, 0, 0, 0, 12, 12, 12, 12, 11, 11, 11, 11, 10, 10, 10, 10,
+	9, 9, 9, 9, 8, 8, 8, 8, 7, 7, 7, 7, 6, 6, 6, 6,
+	5, 5, 5, 5, 4, 4, 4, 4, 3, 3, 3, 3, 2, 2, 2, 2,
+	1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint16_t ymEgDecayMask[64] = {
+	0, 0, 0, 0, 4095, 4095, 4095, 4095, 2047, 2047, 2047, 2047, 1023, 1023, 1023, 1023,
+	511, 511, 511, 511, 255, 255, 255, 255, 127, 127, 127, 127, 63, 63, 63, 63,
+	31, 31, 31, 31, 15, 15, 15, 15, 7, 7, 7, 7, 3, 3, 3, 3,
+	1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t ymEgDecay[64][16] = {
+{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+{0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1},
+{0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1},
+{0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1},
+{1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2},
+{1, 2, 1, 2, 1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2},
+{1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 2, 2, 2, 2},
+{1, 2, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+{1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1, 1},
+{1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1, 1, 2, 2, 2, 2},
+{1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2}
+};
+
+static const uint8_t ymEgAttackShift[64] = {
+	0, 0, 0, 0, 12, 12, 12, 12, 11, 11, 11, 11, 10, 10, 10, 10,
+	9, 9, 9, 9, 8, 8, 8, 8, 7, 7, 7, 7, 6, 6, 6, 6,
+	5, 5, 5, 5, 4, 4, 4, 4, 3, 3, 3, 3, 2, 2, 2, 2,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint16_t ymEgAttackMask[64] = {
+	0, 0, 0, 0, 4092, 4092, 4092, 4092, 2044, 2044, 2044, 2044, 1020, 1020, 1020, 1020,
+	508, 508, 508, 508, 252, 252, 252, 252, 124, 124, 124, 124, 60, 60, 60, 60,
+	28, 28, 28, 28, 12, 12, 12, 12, 4, 4, 4, 4, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t ymEgAttack[64][16] = {
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4, 0, 4},
+{0, 4, 0, 4, 4, 4, 0, 4, 0, 4, 0, 4, 4, 4, 0, 4},
+{0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4},
+{0, 4, 4, 4, 4, 4, 4, 4, 0, 4, 4, 4, 4, 4, 4, 4},
+{4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4},
+{4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4},
+{4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4},
+{4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4},
+{3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3},
+{3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3},
+{3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3},
+{3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255},
+{255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255}
+};
+
+#endif /* YM2413_TABLES_H_ */
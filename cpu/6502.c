@@ -16,8 +16,9 @@
 
 #include "6502.h"
 #include "../video/ppu.h"  //nmiFlipFlop
-#include "../audio/apu.h"  //apuStatus; dmcOutput; noiseShift
+#include "../audio/apu.h"  //reset_apu
 #include "../nes/nesemu.h" //ppucc
+#include "../state.h"
 
 //opcode cycle count look-up table
 static const uint8_t ctable[] = {
@@ -870,9 +871,7 @@ void _6502_power_reset(reset_t rstFlag) {
 	cpuPC = (_6502_cpuread(rst + 1) << 8) + _6502_cpuread(rst);
 	if (rstFlag == HARD_RESET) { /* TODO: what is correct behavior? */
 		_6502_cpuwrite(0x4017, 0x00);
-		apuStatus = 0; /* silence all channels */
-		noiseShift = 1;
-		dmcOutput = 0;
+		reset_apu(); /* silence all channels */
 		_6502_M2 = 0;
 	    irqPulled = 0;
 	    nmiPulled = 0;
@@ -888,6 +887,22 @@ void _6502_power_reset(reset_t rstFlag) {
 	bitset(&cpuP, 1, 2); /* set I flag */
 }
 
+//registers and interrupt lines, taken between instructions
+void _6502_state(struct stateBuffer *state) {
+	STATE(state, cpuA);
+	STATE(state, cpuX);
+	STATE(state, cpuY);
+	STATE(state, cpuP);
+	STATE(state, cpuS);
+	STATE(state, cpuPC);
+	STATE(state, irqPending);
+	STATE(state, nmiPending);
+	STATE(state, intDelay);
+	STATE(state, irqPulled);
+	STATE(state, nmiPulled);
+	STATE(state, _6502_M2);
+}
+
 void interrupt_polling() {
 	if (nmiFlipFlop && (nmiFlipFlop < (ppucc-1))) {
 		nmiPending = 1;
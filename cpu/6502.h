@@ -24,6 +24,9 @@ void    (*_6502_addcycles)  (uint8_t);
 uint8_t (*_6502_cpuread)    (uint16_t);
 void    (*_6502_cpuwrite)   (uint16_t, uint8_t);
 
+struct stateBuffer;
+
 void run_6502(void);
 void _6502_power_reset(reset_t);
+void _6502_state(struct stateBuffer *);
 #endif
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
+#include "../state.h"
 //#include "smsemu.h"
 
 #define S_SHIFT		7
@@ -1689,6 +1690,31 @@ rp2[2] = cpuHLreg;
 rp2[3] = cpuAFreg;
 }
 
+/* taken between instructions, the register pointers never change */
+void z80_state(struct stateBuffer *state) {
+STATE(state, cpuAF);
+STATE(state, cpuBC);
+STATE(state, cpuDE);
+STATE(state, cpuHL);
+STATE(state, cpuAFx);
+STATE(state, cpuBCx);
+STATE(state, cpuDEx);
+STATE(state, cpuHLx);
+STATE(state, cpuI);
+STATE(state, cpuR);
+STATE(state, cpuIX);
+STATE(state, cpuIY);
+STATE(state, cpuPC);
+STATE(state, cpuSP);
+STATE(state, iff1);
+STATE(state, iff2);
+STATE(state, iMode);
+STATE(state, halted);
+STATE(state, intDelay);
+STATE(state, z80_irqPulled);
+STATE(state, z80_nmiPulled);
+}
+
 void interrupt_polling() {
 /* mode 1: set cpuPC to 0x38 */
 }
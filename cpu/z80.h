@@ -3,7 +3,9 @@
 #include <stdio.h>
 #include <stdint.h>
 
-void run_z80(void), z80_power_reset(void);
+struct stateBuffer;
+
+void run_z80(void), z80_power_reset(void), z80_state(struct stateBuffer *);
 
 // Function pointers to be defined by the emulated machine
 uint8_t * (*read_z80_memory)(uint16_t);
@@ -0,0 +1,58 @@
+/* Headless backend
+ *
+ * Runs a machine without window or audio device and as fast as the host
+ * allows. Every frame the framebuffer and the audio mixed since the previous
+ * frame are hashed and printed, so runs can be compared between builds.
+ */
+
+#include "headless.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "my_sdl.h"
+#include "audio/mixer.h"
+
+#define AUDIO_CHUNK	4096
+
+static uint32_t crcTable[256];
+static int frameCount = 0, frameLimit = 0;
+static float audioChunk[AUDIO_CHUNK];
+static struct timespec startClock;
+static inline uint32_t crc32(uint32_t, const uint8_t *, size_t);
+
+void init_headless(int frames){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++)
+			c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+		crcTable[i] = c;
+	}
+	frameCount = 0;
+	frameLimit = frames;
+	clock_gettime(CLOCK_MONOTONIC, &startClock);
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length){
+	crc = ~crc;
+	while(length--)
+		crc = crcTable[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+void headless_frame(uint32_t *buffer, int width, int height){
+	uint32_t videoCrc = crc32(0, (uint8_t *)buffer, (size_t)width * height * sizeof(uint32_t)), audioCrc = 0;
+	int count;
+	while((count = mixer_drain(audioChunk, AUDIO_CHUNK)))
+		audioCrc = crc32(audioCrc, (uint8_t *)audioChunk, count * sizeof(float));
+	frameCount++;
+	printf("frame %d video %08x audio %08x\n", frameCount, videoCrc, audioCrc);
+	if(frameLimit && frameCount >= frameLimit)
+		quit = 1;
+}
+
+void close_headless(){
+	struct timespec endClock;
+	clock_gettime(CLOCK_MONOTONIC, &endClock);
+	double elapsed = (endClock.tv_sec - startClock.tv_sec) + (endClock.tv_nsec - startClock.tv_nsec) / 1e9;
+	printf("%d frames in %.3f s, %.1f fps\n", frameCount, elapsed, elapsed > 0 ? frameCount / elapsed : 0);
+}
@@ -0,0 +1,11 @@
+#ifndef HEADLESS_H_
+#define HEADLESS_H_
+
+#include <stdint.h>
+
+extern uint8_t quit;
+
+/* frames is the number of frames to run before quitting, 0 runs until stopped */
+void init_headless(int), headless_frame(uint32_t *, int, int), close_headless(void);
+
+#endif /* HEADLESS_H_ */
@@ -1,20 +1,84 @@
-/* TODO:
- * -FIR low pass filtering of sound
- * -save states
- */
-
 #include "jemu.h"
 #include <stdint.h>
 #include "my_sdl.h"
 #include "sms/smsemu.h"
 #include "nes/nesemu.h"
+#include "headless.h"
+#include "runahead.h"
+#include "movie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-uint8_t quit = 0, console = 0;
+uint8_t quit = 0, console = 0, cartHash[ROMHASH_SHA1_SIZE];
 sdlSettings settings;
 struct machine *currentMachine;
 int run_console();
+static void usage(const char *);
+
+static struct {
+	const char *name;
+	struct machine *machine;
+} machines[] = {
+	{ "nes_ntsc", &nes_ntsc }, { "nes_pal", &nes_pal }, { "famicom", &famicom }, { "fds", &fds },
+	{ "ntsc_us", &ntsc_us }, { "ntsc_jp", &ntsc_jp }, { "pal1", &pal1 }, { "pal2", &pal2 }
+};
 
-int main() {
+int main(int argc, char *argv[]) {
+	int opt, frames = 0, checkpoint = 0, result;
+	const char *movie = NULL;
+	MovieMode mode = MOVIE_OFF;
+	currentMachine = &nes_ntsc;
+	while((opt = getopt(argc, argv, "m:n:a:r:p:k:Hs")) != -1) {
+		switch(opt) {
+		case 'm':
+			currentMachine = find_machine(optarg);
+			if(!currentMachine) {
+				printf("Error: unknown machine %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			settings.headless = 1;
+			break;
+		case 'a':
+			runAheadFrames = atoi(optarg);
+			if(runAheadFrames > RUNAHEAD_MAX)
+				runAheadFrames = RUNAHEAD_MAX;
+			break;
+		case 'r':
+			movie = optarg;
+			mode = MOVIE_RECORD;
+			break;
+		case 'p':
+			movie = optarg;
+			mode = MOVIE_PLAY;
+			settings.headless = 1;
+			break;
+		case 'k':
+			checkpoint = atoi(optarg);
+			break;
+		case 'H':
+			settings.headless = 1;
+			break;
+		case 's':
+			settings.audioThread = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(movie)
+		open_movie(movie, mode, checkpoint);
+	snprintf(currentMachine->cartFile, PATH_MAX, "%s", argv[optind]);
 	init_sdl(&settings);
 	settings.renderQuality = "0";
 	settings.window.name = "jEmu";
@@ -30,9 +94,44 @@ int main() {
 	init_sdl_video();
 	frameTime = 16666667;
 	init_time(frameTime);
-	currentMachine = &nes_ntsc;
-	run_console();
+	if(settings.headless)
+		init_headless(frames);
+	result = run_console();
+	if(movieDivergences)
+		result = 1;
+	if(settings.headless)
+		close_headless();
 	close_sdl();
+	return result;
+}
+
+struct machine *find_machine(const char *name) {
+	for(int i = 0; i < sizeof(machines) / sizeof(machines[0]); i++) {
+		if(!strcmp(machines[i].name, name))
+			return machines[i].machine;
+	}
+	return NULL;
+}
+
+const char *machine_name(const struct machine *machine) {
+	for(int i = 0; i < sizeof(machines) / sizeof(machines[0]); i++) {
+		if(machines[i].machine == machine)
+			return machines[i].name;
+	}
+	return "";
+}
+
+void usage(const char *name) {
+	printf("Usage: %s [-m machine] [-H] [-n frames] [-a frames] [-r movie [-k frames] | -p movie] [-s] rom\n", name);
+	printf("  -m machine  nes_ntsc (default), nes_pal, famicom, fds, ntsc_us, ntsc_jp, pal1, pal2\n");
+	printf("  -H          headless, no window or audio device; prints per frame CRCs and the fps\n");
+	printf("  -n frames   run headless and quit after this many frames\n");
+	printf("  -a frames   run ahead this many frames (up to %d) to hide input lag\n", RUNAHEAD_MAX);
+	printf("  -r movie    record the buttons of every frame from power-on to a movie\n");
+	printf("  -k frames   frames between the movie's checkpoints, %d by default\n", MOVIE_CHECKPOINT);
+	printf("  -p movie    replay a movie headless on the machine it was recorded on, checking\n");
+	printf("              its checkpoints; exits with 1 if the replay diverged\n");
+	printf("  -s          run the sound chips on a worker thread\n");
 }
 
 void machine_menu_option(int option) {
@@ -78,3 +177,31 @@ int run_console() {
 	}
 	return 0;
 }
+
+void save_state() {
+	char stateName[PATH_MAX];
+	size_t size = snapshot_size();
+	uint8_t *buffer = malloc(size);
+	snprintf(stateName, sizeof(stateName), "%.*ssta", (int)strlen(currentMachine->cartFile) - 3, currentMachine->cartFile);
+	FILE *stateFile = fopen(stateName, "wb");
+	if(buffer && stateFile && save_snapshot(buffer, size))
+		fwrite(buffer, size, 1, stateFile);
+	else
+		printf("Error: could not save state to %s\n", stateName);
+	if(stateFile)
+		fclose(stateFile);
+	free(buffer);
+}
+
+void load_state() {
+	char stateName[PATH_MAX];
+	size_t size = snapshot_size();
+	uint8_t *buffer = malloc(size);
+	snprintf(stateName, sizeof(stateName), "%.*ssta", (int)strlen(currentMachine->cartFile) - 3, currentMachine->cartFile);
+	FILE *stateFile = fopen(stateName, "rb");
+	if(!buffer || !stateFile || fread(buffer, size, 1, stateFile) != 1 || load_snapshot(buffer, size))
+		printf("Error: could not load state from %s\n", stateName);
+	if(stateFile)
+		fclose(stateFile);
+	free(buffer);
+}
@@ -2,8 +2,10 @@
 #define JEMU_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include <linux/limits.h>
 #include "my_sdl.h"
+#include "romhash.h"
 
 typedef enum _region {
 	JAPAN,
@@ -34,8 +36,21 @@ struct machine {
 
 extern uint8_t quit;
 extern sdlSettings settings;
+extern uint8_t cartHash[ROMHASH_SHA1_SIZE];	/* SHA-1 of the loaded game, set by the cartridge loaders */
 struct machine *currentMachine;
 
 void (*reset_emulation)(void);
+/* machine snapshots in caller supplied memory; save returns the bytes written or 0
+ * if they don't fit, load returns 0 once the machine is restored */
+size_t (*snapshot_size)(void);
+size_t (*save_snapshot)(uint8_t *, size_t);
+int (*load_snapshot)(const uint8_t *, size_t);
+/* the buttons held on both pads, 2 bytes, for movies */
+void (*read_pads)(uint8_t *);
+void (*write_pads)(const uint8_t *);
+/* snapshot of the running machine to and from the .sta file next to the cartridge */
+void save_state(void), load_state(void);
+struct machine *find_machine(const char *);
+const char *machine_name(const struct machine *);
 
 #endif /* JEMU_H_ */
@@ -0,0 +1,653 @@
+/* ROM library
+ *
+ * A background thread walks the ROM tree once, identifies every image through
+ * the softlist index and the ROM hash cache and keeps the result in an on-disk
+ * catalog. Entries are sorted by directory and name, so the file browser pages
+ * through a directory with a binary search instead of rereading it on every
+ * scroll step. inotify keeps the catalog current while the emulator runs.
+ */
+
+#include "library.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "SDL.h"
+#include "softlist.h"
+#include "romhash.h"
+
+#define CATALOG_MAGIC	0x5441434a	/* "JCAT" */
+#define CATALOG_VERSION	1
+#define WATCH_MASK		(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define POLL_TIMEOUT	200			/* ms between checks for shutdown */
+#define EVENT_BUFFER	4096
+
+typedef enum entryType {
+	ENTRY_DIR,
+	ENTRY_FILE
+} EntryType;
+
+enum infoField {
+	INFO_TITLE,
+	INFO_YEAR,
+	INFO_PUBLISHER,
+	INFO_BOARD,
+	INFO_FIELDS
+};
+
+struct catalogHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+};
+
+/* on disk every record is followed by the path and the info strings */
+struct catalogRecord {
+	uint64_t size;
+	uint64_t inode;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	uint16_t pathLength;
+	uint8_t type;
+	uint8_t infoLength[INFO_FIELDS];
+};
+
+struct libraryEntry {
+	struct catalogRecord record;
+	char *path;
+	char *info[INFO_FIELDS];	/* NULL when unknown */
+	uint16_t nameOffset;		/* the directory part keeps its trailing slash */
+	uint8_t stale;
+};
+
+struct watch {
+	int wd;
+	char *path;
+};
+
+static struct libraryEntry *entries = NULL;
+static uint32_t entryCount = 0, entrySize = 0, sortedCount = 0, *slots = NULL, slotMask = 0;
+static struct watch *watches = NULL;
+static uint32_t watchCount = 0, watchSize = 0;
+static struct softlist nesList, smsList;
+static int8_t nesListState = 0, smsListState = 0;	/* 1 open, -1 failed */
+static uint8_t catalogReady = 0, catalogDirty = 0, needsSort = 0, rescanning = 0;	/* the sorted catalog is served while a rescan checks it */
+static char libraryRoot[PATH_MAX];
+static int inotifyFd = -1;
+static volatile int libraryRunning = 0;
+static SDL_mutex *libraryLock = NULL;
+static SDL_Thread *indexer = NULL;
+
+static int run_indexer(void *);
+static inline void load_catalog(void), save_catalog(void), full_rescan(void), finish_update(void), rebuild_slots(void), walk_directory(const char *),
+		index_file(const char *, const struct stat *), index_directory(const char *, const struct stat *), update_entry(const char *, const struct stat *, EntryType, char **),
+		append_entry(struct libraryEntry *), free_entry(struct libraryEntry *), mark_stale(const char *), add_watch(const char *), remove_watches(const char *),
+		identify_rom(const char *, const struct stat *, char **), make_label(const struct libraryEntry *, char *, size_t);
+static inline int process_events(const char *, ssize_t), compare_entries(const void *, const void *), compare_key(const struct libraryEntry *, const char *, size_t, const char *);
+static inline int32_t find_entry(const char *);
+static inline uint32_t lower_bound(const char *, size_t, const char *), path_hash(const char *);
+
+void init_library(const char *root){
+	if(libraryRunning)
+		return;
+	if(!realpath(root, libraryRoot)){
+		printf("Error: ROM library %s not found\n", root);
+		return;
+	}
+	if(!(libraryLock = SDL_CreateMutex())){
+		printf("Error: could not create library lock: %s\n", SDL_GetError());
+		return;
+	}
+	load_catalog();
+	libraryRunning = 1;
+	if(!(indexer = SDL_CreateThread(run_indexer, "library", NULL))){
+		printf("Error: could not create library thread: %s\n", SDL_GetError());
+		libraryRunning = 0;
+	}
+}
+
+void close_library(){
+	if(!libraryLock)
+		return;
+	libraryRunning = 0;
+	if(indexer)
+		SDL_WaitThread(indexer, NULL);
+	indexer = NULL;
+	for(uint32_t i = 0; i < entryCount; i++)
+		free_entry(&entries[i]);
+	free(entries);
+	free(slots);
+	entries = NULL;
+	slots = NULL;
+	entryCount = entrySize = sortedCount = slotMask = 0;
+	catalogReady = 0;
+	SDL_DestroyMutex(libraryLock);
+	libraryLock = NULL;
+}
+
+int library_list(const char *dir, int offset, struct libraryItem *items, int max){
+	char canonical[PATH_MAX + 1];
+	size_t rootLength = strlen(libraryRoot), length;
+	int total = -1;
+	if(!libraryLock || !realpath(dir, canonical))
+		return -1;
+	if(strncmp(canonical, libraryRoot, rootLength) || (canonical[rootLength] && canonical[rootLength] != '/' && libraryRoot[rootLength - 1] != '/'))
+		return -1;
+	SDL_LockMutex(libraryLock);
+	/* a directory the indexer has not reached or sorted yet is read by the caller, as is any
+	 * directory while changes from inotify wait to be sorted in */
+	int32_t index = -1;
+	if(catalogReady && (rescanning || !needsSort) && (!strcmp(canonical, libraryRoot) || ((index = find_entry(canonical)) >= 0 && (uint32_t)index < sortedCount))){
+		length = strlen(canonical);
+		if(canonical[length - 1] != '/'){
+			canonical[length++] = '/';
+			canonical[length] = '\0';
+		}
+		uint32_t first = lower_bound(canonical, length, ""), last = first;
+		while(last < sortedCount && entries[last].nameOffset == length && !memcmp(entries[last].path, canonical, length))
+			last++;
+		total = last - first + 1;
+		for(int i = offset; i < total && i < offset + max; i++){
+			struct libraryItem *item = &items[i - offset];
+			if(!i){
+				strcpy(item->name, "..");
+				strcpy(item->label, "..");
+				continue;
+			}
+			struct libraryEntry *entry = &entries[first + i - 1];
+			snprintf(item->name, sizeof(item->name), "%s", entry->path + entry->nameOffset);
+			make_label(entry, item->label, sizeof(item->label));
+		}
+	}
+	SDL_UnlockMutex(libraryLock);
+	return total;
+}
+
+int run_indexer(void *data __attribute__ ((unused))){
+	char events[EVENT_BUFFER] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pollFd;
+	if((inotifyFd = inotify_init1(IN_CLOEXEC)) < 0)
+		printf("Warning: inotify not available, the ROM library is only scanned at startup\n");
+	full_rescan();
+	pollFd.fd = inotifyFd;
+	pollFd.events = POLLIN;
+	while(libraryRunning && inotifyFd >= 0){
+		if(poll(&pollFd, 1, POLL_TIMEOUT) <= 0)
+			continue;
+		ssize_t length = read(inotifyFd, events, sizeof(events));
+		if(length <= 0)
+			continue;
+		if(process_events(events, length))
+			full_rescan();
+		else{
+			finish_update();
+			save_catalog();
+		}
+	}
+	if(inotifyFd >= 0)
+		close(inotifyFd);
+	inotifyFd = -1;
+	for(uint32_t i = 0; i < watchCount; i++)
+		free(watches[i].path);
+	free(watches);
+	watches = NULL;
+	watchCount = watchSize = 0;
+	return 0;
+}
+
+/* returns 1 when the kernel dropped events and the tree has to be walked again */
+int process_events(const char *buffer, ssize_t length){
+	char path[PATH_MAX];
+	struct stat pathStat;
+	const struct inotify_event *event;
+	for(const char *ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + event->len){
+		event = (const struct inotify_event *)ptr;
+		if(event->mask & IN_Q_OVERFLOW)
+			return 1;
+		if(event->mask & IN_IGNORED){
+			for(uint32_t i = 0; i < watchCount; i++){
+				if(watches[i].wd == event->wd){
+					free(watches[i].path);
+					watches[i] = watches[--watchCount];
+					break;
+				}
+			}
+			continue;
+		}
+		if(!event->len || event->name[0] == '.')
+			continue;
+		path[0] = '\0';
+		for(uint32_t i = 0; i < watchCount; i++){
+			if(watches[i].wd == event->wd){
+				snprintf(path, sizeof(path), "%s/%s", watches[i].path, event->name);
+				break;
+			}
+		}
+		if(!path[0])
+			continue;
+		if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+			mark_stale(path);
+			if(event->mask & IN_ISDIR)
+				remove_watches(path);
+		}
+		else if(stat(path, &pathStat))
+			continue;
+		else if((event->mask & IN_ISDIR) && S_ISDIR(pathStat.st_mode)){
+			index_directory(path, &pathStat);
+			walk_directory(path);
+		}
+		else if((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && S_ISREG(pathStat.st_mode))
+			index_file(path, &pathStat);
+	}
+	return 0;
+}
+
+void full_rescan(){
+	SDL_LockMutex(libraryLock);
+	for(uint32_t i = 0; i < entryCount; i++)
+		entries[i].stale = 1;
+	needsSort = 1;
+	rescanning = 1;
+	SDL_UnlockMutex(libraryLock);
+	walk_directory(libraryRoot);
+	if(!libraryRunning)
+		return; /* interrupted, the previous catalog stays on disk */
+	finish_update();
+	SDL_LockMutex(libraryLock);
+	catalogReady = 1;
+	rescanning = 0;
+	SDL_UnlockMutex(libraryLock);
+	save_catalog();
+}
+
+void walk_directory(const char *path){
+	char child[PATH_MAX];
+	struct dirent *dirEntry;
+	struct stat childStat;
+	DIR *dir = opendir(path);
+	if(!dir)
+		return;
+	add_watch(path);
+	while(libraryRunning && (dirEntry = readdir(dir))){
+		if(dirEntry->d_name[0] == '.')
+			continue;
+		if(snprintf(child, sizeof(child), "%s/%s", path, dirEntry->d_name) >= sizeof(child))
+			continue;
+		if(lstat(child, &childStat))
+			continue;
+		if(S_ISDIR(childStat.st_mode)){
+			index_directory(child, &childStat);
+			walk_directory(child);
+		}
+		/* links to files are followed, links to directories could loop */
+		else if(S_ISLNK(childStat.st_mode) && !stat(child, &childStat) && S_ISREG(childStat.st_mode))
+			index_file(child, &childStat);
+		else if(S_ISREG(childStat.st_mode))
+			index_file(child, &childStat);
+	}
+	closedir(dir);
+}
+
+void index_directory(const char *path, const struct stat *dirStat){
+	SDL_LockMutex(libraryLock);
+	int32_t index = find_entry(path);
+	if(index >= 0 && entries[index].record.type == ENTRY_DIR){
+		entries[index].stale = 0;
+		SDL_UnlockMutex(libraryLock);
+		return;
+	}
+	SDL_UnlockMutex(libraryLock);
+	char *info[INFO_FIELDS] = { NULL };
+	update_entry(path, dirStat, ENTRY_DIR, info);
+}
+
+/* unchanged files keep their entry, everything else is identified again */
+void index_file(const char *path, const struct stat *fileStat){
+	SDL_LockMutex(libraryLock);
+	int32_t index = find_entry(path);
+	if(index >= 0){
+		struct catalogRecord *record = &entries[index].record;
+		if(record->type == ENTRY_FILE && record->size == fileStat->st_size && record->inode == fileStat->st_ino &&
+				record->mtimeSec == fileStat->st_mtim.tv_sec && record->mtimeNsec == fileStat->st_mtim.tv_nsec){
+			entries[index].stale = 0;
+			SDL_UnlockMutex(libraryLock);
+			return;
+		}
+	}
+	SDL_UnlockMutex(libraryLock);
+	char *info[INFO_FIELDS] = { NULL };
+	identify_rom(path, fileStat, info);
+	update_entry(path, fileStat, ENTRY_FILE, info);
+}
+
+/* takes ownership of the info strings */
+void update_entry(const char *path, const struct stat *pathStat, EntryType type, char **info){
+	struct libraryEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.record.size = pathStat->st_size;
+	entry.record.inode = pathStat->st_ino;
+	entry.record.mtimeSec = pathStat->st_mtim.tv_sec;
+	entry.record.mtimeNsec = pathStat->st_mtim.tv_nsec;
+	entry.record.type = type;
+	for(int i = 0; i < INFO_FIELDS; i++){
+		entry.info[i] = info[i];
+		entry.record.infoLength[i] = info[i] ? strlen(info[i]) : 0;
+	}
+	SDL_LockMutex(libraryLock);
+	int32_t index = find_entry(path);
+	if(index >= 0){
+		entry.path = entries[index].path;
+		entry.nameOffset = entries[index].nameOffset;
+		entry.record.pathLength = entries[index].record.pathLength;
+		for(int i = 0; i < INFO_FIELDS; i++)
+			free(entries[index].info[i]);
+		entries[index] = entry;
+	}
+	else{
+		entry.path = strdup(path);
+		entry.record.pathLength = strlen(path);
+		entry.nameOffset = strrchr(path, '/') - path + 1;
+		append_entry(&entry);
+		needsSort = 1;
+	}
+	catalogDirty = 1;
+	SDL_UnlockMutex(libraryLock);
+}
+
+void identify_rom(const char *path, const struct stat *romStat, char **info){
+	const char *ext = strrchr(path, '.');
+	const struct softlistEntry *match = NULL;
+	struct softlist *list;
+	RomArea area;
+	uint8_t sha1[ROMHASH_SHA1_SIZE];
+	int count = 0;
+	if(!ext || !romStat->st_size)
+		return;
+	if(!strcasecmp(ext, ".nes")){
+		if(!nesListState)
+			nesListState = open_softlist(&nesList, "softlist/nes.xml", "prg") ? -1 : 1;
+		list = (nesListState > 0) ? &nesList : NULL;
+		area = AREA_NES_PRG;
+	}
+	else if(!strcasecmp(ext, ".sms")){
+		if(!smsListState)
+			smsListState = open_softlist(&smsList, "softlist/sms.xml", "rom") ? -1 : 1;
+		list = (smsListState > 0) ? &smsList : NULL;
+		area = AREA_SMS_ROM;
+	}
+	else
+		return;
+	if(!list)
+		return;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return;
+	uint8_t *map = mmap(NULL, romStat->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return;
+	const uint8_t *data = map;
+	size_t size = romStat->st_size;
+	if(area == AREA_NES_PRG){
+		/* same PRG hash the cartridge loader looks up */
+		if(size < 0x10 || memcmp(map, "NES\x1a", 4) || (0x10 + ((size_t)map[4] << 14)) > size){
+			munmap(map, romStat->st_size);
+			return;
+		}
+		data = map + 0x10;
+		size = (size_t)map[4] << 14;
+	}
+	rom_sha1(path, romStat, area, data, size, sha1);
+	munmap(map, romStat->st_size);
+	if(!(match = softlist_find(list, sha1, &count)))
+		return;
+	match += count - 1; /* the loaders let the last duplicate win */
+	if(match->title[0])
+		info[INFO_TITLE] = strdup(match->title);
+	if(match->year[0])
+		info[INFO_YEAR] = strdup(match->year);
+	if(match->publisher[0])
+		info[INFO_PUBLISHER] = strdup(match->publisher);
+	if(match->pcb[0] || match->slot[0])
+		info[INFO_BOARD] = strdup(match->pcb[0] ? match->pcb : match->slot);
+}
+
+void make_label(const struct libraryEntry *entry, char *label, size_t size){
+	const char *year = entry->info[INFO_YEAR], *publisher = entry->info[INFO_PUBLISHER];
+	size_t n;
+	if(!entry->info[INFO_TITLE]){
+		snprintf(label, size, "%s", entry->path + entry->nameOffset);
+		return;
+	}
+	n = snprintf(label, size, "%s", entry->info[INFO_TITLE]);
+	if(n < size && (year || publisher))
+		n += snprintf(label + n, size - n, " (%s%s%s)", year ? year : "", (year && publisher) ? ", " : "", publisher ? publisher : "");
+	if(n < size && entry->info[INFO_BOARD])
+		snprintf(label + n, size - n, " [%s]", entry->info[INFO_BOARD]);
+}
+
+/* the entry itself and everything below it */
+void mark_stale(const char *path){
+	size_t length = strlen(path);
+	SDL_LockMutex(libraryLock);
+	for(uint32_t i = 0; i < entryCount; i++){
+		if(!strncmp(entries[i].path, path, length) && (!entries[i].path[length] || entries[i].path[length] == '/')){
+			entries[i].stale = 1;
+			needsSort = 1;
+		}
+	}
+	SDL_UnlockMutex(libraryLock);
+}
+
+/* drops stale entries and sorts appended ones into place */
+void finish_update(){
+	uint32_t kept = 0;
+	SDL_LockMutex(libraryLock);
+	if(needsSort){
+		for(uint32_t i = 0; i < entryCount; i++){
+			if(entries[i].stale){
+				free_entry(&entries[i]);
+				catalogDirty = 1;
+			}
+			else
+				entries[kept++] = entries[i];
+		}
+		entryCount = kept;
+		qsort(entries, entryCount, sizeof(struct libraryEntry), compare_entries);
+		sortedCount = entryCount;
+		rebuild_slots();
+		needsSort = 0;
+	}
+	SDL_UnlockMutex(libraryLock);
+}
+
+void add_watch(const char *path){
+	if(inotifyFd < 0)
+		return;
+	int wd = inotify_add_watch(inotifyFd, path, WATCH_MASK);
+	if(wd < 0)
+		return;
+	/* a directory moved inside the tree keeps its watch */
+	for(uint32_t i = 0; i < watchCount; i++){
+		if(watches[i].wd == wd){
+			free(watches[i].path);
+			watches[i].path = strdup(path);
+			return;
+		}
+	}
+	if(watchCount == watchSize){
+		watchSize = watchSize ? (watchSize << 1) : 64;
+		if(!(watches = realloc(watches, watchSize * sizeof(struct watch)))){
+			printf("Error: could not allocate library watches\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	watches[watchCount].wd = wd;
+	watches[watchCount++].path = strdup(path);
+}
+
+/* IN_IGNORED removes the table entries afterwards */
+void remove_watches(const char *path){
+	size_t length = strlen(path);
+	for(uint32_t i = 0; i < watchCount; i++){
+		if(!strncmp(watches[i].path, path, length) && (!watches[i].path[length] || watches[i].path[length] == '/'))
+			inotify_rm_watch(inotifyFd, watches[i].wd);
+	}
+}
+
+void save_catalog(){
+	char tmpFile[PATH_MAX];
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", LIBRARY_FILE);
+	SDL_LockMutex(libraryLock);
+	if(!catalogDirty){
+		SDL_UnlockMutex(libraryLock);
+		return;
+	}
+	FILE *file = fopen(tmpFile, "wb");
+	if(!file){
+		SDL_UnlockMutex(libraryLock);
+		return;
+	}
+	struct catalogHeader header = { CATALOG_MAGIC, CATALOG_VERSION, entryCount };
+	fwrite(&header, sizeof(header), 1, file);
+	for(uint32_t i = 0; i < entryCount; i++){
+		fwrite(&entries[i].record, sizeof(struct catalogRecord), 1, file);
+		fwrite(entries[i].path, entries[i].record.pathLength, 1, file);
+		for(int j = 0; j < INFO_FIELDS; j++)
+			fwrite(entries[i].info[j], entries[i].record.infoLength[j], 1, file);
+	}
+	catalogDirty = 0;
+	SDL_UnlockMutex(libraryLock);
+	if(fclose(file))
+		remove(tmpFile);
+	else
+		rename(tmpFile, LIBRARY_FILE);
+}
+
+void load_catalog(){
+	struct catalogHeader header;
+	struct libraryEntry entry;
+	FILE *file = fopen(LIBRARY_FILE, "rb");
+	if(!file)
+		return;
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != CATALOG_MAGIC || header.version != CATALOG_VERSION){
+		fclose(file);
+		return;
+	}
+	SDL_LockMutex(libraryLock);
+	for(uint32_t i = 0; i < header.count; i++){
+		memset(&entry, 0, sizeof(entry));
+		if(fread(&entry.record, sizeof(struct catalogRecord), 1, file) != 1)
+			break;
+		int failed = !(entry.path = calloc(entry.record.pathLength + 1, 1)) || fread(entry.path, entry.record.pathLength, 1, file) != 1;
+		for(int j = 0; j < INFO_FIELDS && !failed; j++){
+			if(entry.record.infoLength[j])
+				failed = !(entry.info[j] = calloc(entry.record.infoLength[j] + 1, 1)) || fread(entry.info[j], entry.record.infoLength[j], 1, file) != 1;
+		}
+		char *slash = entry.path ? strrchr(entry.path, '/') : NULL;
+		if(failed || !slash){
+			free_entry(&entry); /* truncated catalog, the rescan fills in the rest */
+			break;
+		}
+		entry.nameOffset = slash - entry.path + 1;
+		append_entry(&entry);
+	}
+	fclose(file);
+	qsort(entries, entryCount, sizeof(struct libraryEntry), compare_entries);
+	sortedCount = entryCount;
+	rebuild_slots();
+	catalogReady = 1;
+	SDL_UnlockMutex(libraryLock);
+}
+
+void append_entry(struct libraryEntry *entry){
+	if(entryCount == entrySize){
+		entrySize = entrySize ? (entrySize << 1) : 1024;
+		if(!(entries = realloc(entries, entrySize * sizeof(struct libraryEntry)))){
+			printf("Error: could not allocate library catalog\n");
+			exit(EXIT_FAILURE);
+		}
+		rebuild_slots();
+	}
+	uint32_t i = path_hash(entry->path) & slotMask;
+	while(slots[i])
+		i = (i + 1) & slotMask;
+	entries[entryCount] = *entry;
+	slots[i] = ++entryCount;
+}
+
+void free_entry(struct libraryEntry *entry){
+	free(entry->path);
+	for(int i = 0; i < INFO_FIELDS; i++)
+		free(entry->info[i]);
+}
+
+/* path lookups go through an open addressed table at twice the entry capacity */
+void rebuild_slots(){
+	free(slots);
+	slotMask = (entrySize << 1) - 1;
+	if(!(slots = calloc(slotMask + 1, sizeof(uint32_t)))){
+		printf("Error: could not allocate library catalog\n");
+		exit(EXIT_FAILURE);
+	}
+	for(uint32_t n = 0; n < entryCount; n++){
+		uint32_t i = path_hash(entries[n].path) & slotMask;
+		while(slots[i])
+			i = (i + 1) & slotMask;
+		slots[i] = n + 1;
+	}
+}
+
+uint32_t path_hash(const char *path){
+	uint32_t hash = 2166136261u;
+	while(*path)
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	return hash;
+}
+
+int32_t find_entry(const char *path){
+	if(!entrySize)
+		return -1;
+	for(uint32_t i = path_hash(path) & slotMask; slots[i]; i = (i + 1) & slotMask){
+		if(!strcmp(entries[slots[i] - 1].path, path))
+			return slots[i] - 1;
+	}
+	return -1;
+}
+
+/* first sorted entry not below (dir, name) */
+uint32_t lower_bound(const char *dir, size_t dirLength, const char *name){
+	uint32_t low = 0, high = sortedCount, mid;
+	while(low < high){
+		mid = low + ((high - low) >> 1);
+		if(compare_key(&entries[mid], dir, dirLength, name) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* orders by directory first so the children of a directory are contiguous */
+int compare_key(const struct libraryEntry *entry, const char *dir, size_t dirLength, const char *name){
+	size_t n = (entry->nameOffset < dirLength) ? entry->nameOffset : dirLength;
+	int result = memcmp(entry->path, dir, n);
+	if(result)
+		return result;
+	if(entry->nameOffset != dirLength)
+		return (entry->nameOffset < dirLength) ? -1 : 1;
+	return strcmp(entry->path + entry->nameOffset, name);
+}
+
+int compare_entries(const void *a, const void *b){
+	const struct libraryEntry *eb = b;
+	return compare_key(a, eb->path, eb->nameOffset, eb->path + eb->nameOffset);
+}
@@ -0,0 +1,20 @@
+#ifndef LIBRARY_H_
+#define LIBRARY_H_
+
+#include <stdint.h>
+
+#define LIBRARY_FILE		"softlist/library.cat"
+#define LIBRARY_NAME_SIZE	200
+
+struct libraryItem {
+	char name[LIBRARY_NAME_SIZE];	/* file name inside the directory */
+	char label[LIBRARY_NAME_SIZE];	/* title, year, publisher and board of identified ROMs, otherwise the name */
+};
+
+/* root is the directory tree the indexer thread walks and watches */
+void init_library(const char *), close_library(void);
+/* fills up to max items of dir starting at offset, returns the number of entries in dir
+ * or -1 while dir is not in the catalog */
+int library_list(const char *, int, struct libraryItem *, int);
+
+#endif /* LIBRARY_H_ */
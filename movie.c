@@ -0,0 +1,207 @@
+/* Input movies
+ *
+ * A movie holds the buttons of every frame, so a replay takes the machine
+ * through the same code paths as the recording did, as fast as the host
+ * allows when run headless. The buttons only change when render_frame reads
+ * the input at the end of a frame, which can be in the middle of an
+ * instruction, so they are sampled and fed back right there. Rewind and
+ * run-ahead are left out while a movie runs. Every checkpoint-th frame the
+ * machine snapshot is hashed at the next instruction boundary; a replay
+ * hashing differently has diverged from the recording.
+ */
+
+#include "movie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/limits.h>
+#include "jemu.h"
+#include "runahead.h"
+
+MovieMode movieMode = MOVIE_OFF;
+uint8_t movieToggle = 0;
+uint32_t movieDivergences = 0;
+static MovieMode pendingMode = MOVIE_OFF;
+static char movieName[PATH_MAX];
+static FILE *movieFile = NULL;
+static struct movieHeader header;
+static uint32_t frame = 0;
+static uint16_t checkpointFrames = MOVIE_CHECKPOINT;
+static uint8_t *snapshot = NULL;
+static size_t snapshotSize = 0;
+static inline void begin_recording(uint8_t), begin_replay(void), hash_machine(uint8_t *), size_snapshot(size_t);
+
+void open_movie(const char *name, MovieMode mode, int checkpoint){
+	snprintf(movieName, sizeof(movieName), "%s", name);
+	pendingMode = mode;
+	if(checkpoint > 0 && checkpoint <= UINT16_MAX)
+		checkpointFrames = checkpoint;
+	if(mode != MOVIE_PLAY)
+		return;
+	movieFile = fopen(movieName, "rb");
+	if(!movieFile || fread(&header, sizeof(header), 1, movieFile) != 1 || header.magic != MOVIE_MAGIC
+			|| header.version != MOVIE_VERSION || !header.checkpoint){
+		printf("Error: %s is not a movie\n", movieName);
+		exit(EXIT_FAILURE);
+	}
+	header.machine[MOVIE_NAME_LENGTH - 1] = '\0';
+	currentMachine = find_machine(header.machine);
+	if(!currentMachine){
+		printf("Error: %s was recorded on unknown machine %s\n", movieName, header.machine);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* the machine is at power-on */
+void start_movie(){
+	if(pendingMode == MOVIE_RECORD)
+		begin_recording(0);
+	else if(pendingMode == MOVIE_PLAY)
+		begin_replay();
+	pendingMode = MOVIE_OFF;
+}
+
+void movie_input(){
+	uint8_t pads[MOVIE_PADS];
+	if(!movieMode)
+		return;
+	frame++;
+	if(movieMode == MOVIE_RECORD){
+		read_pads(pads);
+		fwrite(pads, MOVIE_PADS, 1, movieFile);
+		return;
+	}
+	if(fread(pads, MOVIE_PADS, 1, movieFile) != 1){
+		printf("Error: %s ends at frame %u of %u\n", movieName, frame, header.frames);
+		exit(EXIT_FAILURE);
+	}
+	write_pads(pads);
+}
+
+void movie_frame(){
+	uint8_t hash[ROMHASH_SHA1_SIZE], recorded[ROMHASH_SHA1_SIZE];
+	if(movieMode == MOVIE_RECORD && !(frame % header.checkpoint)){
+		hash_machine(hash);
+		fwrite(hash, ROMHASH_SHA1_SIZE, 1, movieFile);
+	}
+	else if(movieMode == MOVIE_PLAY){
+		if(!(frame % header.checkpoint)){
+			if(fread(recorded, ROMHASH_SHA1_SIZE, 1, movieFile) != 1){
+				printf("Error: %s ends at frame %u of %u\n", movieName, frame, header.frames);
+				exit(EXIT_FAILURE);
+			}
+			hash_machine(hash);
+			if(memcmp(hash, recorded, ROMHASH_SHA1_SIZE) && !movieDivergences++)
+				printf("Movie diverged at frame %u\n", frame);
+		}
+		if(frame >= header.frames){
+			stop_movie();
+			quit = 1;
+		}
+	}
+	if(movieToggle){
+		movieToggle = 0;
+		if(movieMode)
+			stop_movie();
+		else{
+			snprintf(movieName, sizeof(movieName), "%.*smov", (int)strlen(currentMachine->cartFile) - 3, currentMachine->cartFile);
+			begin_recording(1);
+		}
+	}
+}
+
+void stop_movie(){
+	if(!movieMode)
+		return;
+	if(movieMode == MOVIE_RECORD){
+		header.frames = frame;
+		if(ferror(movieFile) || fseek(movieFile, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, movieFile) != 1)
+			printf("Error: could not write movie %s\n", movieName);
+		else
+			printf("Recorded %u frames to %s\n", frame, movieName);
+	}
+	else
+		printf("Replayed %u of %u frames, %u checkpoints, %u diverged\n", frame, header.frames, frame / header.checkpoint, movieDivergences);
+	fclose(movieFile);
+	movieFile = NULL;
+	movieMode = MOVIE_OFF;
+	free(snapshot);
+	snapshot = NULL;
+	snapshotSize = 0;
+}
+
+void begin_recording(uint8_t fromSnapshot){
+	uint8_t pads[MOVIE_PADS];
+	header = (struct movieHeader){ .magic = MOVIE_MAGIC, .version = MOVIE_VERSION, .checkpoint = checkpointFrames };
+	snprintf(header.machine, sizeof(header.machine), "%s", machine_name(currentMachine));
+	memcpy(header.romSha1, cartHash, ROMHASH_SHA1_SIZE);
+	if(fromSnapshot){
+		size_snapshot(snapshot_size());
+		if(!save_snapshot(snapshot, snapshotSize)){
+			printf("Error: could not take the snapshot to record movie %s from\n", movieName);
+			return;
+		}
+		header.snapshotSize = snapshotSize;
+	}
+	movieFile = fopen(movieName, "wb");
+	if(!movieFile){
+		printf("Error: could not record movie to %s\n", movieName);
+		return;
+	}
+	fwrite(&header, sizeof(header), 1, movieFile);
+	if(fromSnapshot)
+		fwrite(snapshot, snapshotSize, 1, movieFile);
+	read_pads(pads);
+	fwrite(pads, MOVIE_PADS, 1, movieFile);
+	reset_run_ahead();
+	frame = 0;
+	movieMode = MOVIE_RECORD;
+	printf("Recording movie to %s\n", movieName);
+}
+
+void begin_replay(){
+	uint8_t pads[MOVIE_PADS];
+	if(memcmp(header.romSha1, cartHash, ROMHASH_SHA1_SIZE)){
+		printf("Error: %s was recorded with another game\n", movieName);
+		exit(EXIT_FAILURE);
+	}
+	if(header.snapshotSize){
+		size_snapshot(header.snapshotSize);
+		if(fread(snapshot, snapshotSize, 1, movieFile) != 1 || load_snapshot(snapshot, snapshotSize)){
+			printf("Error: the snapshot in %s does not fit this machine\n", movieName);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(fread(pads, MOVIE_PADS, 1, movieFile) != 1){
+		printf("Error: %s holds no frames\n", movieName);
+		exit(EXIT_FAILURE);
+	}
+	write_pads(pads);
+	reset_run_ahead();
+	frame = 0;
+	movieDivergences = 0;
+	movieMode = MOVIE_PLAY;
+	if(!header.frames){
+		stop_movie();
+		quit = 1;
+	}
+}
+
+void hash_machine(uint8_t *hash){
+	size_snapshot(snapshot_size());
+	if(!save_snapshot(snapshot, snapshotSize))
+		memset(snapshot, 0, snapshotSize);
+	romhash_compute(snapshot, snapshotSize, hash);
+}
+
+void size_snapshot(size_t size){
+	if(size == snapshotSize)
+		return;
+	free(snapshot);
+	snapshotSize = size;
+	snapshot = malloc(snapshotSize);
+	if(!snapshot){
+		printf("Error: could not allocate movie snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+}
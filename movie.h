@@ -0,0 +1,44 @@
+#ifndef MOVIE_H_
+#define MOVIE_H_
+
+#include <stdint.h>
+#include "romhash.h"
+
+#define MOVIE_MAGIC			0x564d454a	/* "JEMV" */
+#define MOVIE_VERSION		1
+#define MOVIE_PADS			2			/* bytes of buttons per frame */
+#define MOVIE_CHECKPOINT	60			/* default frames between checkpoints */
+#define MOVIE_NAME_LENGTH	16
+
+typedef enum movieMode {
+	MOVIE_OFF,
+	MOVIE_RECORD,
+	MOVIE_PLAY
+} MovieMode;
+
+/* The file is the header, the starting snapshot if any and then the buttons of every
+ * frame, the first entry holding those at the start. Every checkpoint-th frame the
+ * entry is followed by the SHA-1 of the machine snapshot at that frame. */
+struct movieHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t checkpoint;		/* frames between checkpoints */
+	char machine[MOVIE_NAME_LENGTH];
+	uint8_t romSha1[ROMHASH_SHA1_SIZE];
+	uint32_t frames;
+	uint32_t snapshotSize;		/* 0 when the movie starts at power-on */
+};
+
+extern MovieMode movieMode;
+extern uint8_t movieToggle;		/* set by the movie key, recording starts or stops at the next frame */
+extern uint32_t movieDivergences;
+
+/* a movie from the command line, started with the machine at power-on; replays pick
+ * the machine they were recorded on */
+void open_movie(const char *, MovieMode, int);
+/* called by render_frame where the input is read, the buttons are recorded or replaced */
+void movie_input(void);
+/* called by the machine between instructions once a frame of the real timeline is done */
+void movie_frame(void), start_movie(void), stop_movie(void);
+
+#endif /* MOVIE_H_ */
@@ -19,10 +19,16 @@
 #include "sms/smsemu.h"
 #include "audio/sn79489.h"
 #include "audio/ym2413.h"
+#include "audio/mixer.h"
+#include "headless.h"
+#include "library.h"
 #include "cpu/z80.h"
 #include "sms/smscartridge.h"
 #include "jemu.h"
 #include "nes/fds.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "movie.h"
 
 #define RENDER_FLAGS	(SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE)
 
@@ -34,7 +40,7 @@ TTF_Font* Sans;
 SDL_Color menuTextColor = {0xff, 0xff, 0xff, 0x00};
 uint8_t menuBgColor[4] = {0x00, 0x00, 0x00, 0x00};
 uint8_t menuActiveColor[4] = {0x80, 0x80, 0x80, 0x00};
-uint_fast8_t isPaused = 0, fullscreen = 0, stateSave = 0, stateLoad = 0, vsync = 0, throttle = 1, showMenu = 0;
+uint_fast8_t isPaused = 0, fullscreen = 0, stateSave = 0, stateLoad = 0, frameDone = 0, frameSkip = 0, vsync = 0, throttle = 1, showMenu = 0, forceRedraw = 1, audioStats = 0;
 sdlSettings *currentSettings;
 menuItem prototypeMenu, mainMenu, fileMenu, graphicsMenu, machineMenu, audioMenu, fileList, machineList, *currentMenu;
 io_function io_func;
@@ -43,14 +49,17 @@ uint16_t channelMask = 0x1ff, rhythmMask = 0x1f;
 DIR *currentDir;
 char *defaultDir = "/home/jonas/git/roms/", workDir[PATH_MAX];
 int fileListOffset = 0, oldFileListOffset = 0;
+static char fileNames[MAX_MENU_ITEMS][MAX_MENU_ITEM_LENGTH]; /* file list rows show titles, these are the names behind them */
+static struct libraryItem libraryItems[MAX_MENU_ITEMS];
 float frameTime, fps;
 int clockRate;
 SDL_DisplayMode mode;
 SDL_Rect SrcR, TrgR;
 
-static inline void render_window (windowHandle *, uint32_t *), idle_time(float), create_handle (windowHandle *), draw_menu(menuItem *), set_menu(void), get_menu_size(menuItem *, int, int), get_max_menu_size(menuItem *), create_menu(void), main_menu_option(int), clear_screen(SDL_Renderer *);
+static inline void render_window (windowHandle *, uint32_t *, uint8_t *), idle_time(float), create_handle (windowHandle *), draw_menu(menuItem *), set_menu(void), get_menu_size(menuItem *, int, int), get_max_menu_size(menuItem *), create_menu(void), main_menu_option(int), clear_screen(SDL_Renderer *);
 static inline void option_fullscreen(void), option_quit(void), option_open_file(void), game_io(void), menu_io(void), file_io(void), get_parent_dir(char *), add_slash(char *), set_screen_cropratio(windowHandle *handle);
 static inline float diff_time(struct timespec *, struct timespec *);
+static void audio_callback(void *, Uint8 *, int);
 static inline int is_directory(const char *), create_file_list(void), file_count(DIR *), fileSorter(const void *const, const void *const);
 static inline struct dirent ** read_directory(DIR *);
 void (*current_options)();
@@ -63,6 +72,8 @@ void init_sdl(sdlSettings *settings) {
     io_func = &game_io;
     current_options = &main_menu_option;
     currentSettings = settings;
+    if (settings->headless)
+        return;
     SDL_version ver;
     SDL_GetVersion(&ver);
     printf("Running SDL version: %d.%d.%d\n",ver.major,ver.minor,ver.patch);
@@ -78,9 +89,12 @@ void init_sdl(sdlSettings *settings) {
     else
         strcpy(workDir, defaultDir);
     add_slash(workDir);
+    init_library(workDir);
 }
 
 void init_sdl_video(){
+	if(currentSettings->headless)
+		return;
 	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY,currentSettings->renderQuality);
 	destroy_handle(&currentSettings->window);
 	create_handle (&currentSettings->window);
@@ -104,18 +118,27 @@ void init_sdl_video(){
 }
 
 void init_sdl_audio(){
+	if(currentSettings->headless){
+		init_mixer(currentSettings->audioBufferSize);
+		return;
+	}
 	wantedAudioSettings.freq = currentSettings->audioFrequency;
 	wantedAudioSettings.format = AUDIO_F32;
 	wantedAudioSettings.channels = currentSettings->channels;
-	wantedAudioSettings.callback = NULL;
+	wantedAudioSettings.callback = audio_callback;
 	wantedAudioSettings.samples = currentSettings->audioBufferSize >> 1; /* Must be less than buffer size to prevent increasing lag... */
 	SDL_CloseAudio();
+	/* the callback is stopped, sources get added by the chips after this */
+	init_mixer(currentSettings->audioBufferSize);
 	if (SDL_OpenAudio(&wantedAudioSettings, &audioSettings) < 0)
 	    SDL_Log("Failed to open audio: %s", SDL_GetError());
 	else if (audioSettings.format != wantedAudioSettings.format)
 	    SDL_Log("The desired audio format is not available.");
 	SDL_PauseAudio(0);
-	SDL_ClearQueuedAudio(1);
+}
+
+void audio_callback(void *userdata, Uint8 *stream, int len){
+	mixer_read((float *)stream, len / sizeof(float));
 }
 
 void create_handle (windowHandle *handle){
@@ -130,6 +153,7 @@ void create_handle (windowHandle *handle){
 		printf("SDL_CreateTexture failed: %s\n", SDL_GetError());
 		exit(EXIT_FAILURE);}
 	handle->windowID = SDL_GetWindowID(handle->win);
+	forceRedraw = 1;
 }
 
 void destroy_handle (windowHandle *handle){
@@ -144,10 +168,15 @@ void destroy_handle (windowHandle *handle){
 }
 
 void close_sdl(){
+	if(currentSettings->headless){
+		close_mixer();
+		return;
+	}
 	destroy_handle (&currentSettings->window);
 	TTF_CloseFont(Sans);
-	SDL_ClearQueuedAudio(1);
 	SDL_CloseAudio();
+	close_mixer();
+	close_library();
 	SDL_Quit();
 }
 
@@ -162,14 +191,28 @@ void set_screen_cropratio(windowHandle *handle){
 	TrgR.h = currentSettings->desktopHeight;
 }
 
-void render_window (windowHandle * handle, uint32_t * buffer){
-	void *pix;
-	int pitch;
-	if(SDL_LockTexture(handle->tex, NULL, &pix, &pitch)){
-		printf("SDL_LockTexture failed: %s\n", SDL_GetError());
-		exit(EXIT_FAILURE);}
-	memcpy(pix, buffer, pitch * handle->screenHeight);
-	SDL_UnlockTexture(handle->tex);
+void render_window (windowHandle * handle, uint32_t * buffer, uint8_t * dirtyLines){
+	SDL_Rect lineRect = {0, 0, handle->screenWidth, 0};
+	int line = 0, updated = 0;
+	/* Only upload runs of scanlines that changed since the last frame */
+	while(line < handle->screenHeight){
+		if(!dirtyLines[line] && !forceRedraw){
+			line++;
+			continue;
+		}
+		lineRect.y = line;
+		while(line < handle->screenHeight && (dirtyLines[line] || forceRedraw))
+			dirtyLines[line++] = 0;
+		lineRect.h = line - lineRect.y;
+		if(SDL_UpdateTexture(handle->tex, &lineRect, buffer + (lineRect.y * handle->screenWidth), handle->screenWidth * sizeof(uint32_t))){
+			printf("SDL_UpdateTexture failed: %s\n", SDL_GetError());
+			exit(EXIT_FAILURE);}
+		updated = 1;
+	}
+	/* Nothing to show, keep the last presented frame unless vsync paces us */
+	if(!updated && !showMenu && !vsync)
+		return;
+	forceRedraw = 0;
 	SDL_SetRenderTarget(handle->rend, whiteboard);
 	SDL_RenderCopy(handle->rend, handle->tex, &SrcR, NULL);
 	if(showMenu){
@@ -195,7 +238,7 @@ void clear_screen(SDL_Renderer *rend){
 /* TIME KEEPING */
 /****************/
 
-struct timespec throttleClock, startClock, endClock;
+struct timespec throttleClock, startClock, endClock, presentClock;
 int frameCounter;
 void init_time (float time){
 	frameCounter = 0;
@@ -217,10 +260,13 @@ void idle_time (float time){
 			printf("%f\n",fps);
 			set_timings(2);
 		}
+		if(audioStats)
+			printf("audio ratio %f fill %.0f underruns %u overruns %u\n", mixerRatio, mixerFill, atomic_load(&mixerUnderruns), atomic_load(&mixerOverruns));
 		frameCounter = 0;
 		clock_gettime(CLOCK_MONOTONIC, &startClock);
 	}
-	if(throttle){
+	/* with vsync the present already blocks, audio follows through rate control */
+	if(throttle && !vsync){
 	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &throttleClock, NULL);
 	throttleClock.tv_nsec += time;
 	throttleClock.tv_sec += throttleClock.tv_nsec / 1000000000;
@@ -239,10 +285,21 @@ float diff_time(struct timespec *start, struct timespec *end){
 	return temp;
 }
 
-void render_frame(uint32_t *buffer){
-	render_window (&currentSettings->window, buffer);
+void render_frame(uint32_t *buffer, uint8_t *dirtyLines){
+	frameDone = 1;
+	/* dirty lines of a skipped frame stay set until one is presented */
+	if(frameSkip)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &presentClock);
+	if(currentSettings->headless){
+		headless_frame(buffer, currentSettings->window.screenWidth, currentSettings->window.screenHeight);
+		movie_input();
+		return;
+	}
+	render_window (&currentSettings->window, buffer, dirtyLines);
 	idle_time(frameTime);
 	io_func();
+	movie_input();
 }
 
 /****************/
@@ -328,25 +385,38 @@ struct dirent ** read_directory(DIR *dir){
 }
 
 int create_file_list(){
-	struct dirent **sortedFiles;
+	struct dirent **sortedFiles = NULL;
 	uint8_t counter = 0;
-	if(!(currentDir = opendir(workDir))){
-		printf("Error: failed to open directory: %s\n",workDir);
-		return 1;
+	/* the library catalog pages without rereading the directory */
+	int length = library_list(workDir, fileListOffset, libraryItems, MAX_MENU_ITEMS);
+	if(length < 0){
+		if(!(currentDir = opendir(workDir))){
+			printf("Error: failed to open directory: %s\n",workDir);
+			return 1;
+		}
+		length = file_count(currentDir);
+		sortedFiles = read_directory(currentDir);
 	}
-	int length = file_count(currentDir);
-	sortedFiles = read_directory(currentDir);
 	filesLeft = 1;
 	for(int i = 0; i < MAX_MENU_ITEMS; i++){
 		if((i + fileListOffset) < length){
-			strcpy(fileList.name[i], sortedFiles[i + fileListOffset]->d_name);
+			if(sortedFiles){
+				snprintf(fileNames[i], MAX_MENU_ITEM_LENGTH, "%.*s", MAX_MENU_ITEM_LENGTH - 1, sortedFiles[i + fileListOffset]->d_name);
+				snprintf(fileList.name[i], MAX_MENU_ITEM_LENGTH, "%s", fileNames[i]);
+			}
+			else{
+				snprintf(fileNames[i], MAX_MENU_ITEM_LENGTH, "%s", libraryItems[i].name);
+				snprintf(fileList.name[i], MAX_MENU_ITEM_LENGTH, "%s", libraryItems[i].label);
+			}
 			counter++;
 		}
 		else
 			filesLeft = 0;
 	}
-	closedir(currentDir);
-	free(sortedFiles);
+	if(sortedFiles){
+		closedir(currentDir);
+		free(sortedFiles);
+	}
 	fileList.length = counter;
 	get_menu_size(&fileList, 0, 0);
 	return 0;
@@ -490,6 +560,7 @@ void toggle_menu(){
 	currentMenu = &mainMenu;
 	currentMenuColumn = currentMenuRow = fileListOffset = 0;
 	current_options = &main_menu_option;
+	forceRedraw = 1;
 }
 
 void draw_menu(menuItem *menu){
@@ -552,18 +623,6 @@ void main_menu_option(int option){
 	}
 }
 
-void output_sound(float *buffer, int counter){
-//	float sample[counter];
-	if (!throttle || (SDL_GetQueuedAudioSize(1) > (audioSettings.size * audioSettings.channels)))
-		SDL_ClearQueuedAudio(1);
-//	for(int i = 0;i < counter;i++){
-//		sample[i] = (ym2413_SampleBuffer[i] + sn79489_SampleBuffer[i]) / 2;
-//	}
-	//sn79489_SampleCounter = 0;
-	if (SDL_QueueAudio(1, buffer, counter * sizeof(*buffer)))
-		printf("SDL_QueueAudio failed: %s\n", SDL_GetError());
-}
-
 /****************/
 /* MENU OPTIONS */
 /****************/
@@ -587,6 +646,7 @@ void option_fullscreen(){
 	    SDL_ShowCursor(SDL_ENABLE);
 		SDL_SetWindowGrab(currentSettings->window.win, SDL_FALSE);
 	}
+	forceRedraw = 1;
 }
 
 void option_quit(){
@@ -673,7 +733,7 @@ void file_io(){
 				}
 				break;
 			case SDL_SCANCODE_RETURN:
-				append_to_dir(workDir, fileList.name[currentMenuRow - 1]);
+				append_to_dir(workDir, fileNames[currentMenuRow - 1]);
 				break;
 			case SDL_SCANCODE_ESCAPE:
 			case SDL_SCANCODE_BACKSPACE:
@@ -765,6 +825,22 @@ void game_io(){
 				reset = 1;
 				isPaused = 0;
 				break;
+			case SDL_SCANCODE_F4:
+				rewinding = 1;
+				break;
+			case SDL_SCANCODE_F5:
+				movieToggle = 1;
+				break;
+			case SDL_SCANCODE_F6:
+				runAheadFrames = (runAheadFrames + 1) % (RUNAHEAD_MAX + 1);
+				printf("Run-ahead: %d frames\n", runAheadFrames);
+				break;
+			case SDL_SCANCODE_F7:
+				runAheadStats ^= 1;
+				break;
+			case SDL_SCANCODE_F9:
+				audioStats ^= 1;
+				break;
 			case SDL_SCANCODE_F10:
 				throttle ^= 1;
 				if (throttle)
@@ -790,6 +866,7 @@ void game_io(){
 					currentSettings->window.tex = SDL_CreateTexture(currentSettings->window.rend, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, currentSettings->window.screenWidth, currentSettings->window.screenHeight);
 					set_timings(1);
 				}
+				forceRedraw = 1;
 				break;
 			case SDL_SCANCODE_P:
 				if (!(event.key.repeat))
@@ -855,6 +932,9 @@ void game_io(){
 			break;
 		case SDL_KEYUP:
 			switch (event.key.keysym.scancode){
+			case SDL_SCANCODE_F4:
+				rewinding = 0;
+				break;
 			case SDL_SCANCODE_UP:
 				player1_buttonUp(0);
 				//ioPort1 |= IO1_PORTA_UP;
@@ -910,6 +990,9 @@ void game_io(){
 
 			}
 			break;
+		case SDL_WINDOWEVENT: /* window contents may need to be presented again */
+			forceRedraw = 1;
+			break;
 		}
 		}
 	}
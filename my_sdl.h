@@ -2,6 +2,7 @@
 #define MY_SDL_H_
 
 #include <stdint.h>
+#include <time.h>
 #include "SDL.h"
 
 #define MAX_MENU_ITEMS			25
@@ -31,6 +32,9 @@ typedef struct sdlSettings {
 	int audioFrequency;
 	int channels;
 	int audioBufferSize;
+	int audioQuality;
+	int audioThread;	/* sound chips run on a worker thread */
+	int headless;		/* no window or audio device, frames are hashed instead */
 	windowHandle window;
 	int desktopWidth;
 	int desktopHeight;
@@ -55,12 +59,15 @@ struct menuItem {
 	menuItem *parent;
 	io_function ioFunction;
 };
-extern uint_fast8_t isPaused, stateSave, stateLoad;
+extern uint_fast8_t isPaused, stateSave, stateLoad, audioStats;
+extern uint_fast8_t frameDone;	/* set by render_frame, the machine clears it between instructions */
+extern uint_fast8_t frameSkip;	/* render_frame neither presents, throttles nor reads input */
+extern struct timespec presentClock;	/* when the last frame was presented */
 extern uint16_t channelMask, rhythmMask;
 extern float frameTime, fps;
 extern int clockRate;
 
-void render_frame(uint32_t *), init_sdl(sdlSettings*), init_sdl_video(void), init_sdl_audio(void), close_sdl(void), init_sounds(void), output_sound(float *, int), destroy_handle (windowHandle *), init_time(float), toggle_menu(void);
+void render_frame(uint32_t *, uint8_t *), init_sdl(sdlSettings*), init_sdl_video(void), init_sdl_audio(void), close_sdl(void), init_sounds(void), destroy_handle (windowHandle *), init_time(float), toggle_menu(void);
 void (*player1_button1)(uint8_t),
 	 (*player1_button2)(uint8_t),
 	 (*player1_buttonStart)(uint8_t),
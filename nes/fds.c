@@ -29,8 +29,9 @@
 #include "../jemu.h"
 #include "mapper.h"
 #include "../cpu/6502.h"
+#include "../state.h"
+#include "../romhash.h"
 
-#define BIOS_SIZE	        0x2000
 #define DISK_SIDE_SIZE      65500 //as per the .fds format
 #define FDS_HEADER_SIZE     16 //as per the .fds format
 #define DISK_HEADER_SIZE    56
@@ -93,8 +94,8 @@ void fds_load_disk(char *disk) {
 		exit(EXIT_FAILURE);
 	}
 	free(fdsBiosRom);
-	fdsBiosRom = malloc(BIOS_SIZE * sizeof(uint8_t));
-	fread(fdsBiosRom, BIOS_SIZE, 1, biosFile);
+	fdsBiosRom = malloc(FDS_BIOS_SIZE * sizeof(uint8_t));
+	fread(fdsBiosRom, FDS_BIOS_SIZE, 1, biosFile);
 	strcpy(cart.slot, "fds");
 	cart.prgSize = 0;
 	cart.cramSize = 8192;
@@ -123,6 +124,7 @@ void fds_load_disk(char *disk) {
     tmpDisk = malloc(DISK_SIDE_SIZE * numSides * sizeof(uint8_t));
     fread(tmpDisk, DISK_SIDE_SIZE * numSides, 1, diskFile);
     fclose(diskFile);
+    romhash_compute(tmpDisk, DISK_SIDE_SIZE * numSides, cartHash);
 
     free(diskData);
     diskData = malloc(((DISK_SIDE_SIZE * numSides) << 1) * sizeof(uint8_t)); // make sure there's a margin
@@ -352,3 +354,34 @@ void init_fds(void) {
     diskPosition = 0;
     delay = 0;
 }
+
+//disk writes go to the reconstructed image, so it is part of the state
+void fds_state(struct stateBuffer *state) {
+    STATE(state, irqReload);
+    STATE(state, irqRepeat);
+    STATE(state, irqEnabled);
+    STATE(state, enableSoundReg);
+    STATE(state, writeData);
+    STATE(state, motorOn);
+    STATE(state, resetTransfer);
+    STATE(state, readMode);
+    STATE(state, crcControl);
+    STATE(state, diskReady);
+    STATE(state, diskIrqEnabled);
+    STATE(state, transferFlag);
+    STATE(state, endOfHead);
+    STATE(state, enableDiskReg);
+    STATE(state, readData);
+    STATE(state, diskFlag);
+    STATE(state, readyFlag);
+    STATE(state, protectFlag);
+    STATE(state, extOutput);
+    STATE(state, gapEnded);
+    STATE(state, currentDiskSide);
+    STATE(state, diskInt);
+    STATE(state, irqCounter);
+    STATE(state, diskPosition);
+    STATE(state, delay);
+    STATE(state, fdsRam);
+    state_field(state, diskData, (DISK_SIDE_SIZE * numSides) << 1);
+}
@@ -2,9 +2,13 @@
 #define NES_FDS_H_
 #include <stdint.h>
 
+#define FDS_BIOS_SIZE	0x2000
+
+struct stateBuffer;
+
 void fds_load_disk(char *), run_fds(uint16_t);
 void write_fds_register(uint16_t, uint8_t);
-void init_fds(void);
+void init_fds(void), fds_state(struct stateBuffer *);
 uint8_t read_fds_register(uint16_t);
 
 extern uint8_t *fdsBiosRom, fdsRam[0x8000], currentDiskSide, diskFlag;
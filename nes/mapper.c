@@ -39,14 +39,15 @@
 #include "nescartridge.h"
 #include "nesemu.h"
 #include "fds.h"
+#include "../audio/apu.h"
+#include "../state.h"
 
        uint8_t mapperInt = 0;
-       uint8_t expSound = 0;
 static uint8_t prgBank[8];
 static uint8_t chrBank[8];
 chrtype_t chrSource[0x8];
 
-static inline void null_function();
+static inline void null_function(), null_state(struct stateBuffer *);
 static inline void write_null(uint16_t, uint8_t);
 static inline uint8_t read_null(uint16_t);
 static uint8_t* default_ppu_read_chr(uint16_t);
@@ -277,7 +278,7 @@ void reset_bitcorp() {
  * bf9096 - correct banking.... (quattro games)
  */
 
-static inline void mapper_bf909x(uint16_t, uint8_t);
+static inline void mapper_bf909x(uint16_t, uint8_t), bf909x_state(struct stateBuffer *);
 static uint8_t bf909xOuter = 0;
 void mapper_bf909x(uint16_t address, uint8_t value) {
     switch (address & 0xe000) {
@@ -319,6 +320,10 @@ void mapper_bf909x(uint16_t address, uint8_t value) {
     }
 }
 
+void bf909x_state(struct stateBuffer *state) {
+    STATE(state, bf909xOuter);
+}
+
 /*-----------------------------------COLOR DREAMS------------------------------------*/
 
 /////////////////////////////////////
@@ -383,7 +388,7 @@ void mapper_bnrom(uint16_t address, uint8_t value) {
 //               G-101             //
 /////////////////////////////////////
 
-static inline void mapper_g101(uint16_t, uint8_t);
+static inline void mapper_g101(uint16_t, uint8_t), g101_state(struct stateBuffer *);
 static uint8_t g101Prg0, g101PrgMode;
 
 void mapper_g101(uint16_t address, uint8_t value) {
@@ -450,11 +455,16 @@ void mapper_g101(uint16_t address, uint8_t value) {
     }
 }
 
+void g101_state(struct stateBuffer *state) {
+    STATE(state, g101Prg0);
+    STATE(state, g101PrgMode);
+}
+
 /////////////////////////////////////
 //              H3001              //
 /////////////////////////////////////
 
-static inline void mapper_h3001(uint16_t, uint8_t), reset_h3001(), h3001_irq();
+static inline void mapper_h3001(uint16_t, uint8_t), reset_h3001(), h3001_irq(), h3001_state(struct stateBuffer *);
 static uint8_t h3001IrqEnable;
 static uint16_t h3001IrqReload, h3001IrqCounter;
 void mapper_h3001(uint16_t address, uint8_t value) {
@@ -546,6 +556,12 @@ void reset_h3001() {
     prg_bank_switch();
 }
 
+void h3001_state(struct stateBuffer *state) {
+    STATE(state, h3001IrqEnable);
+    STATE(state, h3001IrqReload);
+    STATE(state, h3001IrqCounter);
+}
+
 /////////////////////////////////////
 //           Holy Diver            //
 /////////////////////////////////////
@@ -650,7 +666,7 @@ void mapper_jf16(uint16_t address, uint8_t value) {
  * -check support for mapper 92
  */
 
-static inline void mapper_jf17(uint16_t, uint8_t);
+static inline void mapper_jf17(uint16_t, uint8_t), jf17_state(struct stateBuffer *);
 uint8_t jf17PrgSelect, jf17ChrSelect;
 
 void mapper_jf17(uint16_t address, uint8_t value) {
@@ -676,13 +692,18 @@ void mapper_jf17(uint16_t address, uint8_t value) {
     jf17ChrSelect = (value & 0x40);
 }
 
+void jf17_state(struct stateBuffer *state) {
+    STATE(state, jf17PrgSelect);
+    STATE(state, jf17ChrSelect);
+}
+
 /////////////////////////////////////
 //             ss88006             //
 /////////////////////////////////////
 
 static uint8_t ss88006Prg0, ss88006Prg1, ss88006Prg2, ss88006IrqControl;
 static uint16_t ss88006IrqCounter, ss88006IrqReload;
-static inline void mapper_ss88006(uint16_t, uint8_t);
+static inline void mapper_ss88006(uint16_t, uint8_t), ss88006_state(struct stateBuffer *);
 static void ss88006_irq();
 
 void mapper_ss88006(uint16_t address, uint8_t value) {
@@ -839,9 +860,18 @@ void ss88006_irq() {
     }
 }
 
+void ss88006_state(struct stateBuffer *state) {
+    STATE(state, ss88006Prg0);
+    STATE(state, ss88006Prg1);
+    STATE(state, ss88006Prg2);
+    STATE(state, ss88006IrqControl);
+    STATE(state, ss88006IrqCounter);
+    STATE(state, ss88006IrqReload);
+}
+
 /*-----------------------------------KONAMI------------------------------------*/
 
-static inline void vrc_clock_irq();
+static inline void vrc_clock_irq(), vrc_irq_state(struct stateBuffer *);
 static void vrc_irq(void);
 static uint8_t vrcIrqControl = 0, vrcIrqLatch, vrcIrqCounter, vrcIrqCycles[3] = { 114, 114, 113 }, vrcIrqCc = 0;
 static int16_t vrcIrqPrescale;
@@ -851,7 +881,7 @@ static int16_t vrcIrqPrescale;
 /////////////////////////////////////
 
 uint8_t vrc1Chr0, vrc1Chr1;
-static inline void mapper_vrc1(uint16_t, uint8_t);
+static inline void mapper_vrc1(uint16_t, uint8_t), vrc1_state(struct stateBuffer *);
 
 void mapper_vrc1(uint16_t address, uint8_t value) {
     if (address >= 0x8000 && address <= 0x8fff) { //PRG select 0
@@ -902,6 +932,11 @@ void mapper_vrc1(uint16_t address, uint8_t value) {
     }
 }
 
+void vrc1_state(struct stateBuffer *state) {
+    STATE(state, vrc1Chr0);
+    STATE(state, vrc1Chr1);
+}
+
 /////////////////////////////////////
 //          Konami VRC 2           //
 // 		    Konami VRC 4           //
@@ -909,7 +944,7 @@ void mapper_vrc1(uint16_t address, uint8_t value) {
 
 static uint8_t vrc24SwapMode = 0;
 uint8_t wramBit = 0, wramBitVal;
-static inline void mapper_vrc24(uint16_t, uint8_t);
+static inline void mapper_vrc24(uint16_t, uint8_t), vrc24_state(struct stateBuffer *);
 
 void mapper_vrc24(uint16_t address, uint8_t value) {
 //reroute addressing
@@ -1037,11 +1072,16 @@ void mapper_vrc24(uint16_t address, uint8_t value) {
     }
 }
 
+void vrc24_state(struct stateBuffer *state) {
+    STATE(state, vrc24SwapMode);
+    vrc_irq_state(state);
+}
+
 /////////////////////////////////////
 //              VRC 3              //
 /////////////////////////////////////
 
-static inline void mapper_vrc3(uint16_t, uint8_t), vrc3_irq(void);
+static inline void mapper_vrc3(uint16_t, uint8_t), vrc3_irq(void), vrc3_state(struct stateBuffer *);
 static uint8_t vrc3IrqControl;
 static uint16_t vrc3IrqCounter, vrc3IrqLatch;
 
@@ -1103,15 +1143,25 @@ void vrc3_irq() {
 }
 
 
+void vrc3_state(struct stateBuffer *state) {
+    STATE(state, vrc3IrqControl);
+    STATE(state, vrc3IrqCounter);
+    STATE(state, vrc3IrqLatch);
+}
+
 /////////////////////////////////////
 //              VRC 6              //
 /////////////////////////////////////
 
+#define VRC6_GAIN   (1.0f / 120) /* 0-61 output, APU mix is halved alongside */
+
 static uint8_t vrc6Pulse1Mode, vrc6Pulse1Duty, vrc6Pulse1Volume, vrc6Pulse2Mode, vrc6Pulse2Duty, vrc6Pulse2Volume,
 vrc6SawAccumulator, vrc6Pulse1Enable, vrc6Pulse2Enable, vrc6SawEnable, vrc6Pulse1DutyCounter, vrc6Pulse2DutyCounter,
 vrc6SawAccCounter = 0, vrc6SawAcc = 0;
 static uint16_t vrc6Pulse1Period, vrc6Pulse2Period, vrc6SawPeriod, vrc6Pulse1Counter = 0, vrc6Pulse2Counter = 0, vrc6SawCounter = 0;
-static inline void mapper_vrc6(uint16_t, uint8_t);
+static inline void mapper_vrc6(uint16_t, uint8_t), vrc6_sound(uint16_t, uint8_t), vrc6_clock(void), vrc6_step(uint32_t), vrc6_state(struct stateBuffer *);
+static inline uint16_t vrc6_advance(uint16_t, uint16_t, uint32_t);
+static inline int vrc6_level(void);
 
 void mapper_vrc6(uint16_t address, uint8_t value) {
     address = (address & 0xff00) | ((address<<(1-cart.vrc6Prg1)) & 0x02) | ((address>>cart.vrc6Prg0) & 0x01);
@@ -1191,47 +1241,54 @@ void mapper_vrc6(uint16_t address, uint8_t value) {
         mapperInt = 0;
         vrcIrqControl = ((vrcIrqControl & 0x04) | ((vrcIrqControl & 0x01) << 1) | (vrcIrqControl & 0x01));
     }
-    else if ((address&0xf003) == 0x9000) { //Pulse 1 control
+    else if ((address&0xf003) >= 0x9000 && (address&0xf003) <= 0xb002) { //sound
+        apu_expansion_write(&vrc6_sound, (address&0xf003), value);
+    }
+}
+
+/* sound registers, written on the sound thread when the channels run there */
+void vrc6_sound(uint16_t address, uint8_t value) {
+    if (address == 0x9000) { //Pulse 1 control
         vrc6Pulse1Mode = (value & 0x80);
         vrc6Pulse1Duty = ((value >> 4) & 7);
         vrc6Pulse1Volume = (value & 0xf);
     }
-    else if ((address&0xf003) == 0x9001) { //Pulse 1 period low
+    else if (address == 0x9001) { //Pulse 1 period low
         vrc6Pulse1Period = ((vrc6Pulse1Period & 0x0f00) | value);
     }
-    else if ((address&0xf003) == 0x9002) { //Pulse 1 period high
+    else if (address == 0x9002) { //Pulse 1 period high
         vrc6Pulse1Period = ((vrc6Pulse1Period & 0x00ff) | ((value & 0xf) << 8));
         vrc6Pulse1Enable = (value & 0x80);
         if (!vrc6Pulse1Enable)
             vrc6Pulse1DutyCounter = 15;
     }
-    else if ((address&0xf003) == 0x9003) { //Pulse 1 frequency
+    else if (address == 0x9003) { //Pulse 1 frequency
 //unused by commerical games
     }
-    else if ((address&0xf003) == 0xa000) { //Pulse 2 control
+    else if (address == 0xa000) { //Pulse 2 control
         vrc6Pulse2Mode = (value & 0x80);
         vrc6Pulse2Duty = ((value >> 4) & 7);
         vrc6Pulse2Volume = (value & 0xf);
     }
-    else if ((address&0xf003) == 0xa001) { //Pulse 2 period low
+    else if (address == 0xa001) { //Pulse 2 period low
         vrc6Pulse2Period = ((vrc6Pulse2Period & 0x0f00) | value);
     }
-    else if ((address&0xf003) == 0xa002) { //Pulse 2 period high
+    else if (address == 0xa002) { //Pulse 2 period high
         vrc6Pulse2Period = ((vrc6Pulse2Period & 0x00ff) | ((value & 0xf) << 8));
         vrc6Pulse2Enable = (value & 0x80);
         if (!vrc6Pulse2Enable)
             vrc6Pulse2DutyCounter = 15;
     }
-    else if ((address&0xf003) == 0xa003) { //Pulse 2 frequency
+    else if (address == 0xa003) { //Pulse 2 frequency
 //unused by commerical games
     }
-    else if ((address&0xf003) == 0xb000) { //Saw accumulator
+    else if (address == 0xb000) { //Saw accumulator
         vrc6SawAccumulator = (value & 0x3f);
     }
-    else if ((address&0xf003) == 0xb001) { //Saw period low
+    else if (address == 0xb001) { //Saw period low
         vrc6SawPeriod = ((vrc6SawPeriod & 0x0f00) | value);
     }
-    else if ((address&0xf003) == 0xb002) { //Saw period high
+    else if (address == 0xb002) { //Saw period high
         vrc6SawPeriod = ((vrc6SawPeriod & 0x00ff) | ((value & 0xf) << 8));
         vrc6SawEnable = (value & 0x80);
         if (!vrc6SawEnable) {
@@ -1241,13 +1298,23 @@ void mapper_vrc6(uint16_t address, uint8_t value) {
     }
 }
 
-float vrc6_sound() {
-    uint8_t sample1 = 0;
-    uint8_t sample2 = 0;
-    uint8_t sample3 = (vrc6SawAcc >> 3);
+/* timer value after n clocks, reloading with period when it passes zero */
+uint16_t vrc6_advance(uint16_t counter, uint16_t period, uint32_t clocks) {
+    if (clocks <= counter)
+        return (counter - clocks);
+    return (period - ((clocks - counter - 1) % (period + 1)));
+}
 
+int vrc6_level() {
+    int level = (vrc6SawAcc >> 3);
     if (((vrc6Pulse1DutyCounter <= vrc6Pulse1Duty) || vrc6Pulse1Mode) && vrc6Pulse1Enable)
-        sample1 = vrc6Pulse1Volume;
+        level += vrc6Pulse1Volume;
+    if (((vrc6Pulse2DutyCounter <= vrc6Pulse2Duty) || vrc6Pulse2Mode) && vrc6Pulse2Enable)
+        level += vrc6Pulse2Volume;
+    return level;
+}
+
+void vrc6_clock() {
     if (!vrc6Pulse1Counter) {
         vrc6Pulse1Counter = vrc6Pulse1Period;
         if (!vrc6Pulse1DutyCounter)
@@ -1257,8 +1324,6 @@ float vrc6_sound() {
         }
     } else
         vrc6Pulse1Counter--;
-    if (((vrc6Pulse2DutyCounter <= vrc6Pulse2Duty) || vrc6Pulse2Mode) && vrc6Pulse2Enable)
-        sample2 = vrc6Pulse2Volume;
     if (!vrc6Pulse2Counter) {
         vrc6Pulse2Counter = vrc6Pulse2Period;
         if (!vrc6Pulse2DutyCounter)
@@ -1284,7 +1349,37 @@ float vrc6_sound() {
     }
     else
         vrc6SawCounter--;
-    return ((sample1 + sample2 + sample3));
+}
+
+/* Runs from one timer expiry to the next, disabled channels that can not
+ * change state at an expiry only have their timers advanced */
+void vrc6_step(uint32_t clocks) {
+    uint32_t time = 0, next;
+    uint8_t pulse1Idle, pulse2Idle, sawIdle;
+    apu_expansion_output(0, vrc6_level());
+    while (time < clocks) {
+        pulse1Idle = (!vrc6Pulse1Enable && vrc6Pulse1DutyCounter);
+        pulse2Idle = (!vrc6Pulse2Enable && vrc6Pulse2DutyCounter);
+        sawIdle = (!vrc6SawEnable && vrc6SawAccCounter != 13);
+        next = clocks - time;
+        if (!pulse1Idle && vrc6Pulse1Counter < next)
+            next = vrc6Pulse1Counter;
+        if (!pulse2Idle && vrc6Pulse2Counter < next)
+            next = vrc6Pulse2Counter;
+        if (!sawIdle && vrc6SawCounter < next)
+            next = vrc6SawCounter;
+        if (next) {
+            vrc6Pulse1Counter = vrc6_advance(vrc6Pulse1Counter, vrc6Pulse1Period, next);
+            vrc6Pulse2Counter = vrc6_advance(vrc6Pulse2Counter, vrc6Pulse2Period, next);
+            vrc6SawCounter = vrc6_advance(vrc6SawCounter, vrc6SawPeriod, next);
+            time += next;
+            if (time == clocks)
+                break;
+        }
+        vrc6_clock();
+        time++;
+        apu_expansion_output(time, vrc6_level());
+    }
 }
 
 void vrc_clock_irq() {
@@ -1315,6 +1410,38 @@ void vrc_irq() {
     }
 }
 
+void vrc6_state(struct stateBuffer *state) {
+    STATE(state, vrc6Pulse1Mode);
+    STATE(state, vrc6Pulse1Duty);
+    STATE(state, vrc6Pulse1Volume);
+    STATE(state, vrc6Pulse2Mode);
+    STATE(state, vrc6Pulse2Duty);
+    STATE(state, vrc6Pulse2Volume);
+    STATE(state, vrc6SawAccumulator);
+    STATE(state, vrc6Pulse1Enable);
+    STATE(state, vrc6Pulse2Enable);
+    STATE(state, vrc6SawEnable);
+    STATE(state, vrc6Pulse1DutyCounter);
+    STATE(state, vrc6Pulse2DutyCounter);
+    STATE(state, vrc6SawAccCounter);
+    STATE(state, vrc6SawAcc);
+    STATE(state, vrc6Pulse1Period);
+    STATE(state, vrc6Pulse2Period);
+    STATE(state, vrc6SawPeriod);
+    STATE(state, vrc6Pulse1Counter);
+    STATE(state, vrc6Pulse2Counter);
+    STATE(state, vrc6SawCounter);
+    vrc_irq_state(state);
+}
+
+void vrc_irq_state(struct stateBuffer *state) {
+    STATE(state, vrcIrqControl);
+    STATE(state, vrcIrqLatch);
+    STATE(state, vrcIrqCounter);
+    STATE(state, vrcIrqCc);
+    STATE(state, vrcIrqPrescale);
+}
+
 /*-----------------------------------NAMCO------------------------------------*/
 
 /////////////////////////////////////
@@ -1323,7 +1450,7 @@ void vrc_irq() {
 
 //TODO: check that Namco 129 is supported
 
-static inline void mapper_namco163(uint16_t, uint8_t), namco163_irq(), namco163_chr_bank_switch();
+static inline void mapper_namco163(uint16_t, uint8_t), namco163_irq(), namco163_chr_bank_switch(), namco163_state(struct stateBuffer *);
 
 static uint8_t namco163CramEnable0 = 0, namco163CramEnable1 = 0, namco163Chr0, namco163Chr1,
 namco163Chr2, namco163Chr3, namco163Chr4, namco163Chr5, namco163Chr6, namco163Chr7, namco163IrqEnable;
@@ -1457,11 +1584,26 @@ void namco163_chr_bank_switch() {
     chrSlot[7] = (namco163CramEnable1 || (namco163Chr7 < 0xe0)) ? &chrRom[((namco163Chr7 & ((cart.chrSize >> 10) - 1)) << 10)] : ((namco163Chr7%2) ? ciRam + 0x400 : ciRam);
 }
 
+void namco163_state(struct stateBuffer *state) {
+    STATE(state, namco163CramEnable0);
+    STATE(state, namco163CramEnable1);
+    STATE(state, namco163Chr0);
+    STATE(state, namco163Chr1);
+    STATE(state, namco163Chr2);
+    STATE(state, namco163Chr3);
+    STATE(state, namco163Chr4);
+    STATE(state, namco163Chr5);
+    STATE(state, namco163Chr6);
+    STATE(state, namco163Chr7);
+    STATE(state, namco163IrqEnable);
+    STATE(state, namco163IrqCounter);
+}
+
 /////////////////////////////////////
 //           NAMCOT 34xx           //
 /////////////////////////////////////
 
-static inline void mapper_namcot34xx(uint16_t, uint8_t), namcot34xx_bank_switch(void);
+static inline void mapper_namcot34xx(uint16_t, uint8_t), namcot34xx_bank_switch(void), namcot34xx_state(struct stateBuffer *);
 static uint8_t namcot34xxSelect, namcot34xxReg[0x8];
 
 void mapper_namcot34xx(uint16_t address, uint8_t value) {
@@ -1519,6 +1661,11 @@ void namcot34xx_bank_switch() {
     prg_bank_switch();
 }
 
+void namcot34xx_state(struct stateBuffer *state) {
+    STATE(state, namcot34xxSelect);
+    STATE(state, namcot34xxReg);
+}
+
 /*-----------------------------------RARE------------------------------------*/
 
 /////////////////////////////////////
@@ -1553,7 +1700,7 @@ void mapper_axrom(uint16_t address, uint8_t value) {
 //            Sunsoft 3            //
 /////////////////////////////////////
 
-static inline void mapper_sun3(uint16_t, uint8_t), sun3_irq();
+static inline void mapper_sun3(uint16_t, uint8_t), sun3_irq(), sun3_state(struct stateBuffer *);
 static uint8_t sun3w, sun3IrqEnable;
 static uint16_t sun3IrqCounter;
 
@@ -1627,11 +1774,17 @@ void sun3_irq() {
     }
 }
 
+void sun3_state(struct stateBuffer *state) {
+    STATE(state, sun3w);
+    STATE(state, sun3IrqEnable);
+    STATE(state, sun3IrqCounter);
+}
+
 /////////////////////////////////////
 //            Sunsoft 4            //
 /////////////////////////////////////
 
-static inline void mapper_sun4(uint16_t, uint8_t), sun4_nametable_mirroring(uint8_t);
+static inline void mapper_sun4(uint16_t, uint8_t), sun4_nametable_mirroring(uint8_t), sun4_state(struct stateBuffer *);
 static uint8_t sun4Name0, sun4Name1, sun4NameSelect;
 
 void mapper_sun4(uint16_t address, uint8_t value) {
@@ -1735,6 +1888,12 @@ void sun4_nametable_mirroring(uint8_t mode) {
     }
 }
 
+void sun4_state(struct stateBuffer *state) {
+    STATE(state, sun4Name0);
+    STATE(state, sun4Name1);
+    STATE(state, sun4NameSelect);
+}
+
 /////////////////////////////////////
 //           Sunsoft 5a            //
 // 			 Sunsoft 5b			   //
@@ -1745,7 +1904,7 @@ void sun4_nametable_mirroring(uint8_t mode) {
  * expansion sound for 5B
  */
 
-static inline void mapper_sun5(uint16_t, uint8_t), sun5_irq();
+static inline void mapper_sun5(uint16_t, uint8_t), sun5_irq(), sun5_state(struct stateBuffer *);
 static uint8_t sun5Command, sun5IrqControl;
 static uint16_t sun5IrqCounter;
 uint8_t extendedPrg = 0;
@@ -1871,6 +2030,12 @@ void sun5_irq() {
     }
 }
 
+void sun5_state(struct stateBuffer *state) {
+    STATE(state, sun5Command);
+    STATE(state, sun5IrqControl);
+    STATE(state, sun5IrqCounter);
+}
+
 /*-----------------------------------T*HQ------------------------------------*/
 
 /////////////////////////////////////
@@ -1899,7 +2064,7 @@ void mapper_cprom(uint16_t address, uint8_t value) {
  */
 
 static uint8_t tc0190IrqEnable = 0, tc0190IrqLatch = 0, tc0190IrqReload = 0, tc0190IrqCounter = 0;
-static inline void mapper_tc0190(uint16_t, uint8_t);
+static inline void mapper_tc0190(uint16_t, uint8_t), tc0190_state(struct stateBuffer *);
 
 void mapper_tc0190(uint16_t address, uint8_t value) {
     switch (address & 0xe003) {
@@ -1991,6 +2156,13 @@ void tc0190_irq() {
     }
 }
 
+void tc0190_state(struct stateBuffer *state) {
+    STATE(state, tc0190IrqEnable);
+    STATE(state, tc0190IrqLatch);
+    STATE(state, tc0190IrqReload);
+    STATE(state, tc0190IrqCounter);
+}
+
 /////////////////////////////////////
 //              X1-005             //
 /////////////////////////////////////
@@ -2223,12 +2395,27 @@ void default_ppu_write_nt(uint16_t address, uint8_t value) {
 }
 
 void null_function() {}
+void null_state(struct stateBuffer *state) {}
 void write_null(uint16_t address, uint8_t value) {}
 uint8_t read_null(uint16_t address) {
     mapperRead = 0;
     return 0;
 }
 
+//Registers shared by all boards, the board's own go through its state hook
+void mapper_state(struct stateBuffer *state) {
+    STATE(state, mapperInt);
+    STATE(state, prgBank);
+    STATE(state, chrBank);
+    STATE(state, chrSource);
+    STATE(state, cart.mirroring);
+    STATE(state, wramEnable);
+    STATE(state, wramBit);
+    STATE(state, wramBitVal);
+    STATE(state, extendedPrg);
+    mapper_registers_state(state);
+}
+
 void init_mapper() {
     reset_default();
     ppu_read_chr = &default_ppu_read_chr;
@@ -2239,6 +2426,7 @@ void init_mapper() {
     irq_ppu_clocked = &null_function;
     read_mapper_register = &read_null;
     write_mapper_register = &write_null;
+    mapper_registers_state = &null_state;
     if(!strcmp(cart.slot,"sxrom")   ||
             !strcmp(cart.slot,"sxrom_a") ||
             !strcmp(cart.slot,"sorom")   ||
@@ -2268,22 +2456,25 @@ void init_mapper() {
     }
     else if (!strcmp(cart.slot,"vrc1")) {
         write_mapper_register = &mapper_vrc1;
+        mapper_registers_state = &vrc1_state;
     }
     else if (!strcmp(cart.slot,"vrc2") ||
             !strcmp(cart.slot,"vrc4")) {
         write_mapper_register = &mapper_vrc24;
+        mapper_registers_state = &vrc24_state;
         if (!strcmp(cart.slot,"vrc2") && (!cart.wramSize && !cart.bwramSize))
             wramBit = 1;
         irq_cpu_clocked = &vrc_irq;
     }
     else if (!strcmp(cart.slot,"vrc6")) {
         write_mapper_register = &mapper_vrc6;
-        expansion_sound = &vrc6_sound;
-        expSound = 1;
+        mapper_registers_state = &vrc6_state;
+        apu_add_expansion(&vrc6_step, 1, VRC6_GAIN);
         irq_cpu_clocked = &vrc_irq;
     }
     else if (!strcmp(cart.slot,"g101")) {
         write_mapper_register = &mapper_g101;
+        mapper_registers_state = &g101_state;
     }
     else if (!strcmp(cart.slot,"lrog017")) {
         write_mapper_register = &mapper_lrog017;
@@ -2297,9 +2488,11 @@ void init_mapper() {
     }
     else if (!strcmp(cart.slot,"jf17") || !strcmp(cart.slot,"jf17pcm")) {
         write_mapper_register = &mapper_jf17;
+        mapper_registers_state = &jf17_state;
     }
     else if (!strcmp(cart.slot,"namcot_3433") || !strcmp(cart.slot,"namcot_3425")  || !strcmp(cart.slot,"namcot_3446")) {
         write_mapper_register = &mapper_namcot34xx;
+        mapper_registers_state = &namcot34xx_state;
     }
     else if (!strcmp(cart.slot,"discrete_74x377")) {
         write_mapper_register = &mapper_74x377;
@@ -2310,16 +2503,19 @@ void init_mapper() {
     }
     else if (!strcmp(cart.slot,"ss88006")) {
         write_mapper_register = &mapper_ss88006;
+        mapper_registers_state = &ss88006_state;
         irq_cpu_clocked = &ss88006_irq;
     }
     else if (!strcmp(cart.slot,"namcot_163")) {
         write_mapper_register = &mapper_namco163;
+        mapper_registers_state = &namco163_state;
         read_mapper_register = &namco163_read;
         irq_cpu_clocked = &namco163_irq;
     }
     else if (!strcmp(cart.slot,"tc0190fmc") || !strcmp(cart.slot,"tc0190fmcp")
             || !strcmp(cart.slot,"tc0350fmr")) {
         write_mapper_register = &mapper_tc0190;
+        mapper_registers_state = &tc0190_state;
         irq_ppu_clocked = &tc0190_irq;
     }
     else if (!strcmp(cart.slot,"bnrom")) {
@@ -2337,27 +2533,33 @@ void init_mapper() {
     }
     else if (!strcmp(cart.slot,"h3001")) {
         write_mapper_register = &mapper_h3001;
+        mapper_registers_state = &h3001_state;
         reset_h3001();
         irq_cpu_clocked = &h3001_irq;
     }
     else if (!strcmp(cart.slot,"sunsoft3")) {
         write_mapper_register = &mapper_sun3;
+        mapper_registers_state = &sun3_state;
         irq_cpu_clocked = &sun3_irq;
     }
     else if (!strcmp(cart.slot,"sunsoft4")) {
         write_mapper_register = &mapper_sun4;
+        mapper_registers_state = &sun4_state;
     }
     else if (!strcmp(cart.slot,"sunsoft5a") ||
             !strcmp(cart.slot,"sunsoft5b") ||
             !strcmp(cart.slot,"sunsoft_fme7")) {
         write_mapper_register = &mapper_sun5;
+        mapper_registers_state = &sun5_state;
         irq_cpu_clocked = &sun5_irq;
     }
     else if (!strcmp(cart.slot,"bf9093") || !strcmp(cart.slot,"bf9096")) {
         write_mapper_register = &mapper_bf909x;
+        mapper_registers_state = &bf909x_state;
     }
     else if (!strcmp(cart.slot,"vrc3")) {
         write_mapper_register = &mapper_vrc3;
+        mapper_registers_state = &vrc3_state;
         irq_cpu_clocked = &vrc3_irq;
     }
     else if (!strcmp(cart.slot,"KONAMI-QTAI")) {
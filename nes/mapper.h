@@ -6,14 +6,13 @@ typedef enum {
 	CHR_RAM,
 	CHR_ROM
 } chrtype_t;
-void init_mapper(void),
+struct stateBuffer;
+void init_mapper(void), mapper_state(struct stateBuffer *),
 	 (*irq_cpu_clocked)(void), (*irq_ppu_clocked)(void),
-	 (*write_mapper_register)(uint16_t, uint8_t);
+	 (*write_mapper_register)(uint16_t, uint8_t), (*mapper_registers_state)(struct stateBuffer *);
 void prg_bank_switch(), chr_bank_switch(), nametable_mirroring(uint8_t);
 uint8_t (*read_mapper_register)(uint16_t), namco163_read(uint16_t);
-float vrc6_sound(void);
-float (*expansion_sound)(void);
-extern uint8_t mapperInt, expSound, wramBit, wramBitVal, extendedPrg;
+extern uint8_t mapperInt, wramBit, wramBitVal, extendedPrg;
 uint8_t mapperRead;
 
 extern chrtype_t chrSource[0x8];
@@ -4,10 +4,14 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include "parser.h"
-#include "tree.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sha.h"
 #include "nesemu.h"
+#include "../softlist.h"
+#include "../romhash.h"
+#include "../jemu.h"
 
 //UNIF
 #define UNIF_TYPE_SIZE      4
@@ -21,10 +25,9 @@ static uint8_t isInes;
 
 static uint8_t header[0x10];
 
-//XML
-xmlDoc *nesXml;
-xmlNode *root;
-xmlChar *sphash = NULL, *schash = NULL;
+//softlist
+static struct softlist nesSoftlist;
+static uint8_t softlistOpen = 0;
 uint8_t hashMatch;
 
 //common cartridge related
@@ -40,7 +43,11 @@ uint8_t *wramSource = NULL; //TODO: should be made obsolete
 uint8_t *chrRom = NULL;
 uint8_t *chrRam = NULL;
 
-static FILE *romFile;
+//the image is mapped and PRG/CHR point into it unless they had to be reassembled
+static uint8_t *romMap = NULL;
+static size_t romMapSize = 0;
+static uint8_t prgCopied = 0, chrCopied = 0;
+
 static FILE *bwramFile; //backed-up RAM assumed to have same name as ROM with .sav extension
 char *bwramName;
 
@@ -51,10 +58,11 @@ uint8_t mirroring[4][4] =
 	  { 0, 0, 0, 0 },	// one screen, low page  CIRAM A10 <-> Ground
 	  { 1, 1, 1, 1 } };	// one screen, high page CIRAM A10 <-> Vcc
 
-static inline void extract_xml_data(xmlNode * s_node);
-static inline void xml_hash_compare(xmlNode * c_node);
-static inline void parse_xml_file(xmlNode * a_node);
+static inline void apply_softlist(const struct softlistEntry *entry);
 static inline void load_by_header();
+static inline void release_rom();
+static inline uint8_t *rom_data(size_t offset, size_t size, uint8_t *copied);
+static inline void append_chunk(uint8_t **dest, long *size, uint8_t *copied, const uint8_t *data, uint32_t length);
 
 void nes_load_rom(char *rom) {
     cart.bwramSize = 0;
@@ -68,13 +76,25 @@ void nes_load_rom(char *rom) {
     isUnif = 0;
     hashMatch = 0;
     wramEnable = 0;
-    if ((romFile = fopen(rom, "r")) == NULL) {
+    release_rom();
+    int romFd = open(rom, O_RDONLY);
+    struct stat romStat;
+    if (romFd < 0 || fstat(romFd, &romStat)) {
         printf("Error: No such file\n");
         exit(EXIT_FAILURE);
     }
+    romMapSize = romStat.st_size;
+    //private and writable so stray CHR ROM writes behave as before, untouched pages stay shared
+    romMap = romMapSize ? mmap(NULL, romMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, romFd, 0) : MAP_FAILED;
+    close(romFd);
+    if (romMap == MAP_FAILED) {
+        printf("Error: Could not map %s\n", rom);
+        exit(EXIT_FAILURE);
+    }
 
 	//look for iNES header
-    fread(header, sizeof(header), 1, romFile);
+    memset(header, 0, sizeof(header));
+    memcpy(header, romMap, romMapSize < sizeof(header) ? romMapSize : sizeof(header));
     for (int i = 0; i < sizeof(inesId); i++) {
         if (header[i] != inesId[i]) {
             isInes = 1;
@@ -84,14 +104,9 @@ void nes_load_rom(char *rom) {
     if(!isInes) { //found iNES header
         cart.prgSize = header[4] * PRG_BANK << 2;
         cart.chrSize = header[5] * CHR_BANK << 3;
-        free(prg);
-        prg = malloc(cart.prgSize * sizeof(uint8_t));
-        fread(prg, cart.prgSize, 1, romFile);
-        if (cart.chrSize) {
-            free(chrRom);
-            chrRom = malloc(cart.chrSize * sizeof(uint8_t));
-            fread(chrRom, cart.chrSize, 1, romFile);
-        }
+        prg = rom_data(sizeof(header), cart.prgSize, &prgCopied);
+        if (cart.chrSize)
+            chrRom = rom_data(sizeof(header) + cart.prgSize, cart.chrSize, &chrCopied);
     }
 
     else { //look for Unif header
@@ -102,64 +117,48 @@ void nes_load_rom(char *rom) {
             }
         }
         if(!isUnif) { //found Unif header
-            fseek(romFile, 0, SEEK_END);
-            uint32_t fSize = ftell(romFile);
-            char blockType[UNIF_TYPE_SIZE + 1];
             cart.prgSize = 0;
             cart.chrSize = 0;
             uint32_t blockLength;
-            fseek(romFile,0x20,SEEK_SET);
-            while (ftell(romFile) < fSize) {
-                fread(blockType, UNIF_TYPE_SIZE, 1, romFile);
-                blockType[4] = '\0';
-                fread(&blockLength, UNIF_LENGTH_SIZE, 1, romFile);
-                if(!strcmp(blockType, "MAPR")) {
-                    char *map = malloc(blockLength);
-                    fread(map, blockLength, 1, romFile);
-                    strcpy(cart.slot,map);
-                    free(map);
+            size_t offset = 0x20;
+            while (offset + UNIF_TYPE_SIZE + UNIF_LENGTH_SIZE <= romMapSize) {
+                const char *blockType = (char *)romMap + offset;
+                memcpy(&blockLength, romMap + offset + UNIF_TYPE_SIZE, UNIF_LENGTH_SIZE);
+                offset += UNIF_TYPE_SIZE + UNIF_LENGTH_SIZE;
+                if (blockLength > romMapSize - offset)
+                    blockLength = romMapSize - offset;
+                uint8_t *block = romMap + offset;
+                offset += blockLength;
+                if(!strncmp(blockType, "MAPR", UNIF_TYPE_SIZE)) {
+                    snprintf(cart.slot, sizeof(cart.slot), "%.*s", (int)blockLength, (char *)block);
                 }
-                else if(!strcmp(blockType, "NAME")) {
-                    char *name = malloc(blockLength);
-                    fread(name, blockLength, 1, romFile);
-                    printf("Name: %s\n",name);
-                    free(name);
+                else if(!strncmp(blockType, "NAME", UNIF_TYPE_SIZE)) {
+                    printf("Name: %.*s\n", (int)blockLength, (char *)block);
                 }
-                else if(!strcmp(blockType, "TVCI")) {
+                else if(!strncmp(blockType, "TVCI", UNIF_TYPE_SIZE)) {
                     assert(blockLength == 1);
-                    uint8_t tv;
-                    fread(&tv, blockLength, 1, romFile);
                 }
                 else if(!strncmp(blockType, "PRG", 3)) {
-                    prg = realloc(prg, sizeof(uint8_t) * (cart.prgSize + blockLength));
-                    fread(prg + cart.prgSize, blockLength, 1, romFile);
-                    cart.prgSize += blockLength;
-               }
+                    append_chunk(&prg, &cart.prgSize, &prgCopied, block, blockLength);
+                }
                 else if(!strncmp(blockType, "CHR", 3)) {
-                    chrRom = realloc(chrRom, sizeof(uint8_t) * (cart.chrSize + blockLength));
-                    fread(chrRom + cart.chrSize, blockLength, 1, romFile);
-                    cart.chrSize += blockLength;
+                    append_chunk(&chrRom, &cart.chrSize, &chrCopied, block, blockLength);
                 }
-                else if(!strcmp(blockType, "BATR")) {
+                else if(!strncmp(blockType, "BATR", UNIF_TYPE_SIZE)) {
                     assert(blockLength == 1);
-                    fread(&cart.battery, blockLength, 1, romFile);
+                    cart.battery = block[0];
                 }
-                else if(!strcmp(blockType, "MIRR")) {
+                else if(!strncmp(blockType, "MIRR", UNIF_TYPE_SIZE)) {
                     assert(blockLength == 1);
-                    fread(&cart.mirroring, blockLength, 1, romFile);
+                    cart.mirroring = block[0];
                 }
                 else
                     break;
             }
         } else {
             cart.prgSize = cart.chrSize = 32768;//just a hack
-            fseek(romFile,0,SEEK_SET);
-            free(prg);
-            prg = malloc(cart.prgSize * sizeof(uint8_t));
-            fread(prg, cart.prgSize, 1, romFile);
-            free(chrRom);
-            chrRom = malloc(cart.chrSize * sizeof(uint8_t));
-            fread(chrRom, cart.chrSize, 1, romFile);
+            prg = rom_data(0, cart.prgSize, &prgCopied);
+            chrRom = rom_data(cart.prgSize, cart.chrSize, &chrCopied);
         }
         if(!strcmp(cart.slot, "KONAMI-QTAI")) {
             cart.bwramSize = 8192;
@@ -169,17 +168,15 @@ void nes_load_rom(char *rom) {
     }
 
 //look for match in softlist
-    SHA1(prg,cart.prgSize,phash);
-    free(sphash);
-    sphash = malloc(SHA_DIGEST_LENGTH * 2 + 1);
-    for (int i = 0; i<sizeof(phash); i++){
-        sprintf((char *)sphash+i*2, "%02x", phash[i]);
-    }
-    nesXml = xmlReadFile("softlist/nes.xml", NULL, 0);
-    root = xmlDocGetRootElement(nesXml);
-    parse_xml_file(root);
-    xmlFreeDoc(nesXml);
-    xmlCleanupParser();
+    rom_sha1(rom, &romStat, AREA_NES_PRG, prg, cart.prgSize, phash);
+    memcpy(cartHash, phash, sizeof(phash));
+    if (!softlistOpen)
+        softlistOpen = !open_softlist(&nesSoftlist, "softlist/nes.xml", "prg");
+    int matches = 0;
+    const struct softlistEntry *entry = softlistOpen ? softlist_find(&nesSoftlist, phash, &matches) : NULL;
+    hashMatch = (matches > 0);
+    for (int i = 0; i < matches; i++) //duplicates are applied in XML order, the last one wins
+        apply_softlist(&entry[i]);
 
     if (!hashMatch && !isInes)
         load_by_header();
@@ -188,7 +185,6 @@ void nes_load_rom(char *rom) {
         free(chrRam);
         chrRam = malloc(cart.cramSize * sizeof(uint8_t));
     }
-    fclose(romFile);
 
     cart.pSlots = ((cart.prgSize) / 0x1000);
     cart.cSlots = ((cart.chrSize) / 0x400);
@@ -227,9 +223,7 @@ void nes_load_rom(char *rom) {
 }
 
 void nes_close_rom() {
-    free(prg);
-    if (cart.chrSize)
-        free(chrRom);
+    release_rom();
     if (cart.cramSize)
         free(chrRam);
     if (cart.bwramSize) {
@@ -242,6 +236,46 @@ void nes_close_rom() {
         free(wram);
 }
 
+void release_rom() {
+    if (prgCopied)
+        free(prg);
+    if (chrCopied)
+        free(chrRom);
+    if (romMap)
+        munmap(romMap, romMapSize);
+    prg = chrRom = romMap = NULL;
+    romMapSize = 0;
+    prgCopied = chrCopied = 0;
+}
+
+//points into the mapping, a truncated image gets a zero padded copy instead
+uint8_t *rom_data(size_t offset, size_t size, uint8_t *copied) {
+    if (offset + size <= romMapSize)
+        return romMap + offset;
+    uint8_t *data = calloc(size, sizeof(uint8_t));
+    if (offset < romMapSize)
+        memcpy(data, romMap + offset, romMapSize - offset);
+    *copied = 1;
+    return data;
+}
+
+//UNIF splits PRG and CHR into chunks, only a single chunk can stay in place
+void append_chunk(uint8_t **dest, long *size, uint8_t *copied, const uint8_t *data, uint32_t length) {
+    if (!*size) {
+        *dest = (uint8_t *)data;
+        *size = length;
+        return;
+    }
+    uint8_t *joined = malloc(*size + length);
+    memcpy(joined, *dest, *size);
+    memcpy(joined + *size, data, length);
+    if (*copied)
+        free(*dest);
+    *dest = joined;
+    *size += length;
+    *copied = 1;
+}
+
 void set_wram() {
     if (header[6] & 0x02) {
         cart.wramSize = 0;
@@ -300,101 +334,35 @@ void load_by_header() {
     }
 }
 
-void extract_xml_data(xmlNode * s_node) {
-    xmlNode *cur_node = s_node->children;
-    xmlChar *nam, *val;
-    while (cur_node) {
-        if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (xmlChar *)"feature")){
-            nam = xmlGetProp(cur_node, (xmlChar *)"name");
-            val = xmlGetProp(cur_node, (xmlChar *)"value");
-            if (!xmlStrcmp(nam,(xmlChar *)"slot"))
-                strcpy(cart.slot,(char *)val);
-            else if (!xmlStrcmp(nam,(xmlChar *)"pcb"))
-                strcpy(cart.pcb,(char *)val);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc2-pin3"))
-                cart.vrc24Prg1 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc2-pin4"))
-                cart.vrc24Prg0 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc4-pin3"))
-                cart.vrc24Prg1 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc4-pin4"))
-                cart.vrc24Prg0 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc2-pin21")) {
-                if (!xmlStrcmp(val,(xmlChar *)"NC"))
-                    cart.vrc24Chr = 0;
-                else
-                    cart.vrc24Chr = 1;
-            }
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc6-pin9"))
-                cart.vrc6Prg1 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vrc6-pin10"))
-                cart.vrc6Prg0 = strtol((char *)val+5,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"mmc1_type"))
-                strcpy(cart.subtype,(char *)val);
-            else if (!xmlStrcmp(nam,(xmlChar *)"mmc3_type"))
-                strcpy(cart.subtype,(char *)val);
-            else if (!xmlStrcmp(nam,(xmlChar *)"mirroring")) {
-                if (!xmlStrcmp(val,(xmlChar *)"horizontal"))
-                    cart.mirroring = 0;
-                else if (!xmlStrcmp(val,(xmlChar *)"vertical"))
-                    cart.mirroring = 1;
-                else if (!xmlStrcmp(val,(xmlChar *)"high"))
-                    cart.mirroring = 3;
-                else if (!xmlStrcmp(val,(xmlChar *)"4screen"))
-                    cart.mirroring = 4;
-                else if (!xmlStrcmp(val,(xmlChar *)"pcb_controlled"))
-                    cart.mirroring = 5;
-            }
-            xmlFree(nam);
-            xmlFree(val);
-        }
-        else if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (xmlChar *)"dataarea")) {
-            nam = xmlGetProp(cur_node, (xmlChar *)"name");
-            val = xmlGetProp(cur_node, (xmlChar *)"size");
-            if (!xmlStrcmp(nam,(xmlChar *)"prg"))
-                cart.prgSize = strtol((char *)val,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"chr"))
-                cart.chrSize = strtol((char *)val,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"wram"))
-                cart.wramSize = strtol((char *)val,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"bwram"))
-                cart.bwramSize = strtol((char *)val,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vram"))
-                cart.cramSize = strtol((char *)val,NULL,10);
-            else if (!xmlStrcmp(nam,(xmlChar *)"vram2"))
-                cart.cramSize += strtol((char *)val,NULL,10);
-            xmlFree(nam);
-            xmlFree(val);
-        }
-        cur_node = cur_node->next;
-    }
-}
-
-void xml_hash_compare(xmlNode * c_node) {
-    xmlNode *cur_node = NULL;
-    xmlChar *hashkey;
-    for (cur_node = c_node; cur_node; cur_node = cur_node->next) {
-        if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (const xmlChar *) "rom")) {
-            hashkey = xmlGetProp(cur_node, (xmlChar *)"sha1");
-            if (!xmlStrcmp(hashkey,sphash)) {
-                hashMatch = 1;
-                extract_xml_data(cur_node->parent->parent);
-            }
-            xmlFree(hashkey);
-        }
-    }
-}
-void parse_xml_file(xmlNode * a_node) {
-    xmlNode *cur_node = NULL;
-    xmlChar *key;
-    for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
-        if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (const xmlChar *) "dataarea")) {
-            key = xmlGetProp(cur_node, (xmlChar *)"name");
-            if (!xmlStrcmp(key, (xmlChar *)"prg")) {
-                xml_hash_compare(cur_node->children);
-            }
-            xmlFree(key);
-        }
-        parse_xml_file(cur_node->children);
-    }
+void apply_softlist(const struct softlistEntry *entry) {
+    if (entry->slot[0])
+        strcpy(cart.slot,entry->slot);
+    if (entry->pcb[0])
+        strcpy(cart.pcb,entry->pcb);
+    if (entry->subtype[0])
+        strcpy(cart.subtype,entry->subtype);
+    if (entry->mirroring != SOFTLIST_UNSET)
+        cart.mirroring = entry->mirroring;
+    if (entry->vrc24Prg1 != SOFTLIST_UNSET)
+        cart.vrc24Prg1 = entry->vrc24Prg1;
+    if (entry->vrc24Prg0 != SOFTLIST_UNSET)
+        cart.vrc24Prg0 = entry->vrc24Prg0;
+    if (entry->vrc24Chr != SOFTLIST_UNSET)
+        cart.vrc24Chr = entry->vrc24Chr;
+    if (entry->vrc6Prg1 != SOFTLIST_UNSET)
+        cart.vrc6Prg1 = entry->vrc6Prg1;
+    if (entry->vrc6Prg0 != SOFTLIST_UNSET)
+        cart.vrc6Prg0 = entry->vrc6Prg0;
+    if (entry->prgSize != SOFTLIST_UNSET)
+        cart.prgSize = entry->prgSize;
+    if (entry->chrSize != SOFTLIST_UNSET)
+        cart.chrSize = entry->chrSize;
+    if (entry->wramSize != SOFTLIST_UNSET)
+        cart.wramSize = entry->wramSize;
+    if (entry->bwramSize != SOFTLIST_UNSET)
+        cart.bwramSize = entry->bwramSize;
+    if (entry->vramSize != SOFTLIST_UNSET)
+        cart.cramSize = entry->vramSize;
+    if (entry->vram2Size != SOFTLIST_UNSET)
+        cart.cramSize += entry->vram2Size;
 }
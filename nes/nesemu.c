@@ -15,14 +15,21 @@
 #include <unistd.h>
 #include "../video/ppu.h"
 #include "../audio/apu.h"
+#include "../audio/soundthread.h"
 #include "../cpu/6502.h"
 #include "../my_sdl.h"
 #include "mapper.h"
 #include "fds.h"
 #include "nescartridge.h"
 #include "../jemu.h"
+#include "../state.h"
+#include "../rewind.h"
+#include "../runahead.h"
+#include "../movie.h"
 
 #define FRAC_BITS			16
+#define NES_STATE_VERSION	3
+#define STATE_NULL			0xffffffff
 
 /* TODO:
  * -better sync handling, needs to read ppu one cycle earlier
@@ -36,6 +43,7 @@
 
 float fps;
 uint8_t ctrb = 0, ctrb2 = 0, ctr1 = 0, ctr2 = 0;
+uint8_t s = 0; //TODO: may need to restore related function
 uint8_t openBus;
 static uint32_t ppu_wait = 0;
 static uint32_t apu_wait = 0;
@@ -48,6 +56,13 @@ char *romName;
 uint8_t *prgSlot[0x08], cpuRam[0x800], ppuRegs[0x08], apuRegs[0x20];
 struct memSlot *cpuMemory[0x10] = {NULL}, *ppuMemory[0x08] = {NULL}, defaultSlot = {0, 0, NULL};
 
+/* Snapshots store pointers into emulated memory as region and offset */
+struct stateRegion {
+    uint8_t *base;
+    size_t size;
+};
+static struct stateRegion stateRegions[12];
+
 //                          MACHINE              BIOS       CART        MASTER CLOCK		VIDEO		REGION		VIDEO CARD		AUDIO CARD		HAS EXPANSION SOUND
 struct machine nes_ntsc = {     NES,             NULL,        "",    NES_NTSC_MASTER,        NTSC,      EXPORT,       PPU_NTSC,       APU_NTSC,                       0 },
                 nes_pal = {     NES,             NULL,        "",     NES_PAL_MASTER,         PAL,      EXPORT,        PPU_PAL,        APU_PAL,                       0 },
@@ -59,13 +74,20 @@ static void nes_p1b1(uint8_t), nes_p1b2(uint8_t), nes_p1start(uint8_t),
         nes_p1right(uint8_t), nes_p1select(uint8_t);
 static void nes_6502_addcycles(uint8_t), nes_6502_synchronize(int),
         nes_reset_emulation(void), init_video(), init_audio(), set_timings(),
-        nes_6502_cpuwrite(uint16_t, uint8_t), write_cpu_register(uint16_t, uint8_t);
+        nes_6502_cpuwrite(uint16_t, uint8_t), write_cpu_register(uint16_t, uint8_t),
+        nes_read_pads(uint8_t *), nes_write_pads(const uint8_t *);
 static uint8_t nes_6502_cpuread(uint16_t), read_cpu_register(uint16_t);
+static void nes_state(struct stateBuffer *), pointer_state(struct stateBuffer *, uint8_t **), map_state_regions(void);
 
 int nesemu() {
 
     //hook up general
     reset_emulation = &nes_reset_emulation;
+    snapshot_size = &nes_state_size;
+    save_snapshot = &nes_save_snapshot;
+    load_snapshot = &nes_load_snapshot;
+    read_pads = &nes_read_pads;
+    write_pads = &nes_write_pads;
 
     //map mermory
     for(int i = 0; i < 0x10; i++) {
@@ -114,13 +136,21 @@ int nesemu() {
     player1_buttonStart = &nes_p1start;
     player1_buttonSelect = &nes_p1select;
 
-    strcpy(currentMachine->cartFile,
-            "/home/jonas/git/roms/nes/mmc2/Mike Tyson's Punch-Out!! (Japan, USA).nes");
-
     nes_reset_emulation();
+    start_movie();
 
     while (quit == 0) {
         run_6502();
+        if (frameDone) {
+            frameDone = 0;
+            if (!aheadFrame)
+                movie_frame();
+            if (!movieMode) {
+                if (!aheadFrame)
+                    rewind_frame();
+                run_ahead_frame();
+            }
+        }
         if (stateLoad) {
             stateLoad = 0;
             load_state();
@@ -131,16 +161,21 @@ int nesemu() {
     }
 
     //fclose(logfile);
+    stop_movie();
+    close_run_ahead();
+    close_rewind();
+    close_sound_thread();
     nes_close_rom();
     return 0;
 }
 
 void init_audio() {
+    close_sound_thread();
     settings.audioFrequency = 48000;
     settings.channels = 1;
     settings.audioBufferSize = 2048;
-    init_apu(settings.audioBufferSize);
     init_sdl_audio();
+    init_apu(settings.audioBufferSize);
     if (currentMachine->videoSystem == NTSC) {
         set_timings_apu(NTSC_APU_CLOCK_DIV * settings.audioFrequency,
                 currentMachine->masterClock);
@@ -148,6 +183,10 @@ void init_audio() {
         set_timings_apu(PAL_APU_CLOCK_DIV * settings.audioFrequency,
                 currentMachine->masterClock);
     }
+    if (settings.audioThread) {
+        sound_add_chip(&run_apu_channels);
+        init_sound_thread();
+    }
 }
 
 void init_video() {
@@ -181,6 +220,9 @@ void set_timings() {
 }
 
 void nes_reset_emulation() {
+    stop_movie();
+    reset_rewind();
+    reset_run_ahead();
     init_audio();
     init_video();
     set_timings();
@@ -194,87 +236,107 @@ void nes_reset_emulation() {
     _6502_power_reset(HARD_RESET);
 }
 
-/* TODO:
- * -save mirroring mode
- * -save state between cpu instructions
- * -save slot banks
- */
+size_t nes_state_size() {
+    struct stateBuffer state = { NULL, 0, 0, 0, 0 };
+    nes_state(&state);
+    return sizeof(struct stateHeader) + state.pos;
+}
 
-void save_state() {
-    char *stateName = strdup(romName);
-    sprintf(stateName + strlen(stateName) - 3, "sta");
-    FILE *stateFile = fopen(stateName, "w");
-//    fwrite(prgBank, sizeof(prgBank), 1, stateFile);
-    fwrite(cpuRam, sizeof(cpuRam), 1, stateFile);
-/*    fwrite(&cpuA, sizeof(cpuA), 1, stateFile);
-    fwrite(&cpuX, sizeof(cpuX), 1, stateFile);
-    fwrite(&cpuY, sizeof(cpuY), 1, stateFile);
-    fwrite(&cpuP, sizeof(cpuP), 1, stateFile);
-    fwrite(&cpuS, sizeof(cpuS), 1, stateFile);
-    fwrite(&cpuPC, sizeof(cpuPC), 1, stateFile);*/
- //   fwrite(chrBank, sizeof(chrBank), 1, stateFile);
-    fwrite(chrSource, sizeof(chrSource), 1, stateFile);
-    fwrite(oam, sizeof(oam), 1, stateFile);
-    fwrite(nameSlot, sizeof(nameSlot), 1, stateFile);
-    fwrite(ciRam, sizeof(ciRam), 1, stateFile);
-    fwrite(palette, sizeof(palette), 1, stateFile);
-/*    fwrite(&ppudot, sizeof(ppudot), 1, stateFile);
-    fwrite(&ppu_vCounter, sizeof(ppu_vCounter), 1, stateFile);*/
-/*    fwrite(&ppuW, sizeof(ppuW), 1, stateFile);
-    fwrite(&ppuX, sizeof(ppuX), 1, stateFile);
-    fwrite(&ppuT, sizeof(ppuT), 1, stateFile);
-    fwrite(&ppuV, sizeof(ppuV), 1, stateFile);*/
-    fwrite(&cart.mirroring, sizeof(cart.mirroring), 1, stateFile);
-    if (cart.wramSize)
-        fwrite(wram, cart.wramSize, 1, stateFile);
-    else if (cart.bwramSize)
-        fwrite(bwram, cart.bwramSize, 1, stateFile);
-    if (cart.cramSize)
-        fwrite(chrRam, cart.cramSize, 1, stateFile);
-    fclose(stateFile);
+//returns the snapshot size or 0 if it does not fit
+size_t nes_save_snapshot(uint8_t *data, size_t size) {
+    struct stateHeader header = { STATE_MAGIC, NES_STATE_VERSION, NES, nes_state_size() };
+    struct stateBuffer state = { data, size, 0, 0, 0 };
+    if (size < header.size)
+        return 0;
+    memcpy(header.romSha1, cartHash, sizeof(header.romSha1));
+    STATE(&state, header);
+    nes_state(&state);
+    return state.pos;
+}
+
+//the machine is left untouched unless the snapshot matches the loaded cartridge
+int nes_load_snapshot(const uint8_t *data, size_t size) {
+    struct stateBuffer state = { (uint8_t *)data, size, sizeof(struct stateHeader), 1, 0 };
+    if (state_check(data, size, NES_STATE_VERSION, NES, nes_state_size(), cartHash))
+        return 1;
+    nes_state(&state);
+    return state.error;
 }
 
-void load_state() {
-    char *stateName = strdup(romName);
-    sprintf(stateName + strlen(stateName) - 3, "sta");
-    FILE *stateFile = fopen(stateName, "r");
-    /* TODO: check for existing save */
-    int readErr = 0;
-//    readErr |= fread(prgBank, sizeof(prgBank), 1, stateFile);
-    readErr |= fread(cpuRam, sizeof(cpuRam), 1, stateFile);
-/*    readErr |= fread(&cpuA, sizeof(cpuA), 1, stateFile);
-    readErr |= fread(&cpuX, sizeof(cpuX), 1, stateFile);
-    readErr |= fread(&cpuY, sizeof(cpuY), 1, stateFile);
-    readErr |= fread(&cpuP, sizeof(cpuP), 1, stateFile);
-    readErr |= fread(&cpuS, sizeof(cpuS), 1, stateFile);
-    readErr |= fread(&cpuPC, sizeof(cpuPC), 1, stateFile);*/
-//    readErr |= fread(chrBank, sizeof(chrBank), 1, stateFile);
-    readErr |= fread(chrSource, sizeof(chrSource), 1, stateFile);
-    readErr |= fread(oam, sizeof(oam), 1, stateFile);
-    readErr |= fread(nameSlot, sizeof(nameSlot), 1, stateFile);
-    readErr |= fread(ciRam, sizeof(ciRam), 1, stateFile);
-    readErr |= fread(palette, sizeof(palette), 1, stateFile);
-/*    readErr |= fread(&ppudot, sizeof(ppudot), 1, stateFile);
-    readErr |= fread(&ppu_vCounter, sizeof(ppu_vCounter), 1, stateFile);*/
-/*    readErr |= fread(&ppuW, sizeof(ppuW), 1, stateFile);
-    readErr |= fread(&ppuX, sizeof(ppuX), 1, stateFile);
-    readErr |= fread(&ppuT, sizeof(ppuT), 1, stateFile);
-    readErr |= fread(&ppuV, sizeof(ppuV), 1, stateFile);*/
-    readErr |= fread(&cart.mirroring, sizeof(cart.mirroring), 1, stateFile);
+void nes_state(struct stateBuffer *state) {
+    /* the sound thread has to catch up and go idle before the channels are touched */
+    if (state->data)
+        apu_flush();
+    map_state_regions();
+    _6502_state(state);
+    STATE(state, cpuRam);
+    STATE(state, ppuRegs);
+    STATE(state, apuRegs);
+    STATE(state, openBus);
+    /* the buttons held (ctr1, ctr2) belong to the host and stay as they are */
+    STATE(state, ctrb);
+    STATE(state, ctrb2);
+    STATE(state, s);
+    STATE(state, ppu_wait);
+    STATE(state, apu_wait);
+    STATE(state, fds_wait);
+    for (int i = 0; i < 0x10; i++) {
+        STATE(state, cpuMemory[i]->mask);
+        STATE(state, cpuMemory[i]->writable);
+        pointer_state(state, &cpuMemory[i]->memory);
+    }
+    for (int i = 0; i < 8; i++)
+        pointer_state(state, &chrSlot[i]);
+    for (int i = 0; i < 4; i++)
+        pointer_state(state, &nameSlot[i]);
+    pointer_state(state, &wramSource);
     if (cart.wramSize)
-        readErr |= fread(wram, cart.wramSize, 1, stateFile);
-    else if (cart.bwramSize)
-        readErr |= fread(bwram, cart.bwramSize, 1, stateFile);
+        state_field(state, wram, cart.wramSize);
+    if (cart.bwramSize)
+        state_field(state, bwram, cart.bwramSize);
     if (cart.cramSize)
-        readErr |= fread(chrRam, cart.cramSize, 1, stateFile);
-    fclose(stateFile);
-    prg_bank_switch();
-    chr_bank_switch();
+        state_field(state, chrRam, cart.cramSize);
+    ppu_state(state);
+    apu_state(state);
+    mapper_state(state);
+    if (currentMachine->bios != NULL)
+        fds_state(state);
 }
 
-//6502 functions
+//region order is part of the snapshot layout, unused regions have size 0
+void map_state_regions() {
+    struct stateRegion regions[] = {
+        { cpuRam, sizeof(cpuRam) }, { ppuRegs, sizeof(ppuRegs) }, { apuRegs, sizeof(apuRegs) }, { &openBus, 1 },
+        { ciRam, sizeof(ciRam) }, { prg, cart.prgSize }, { chrRom, cart.chrSize }, { chrRam, cart.cramSize },
+        { wram, cart.wramSize }, { bwram, cart.bwramSize }, { fdsRam, currentMachine->bios ? sizeof(fdsRam) : 0 },
+        { fdsBiosRom, currentMachine->bios ? FDS_BIOS_SIZE : 0 }
+    };
+    memcpy(stateRegions, regions, sizeof(stateRegions));
+}
 
-uint8_t s = 0; //TODO: may need to restore related function
+void pointer_state(struct stateBuffer *state, uint8_t **pointer) {
+    uint32_t location = STATE_NULL;
+    if (!state->loading && *pointer) {
+        for (int i = 0; i < sizeof(stateRegions) / sizeof(stateRegions[0]); i++) {
+            if (*pointer >= stateRegions[i].base && *pointer < stateRegions[i].base + stateRegions[i].size) {
+                location = (i << 24) | (*pointer - stateRegions[i].base);
+                break;
+            }
+        }
+    }
+    STATE(state, location);
+    if (state->loading && !state->error) {
+        uint32_t region = location >> 24, offset = location & 0xffffff;
+        if (location == STATE_NULL)
+            *pointer = NULL;
+        else if (region < sizeof(stateRegions) / sizeof(stateRegions[0]) && offset < stateRegions[region].size)
+            *pointer = stateRegions[region].base + offset;
+        else
+            state->error = 1;
+    }
+}
+
+//6502 functions
 
 uint8_t nes_6502_cpuread(uint16_t address) {
     openBus = address >> 4; //TODO: correct emulation involves preserving last value read by 6502
@@ -355,91 +417,6 @@ uint8_t read_cpu_register(uint16_t address) {
 void write_cpu_register(uint16_t address, uint8_t value) {
     uint16_t source;
     switch (address) {
-    case 0x4000: /* Pulse 1 duty, envel., volume */
-        pulse1Control = value;
-        env1Divide = (pulse1Control & 0xf);
-        break;
-    case 0x4001: /* Pulse 1 sweep, period, negate, shift */
-        sweep1 = value;
-        sweep1Divide = ((sweep1 >> 4) & 7);
-        sweep1Shift = (sweep1 & 7);
-        sweep1Reload = 1;
-        break;
-    case 0x4002: /* Pulse 1 timer low */
-        pulse1Timer = (pulse1Timer & 0x700) | value;
-        break;
-    case 0x4003: /* Pulse 1 length counter, timer high */
-        if (apuStatus & 1)
-            pulse1Length = lengthTable[((value >> 3) & 0x1f)];
-        pulse1Timer = (pulse1Timer & 0xff) | ((value & 7) << 8);
-        env1Start = 1;
-        pulse1Duty = 0;
-        break;
-    case 0x4004: /* Pulse 2 duty, envel., volume */
-        pulse2Control = value;
-        env2Divide = (pulse2Control & 0xf);
-        break;
-    case 0x4005: /* Pulse 2 sweep, period, negate, shift */
-        sweep2 = value;
-        sweep2Divide = ((sweep2 >> 4) & 7);
-        sweep2Shift = (sweep2 & 7);
-        sweep2Reload = 1;
-        break;
-    case 0x4006: /* Pulse 2 timer low */
-        pulse2Timer = (pulse2Timer & 0x700) | value;
-        break;
-    case 0x4007: /* Pulse 2 length counter, timer high */
-        if (apuStatus & 2)
-            pulse2Length = lengthTable[((value >> 3) & 0x1f)];
-        pulse2Timer = (pulse2Timer & 0xff) | ((value & 7) << 8);
-        env2Start = 1;
-        pulse2Duty = 0;
-        break;
-    case 0x4008: /* Triangle misc. */
-        triControl = value;
-        break;
-    case 0x400a: /* Triangle timer low */
-        triTimer = (triTimer & 0x700) | value;
-        break;
-    case 0x400b: /* Triangle length, timer high */
-        if (apuStatus & 4) {
-            triLinReload = 1;
-            triLength = lengthTable[((value >> 3) & 0x1f)];
-        }
-        triTimer = (triTimer & 0xff) | ((value & 7) << 8);
-        break;
-    case 0x400c: /* Noise misc. */
-        noiseControl = value;
-        envNoiseDivide = (noiseControl & 0xf);
-        break;
-    case 0x400e: /* Noise loop, period */
-        noiseTimer = noiseTable[(value & 0xf)];
-        noiseMode = (value & 0x80);
-        break;
-    case 0x400f: /* Noise length counter */
-        if (apuStatus & 8) {
-            noiseLength = lengthTable[((value >> 3) & 0x1f)];
-            envNoiseStart = 1;
-        }
-        break;
-    case 0x4010: /* DMC IRQ, loop, freq. */
-        dmcControl = value;
-        dmcRate = dmcRateTable[currentMachine->audioCard][(dmcControl & 0xf)];
-        dmcTemp = dmcRate;
-        if (!(dmcControl & 0x80)) {
-            dmcInt = 0;
-        }
-        break;
-    case 0x4011: /* DMC load counter */
-        dmcOutput = (value & 0x7f);
-        break;
-    case 0x4012: /* DMC sample address */
-        dmcAddress = (0xc000 + (value << 6));
-        dmcCurAdd = dmcAddress;
-        break;
-    case 0x4013: /* DMC sample length */
-        dmcLength = ((value << 4) + 1);
-        break;
     case 0x4014:
         source = (value << 8);
         if (_6502_M2 % 2)
@@ -455,25 +432,6 @@ void write_cpu_register(uint16_t address, uint8_t value) {
             _6502_synchronize(0);
         }
         break;
-    case 0x4015: /* APU status */
-        dmcInt = 0;
-        apuStatus = value;
-        if (!(apuStatus & 0x01))
-            pulse1Length = 0;
-        if (!(apuStatus & 0x02))
-            pulse2Length = 0;
-        if (!(apuStatus & 0x04))
-            triLength = 0;
-        if (!(apuStatus & 0x08))
-            noiseLength = 0;
-        if (!(apuStatus & 0x10)) {
-            dmcBytesLeft = 0;
-            dmcSilence = 1;
-        } else if (apuStatus & 0x10) {
-            if (!dmcBytesLeft)
-                dmcRestart = 1;
-        }
-        break;
     case 0x4016:
         s = (value & 1);
         if (s == 1) {
@@ -481,10 +439,8 @@ void write_cpu_register(uint16_t address, uint8_t value) {
             ctrb2 = 0;
         }
         break;
-    case 0x4017: /* APU frame counter */
-        frameWrite = 1;
-        frameWriteDelay = 2 + (apucc % 2);
-        apuFrameCounter = value;
+    default:
+        write_apu_register(address, value);
         break;
     }
 }
@@ -505,7 +461,7 @@ void nes_6502_synchronize(int x) {
     fds_wait = x;
     if (ppu_drawFrame) {
         ppu_drawFrame = 0;
-        render_frame(ppuScreenBuffer);
+        render_frame(ppuScreenBuffer, ppuDirtyLines);
     }
 }
 
@@ -534,3 +490,13 @@ void nes_p1left(uint8_t buttonDown) {
 void nes_p1right(uint8_t buttonDown) {
     bitset(&ctr1, buttonDown, 7);
 }
+
+void nes_read_pads(uint8_t *pads) {
+    pads[0] = ctr1;
+    pads[1] = ctr2;
+}
+
+void nes_write_pads(const uint8_t *pads) {
+    ctr1 = pads[0];
+    ctr2 = pads[1];
+}
@@ -1,6 +1,7 @@
 #ifndef NESEMU_H_
 #define NESEMU_H_
 #include <stdint.h>
+#include <stddef.h>
 
 #define PRG_BANK 0x1000
 #define CHR_BANK 0x400
@@ -30,7 +31,8 @@ extern const float originalFps, originalCpuClock, cyclesPerFrame;
 extern float fps;
 extern struct machine nes_ntsc,	nes_pal, famicom, fds;
 
-void save_state(), load_state();
+size_t nes_state_size(void), nes_save_snapshot(uint8_t *, size_t);
+int nes_load_snapshot(const uint8_t *, size_t);
 int nesemu();
 
 static inline void bitset(uint_fast8_t * inp, uint_fast8_t val, uint_fast8_t b)
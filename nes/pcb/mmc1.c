@@ -43,6 +43,7 @@ SZROM    128 / 256 KB        16 KB    16-64 KB ROM         Japan Only
  */
 
 #include "../mapper.h"
+#include "../../state.h"
 #include <string.h>
 #include <stdio.h>
 #include "../nescartridge.h"
@@ -70,6 +71,7 @@ static uint8_t prgRamShift;
 static uint32_t lastCycle;
 
 static void mmc1_register_write(uint16_t, uint8_t);
+static void mmc1_state(struct stateBuffer *);
 static void mmc1_prg_bank_switch();
 static void mmc1_chr_bank_switch();
 
@@ -114,6 +116,7 @@ void mmc1_reset() { //TODO: verify startup values
         prgMask32 = ((cart.prgSize >> 15) - 1) << 1;
     }
     write_mapper_register = &mmc1_register_write;
+    mapper_registers_state = &mmc1_state;
     //MMC1A: PRG RAM is always enabled. Two games abuse this lack of feature: they have been allocated to iNES Mapper 155.
     //MMC1B: PRG RAM is enabled by default.
     //MMC1C: PRG RAM is disabled by default. TODO: how to identify these?
@@ -258,3 +261,17 @@ void mmc1_chr_bank_switch() {
         chrSlot[7] = ((chrSource[7] == CHR_RAM) ? (chrRam + ((chrReg0 & chrMask8) << 12)) : (chrRom + ((chrReg0 & chrMask8) << 12))) + 0x1c00;
     }
 }
+
+void mmc1_state(struct stateBuffer *state) {
+    STATE(state, shiftCounter);
+    STATE(state, shiftReg);
+    STATE(state, controlReg_prgSize);
+    STATE(state, controlReg_prgSelect);
+    STATE(state, controlReg_chrSize);
+    STATE(state, chrReg0);
+    STATE(state, chrReg1);
+    STATE(state, prgReg);
+    STATE(state, prgOffset);
+    STATE(state, prgRamBank);
+    STATE(state, lastCycle);
+}
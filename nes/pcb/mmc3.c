@@ -33,6 +33,7 @@ TVROM   64 KB                                   16 / 32 / 64 KB ROM + 4 KB VRAM
  */
 
 #include "../mapper.h"
+#include "../../state.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -59,6 +60,7 @@ static int32_t lastCycle;
 static uint8_t downCycles;
 
 static void     mmc3_register_write(uint16_t, uint8_t);
+static void     mmc3_state(struct stateBuffer *);
 static void     mmc3_prg_bank_switch();
 static void     mmc3_chr_bank_switch();
 static void     mmc3_irq_old(void);
@@ -69,6 +71,7 @@ static uint8_t* mmc3_ppu_read_chr(uint16_t);
 
 void mmc3_reset() { //TODO: verify startup values
     write_mapper_register = &mmc3_register_write;
+    mapper_registers_state = &mmc3_state;
     ppu_read_chr = &mmc3_ppu_read_chr;
     if(!strcmp(cart.subtype,"MMC3A"))//TODO: are some MMC3B using old behavior?
         mmc3_irq = &mmc3_irq_old;
@@ -252,3 +255,21 @@ void mmc3_irq_new() {
         mapperInt = 1;
     irqReload = 0;
 }
+
+void mmc3_state(struct stateBuffer *state) {
+    STATE(state, bank8);
+    STATE(state, bankA);
+    STATE(state, bankC);
+    STATE(state, bankE);
+    STATE(state, bankSelect);
+    STATE(state, bankRegister);
+    STATE(state, irqEnable);
+    STATE(state, irqLatch);
+    STATE(state, irqReload);
+    STATE(state, irqCounter);
+    STATE(state, mmc3ChrSource);
+    STATE(state, lastAddress);
+    STATE(state, lastCycle);
+    STATE(state, downCycles);
+    STATE(state, irqNext);
+}
@@ -11,6 +11,7 @@ FKROM   128 / 256 KB    8 KB        128 KB ROM
 */
 
 #include "../mapper.h"
+#include "../../state.h"
 #include <string.h>
 #include <stdio.h>
 #include "../nescartridge.h"
@@ -29,6 +30,7 @@ static uint16_t latch0;
 static uint16_t latch1;
 
 static void mmc4_register_write(uint16_t, uint8_t);
+static void mmc4_state(struct stateBuffer *);
 static void mmc4_prg_mapping();
 static void mmc4_chr_mapping();
 static uint8_t* mmc4_ppu_read_chr(uint16_t);
@@ -40,6 +42,7 @@ void mmc4_reset() { //TODO: correct startup values
     chrMask = (cart.chrSize >> 12) - 1;
     mmc4_prg_mapping();
     write_mapper_register = &mmc4_register_write;
+    mapper_registers_state = &mmc4_state;
     ppu_read_chr = &mmc4_ppu_read_chr;
 }
 
@@ -109,3 +112,13 @@ void mmc4_chr_mapping() {
     chrSlot[6] = chrRom + (((latch1 ? chrReg3 : chrReg2) & chrMask) << 12) + 0x800;
     chrSlot[7] = chrRom + (((latch1 ? chrReg3 : chrReg2) & chrMask) << 12) + 0xc00;
 }
+
+void mmc4_state(struct stateBuffer *state) {
+    STATE(state, prgReg);
+    STATE(state, chrReg0);
+    STATE(state, chrReg1);
+    STATE(state, chrReg2);
+    STATE(state, chrReg3);
+    STATE(state, latch0);
+    STATE(state, latch1);
+}
@@ -8,6 +8,7 @@
  * -the code only supports .unif format ROMs (their CHR data does not accurately represent actual ROM)
  */
 #include "../mapper.h"
+#include "../../state.h"
 #include "../../video/ppu.h"
 #include "../nescartridge.h"
 #include "../nesemu.h"
@@ -30,6 +31,7 @@ static uint8_t bankC;
 static uint8_t ntTarget;
 
 static void vrc5_register_write(uint16_t, uint8_t);
+static void vrc5_state(struct stateBuffer *);
 static uint8_t vrc5_register_read(uint16_t);
 static uint8_t* vrc5_ppu_read_chr(uint16_t);
 static uint8_t* vrc5_ppu_read_nt(uint16_t);
@@ -39,6 +41,7 @@ static void kanji_decoder();
 
 void vrc5_reset() {
     write_mapper_register = &vrc5_register_write;
+    mapper_registers_state = &vrc5_state;
     read_mapper_register = &vrc5_register_read;
     ppu_read_chr = &vrc5_ppu_read_chr;
     ppu_read_nt = &vrc5_ppu_read_nt;
@@ -186,3 +189,21 @@ void vrc5_irq() {
             vrc5_irqCounter++;
     }
 }
+
+void vrc5_state(struct stateBuffer *state) {
+    STATE(state, qtRam);
+    STATE(state, vrc5_irqControl);
+    STATE(state, vrc5_irqLatch);
+    STATE(state, vrc5_irqCounter);
+    STATE(state, vrc5_tilePosition);
+    STATE(state, vrc5_tileAttribute);
+    STATE(state, vrc5_column);
+    STATE(state, vrc5_row);
+    STATE(state, ciramByte);
+    STATE(state, qtramByte);
+    STATE(state, qtVal);
+    STATE(state, bank8);
+    STATE(state, bankA);
+    STATE(state, bankC);
+    STATE(state, ntTarget);
+}
@@ -0,0 +1,221 @@
+/* Rewind
+ *
+ * Snapshots are taken through the machine's snapshot hooks and kept in a ring
+ * inside a fixed budget. Most of a machine barely changes between frames, so
+ * all but every REWIND_KEYFRAME-th snapshot are stored as the XOR against the
+ * one before, which is mostly zero bytes. Entries are packed as runs of zero
+ * bytes and literals. The newest snapshot is kept unpacked; stepping back XORs
+ * it with the newest delta, a keyframe in the way is stepped over by rebuilding
+ * forward from the keyframe before it. The oldest entry is always a keyframe.
+ */
+
+#include "rewind.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jemu.h"
+
+#define ZERO_RUN	8	/* shorter runs of zero bytes stay in the literals */
+
+struct rewindEntry {
+	size_t offset;	/* in the arena */
+	uint32_t size;
+	uint8_t keyframe;
+};
+
+uint8_t rewinding = 0;
+static uint8_t *arena = NULL, *current = NULL, *scratch = NULL, *packed = NULL;
+static size_t stateSize = 0, arenaHead = 0;
+static struct rewindEntry entries[REWIND_ENTRIES];
+static uint32_t first = 0, count = 0, sinceKeyframe = 0, frames = 0;
+
+static inline void capture(void), step_back(void), drop_oldest(void), unpack(const uint8_t *, uint8_t *, size_t, uint8_t);
+static inline size_t pack(const uint8_t *, uint8_t *, size_t), put_length(uint8_t *, size_t);
+static inline const uint8_t * get_length(const uint8_t *, size_t *);
+static inline struct rewindEntry * entry(uint32_t);
+
+void rewind_frame(){
+	if(rewinding){
+		step_back();
+		frames = 0;
+	}
+	else if(++frames >= REWIND_INTERVAL){
+		capture();
+		frames = 0;
+	}
+}
+
+/* history of another game or from before a reset is dropped */
+void reset_rewind(){
+	first = count = sinceKeyframe = frames = 0;
+	arenaHead = 0;
+	stateSize = 0;
+}
+
+void close_rewind(){
+	free(arena);
+	free(current);
+	free(scratch);
+	free(packed);
+	arena = current = scratch = packed = NULL;
+	reset_rewind();
+}
+
+void capture(){
+	size_t size = snapshot_size(), length;
+	uint8_t keyframe;
+	struct rewindEntry *newest;
+	if(size != stateSize){
+		reset_rewind();
+		stateSize = size;
+		free(current);
+		free(scratch);
+		free(packed);
+		current = malloc(stateSize);
+		scratch = malloc(stateSize);
+		/* literals cost at most a length per ZERO_RUN bytes */
+		packed = malloc(stateSize + (stateSize / ZERO_RUN) * 2 + 16);
+		if(!arena)
+			arena = malloc(REWIND_BUDGET);
+		if(!current || !scratch || !packed || !arena){
+			printf("Error: could not allocate rewind buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!save_snapshot(scratch, stateSize))
+		return;
+	keyframe = (!count || sinceKeyframe >= REWIND_KEYFRAME);
+	if(!keyframe){
+		for(size_t i = 0; i < stateSize; i++)
+			current[i] ^= scratch[i];
+		length = pack(current, packed, stateSize);
+	}
+	else
+		length = pack(scratch, packed, stateSize);
+	uint8_t *swap = current;
+	current = scratch;
+	scratch = swap;
+	if(length > REWIND_BUDGET){
+		reset_rewind();
+		stateSize = size;
+		return;
+	}
+	/* the arena is filled in order, the oldest entries lie just past the head */
+	if(arenaHead + length > REWIND_BUDGET){
+		while(count && entry(0)->offset >= arenaHead)
+			drop_oldest();
+		arenaHead = 0;
+	}
+	while(count && (count == REWIND_ENTRIES || (entry(0)->offset >= arenaHead && entry(0)->offset < arenaHead + length)))
+		drop_oldest();
+	if(!count && !keyframe){
+		/* the chain was dropped, start over from this snapshot */
+		keyframe = 1;
+		length = pack(current, packed, stateSize);
+	}
+	newest = entry(count++);
+	newest->offset = arenaHead;
+	newest->size = length;
+	newest->keyframe = keyframe;
+	memcpy(arena + arenaHead, packed, length);
+	arenaHead += length;
+	sinceKeyframe = keyframe ? 1 : sinceKeyframe + 1;
+}
+
+void step_back(){
+	struct rewindEntry *newest;
+	if(!count)
+		return;
+	if(count > 1){
+		newest = entry(count - 1);
+		if(!newest->keyframe)
+			unpack(arena + newest->offset, current, stateSize, 0);
+		else{
+			uint32_t key = count - 2;
+			while(!entry(key)->keyframe)
+				key--;
+			unpack(arena + entry(key)->offset, current, stateSize, 1);
+			for(uint32_t i = key + 1; i < count - 1; i++)
+				unpack(arena + entry(i)->offset, current, stateSize, 0);
+		}
+		arenaHead = newest->offset;
+		count--;
+		for(sinceKeyframe = 1; !entry(count - sinceKeyframe)->keyframe; sinceKeyframe++);
+	}
+	/* the oldest snapshot stays, rewinding holds there */
+	load_snapshot(current, stateSize);
+}
+
+void drop_oldest(){
+	do{
+		first = (first + 1) & (REWIND_ENTRIES - 1);
+		count--;
+	}while(count && !entry(0)->keyframe);
+}
+
+struct rewindEntry * entry(uint32_t index){
+	return &entries[(first + index) & (REWIND_ENTRIES - 1)];
+}
+
+/* a run of zero bytes and the literals up to the next run, until the end of the data */
+size_t pack(const uint8_t *data, uint8_t *out, size_t size){
+	uint8_t *start = out;
+	size_t i = 0, zeros, literals;
+	uint64_t word;
+	while(i < size){
+		zeros = i;
+		while(zeros + 8 <= size && (memcpy(&word, data + zeros, 8), !word))
+			zeros += 8;
+		while(zeros < size && !data[zeros])
+			zeros++;
+		for(literals = zeros; literals < size; literals++){
+			if(!data[literals] && literals + ZERO_RUN <= size && (memcpy(&word, data + literals, 8), !word))
+				break;
+		}
+		out += put_length(out, zeros - i);
+		out += put_length(out, literals - zeros);
+		memcpy(out, data + zeros, literals - zeros);
+		out += literals - zeros;
+		i = literals;
+	}
+	return out - start;
+}
+
+/* a keyframe replaces out, a delta is XORed into it */
+void unpack(const uint8_t *in, uint8_t *out, size_t size, uint8_t keyframe){
+	size_t i = 0, zeros, literals;
+	while(i < size){
+		in = get_length(in, &zeros);
+		in = get_length(in, &literals);
+		if(keyframe){
+			memset(out + i, 0, zeros);
+			memcpy(out + i + zeros, in, literals);
+		}
+		else{
+			for(size_t n = 0; n < literals; n++)
+				out[i + zeros + n] ^= in[n];
+		}
+		in += literals;
+		i += zeros + literals;
+	}
+}
+
+size_t put_length(uint8_t *out, size_t length){
+	size_t bytes = 0;
+	while(length >= 0x80){
+		out[bytes++] = (length & 0x7f) | 0x80;
+		length >>= 7;
+	}
+	out[bytes++] = length;
+	return bytes;
+}
+
+const uint8_t * get_length(const uint8_t *in, size_t *length){
+	int shift = 0;
+	*length = 0;
+	do{
+		*length |= (size_t)(*in & 0x7f) << shift;
+		shift += 7;
+	}while(*in++ & 0x80);
+	return in;
+}
@@ -0,0 +1,18 @@
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include <stdint.h>
+
+#define REWIND_BUDGET		(64 << 20)	/* compressed snapshots, about 10 minutes of play */
+#define REWIND_INTERVAL		2			/* frames between snapshots */
+#define REWIND_KEYFRAME		64			/* every this many snapshots one is stored whole */
+#define REWIND_ENTRIES		(1 << 15)
+
+/* set while the rewind key is held */
+extern uint8_t rewinding;
+
+/* called by the machine between instructions once a frame is done: takes a snapshot
+ * every REWIND_INTERVAL frames, or steps one snapshot back while rewinding */
+void rewind_frame(void), reset_rewind(void), close_rewind(void);
+
+#endif /* REWIND_H_ */
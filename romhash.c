@@ -0,0 +1,239 @@
+/* Persistent ROM hash cache
+ *
+ * Softlist lookups need the SHA-1 of a ROM, which means reading and hashing
+ * the whole image on every load. Hashes are kept in an append-only file keyed
+ * by the canonical path and area; an entry is valid as long as size, mtime
+ * and inode of the file are unchanged. On a miss the image is hashed in
+ * chunks while the kernel is asked to read ahead the next one.
+ */
+
+#include "romhash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <linux/limits.h>
+#include "evp.h"
+
+#define CACHE_MAGIC		0x4348524a	/* "JRHC" */
+#define CACHE_VERSION	1
+#define HASH_CHUNK		(1 << 20)
+
+struct cacheHeader {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* on disk every record is followed by pathLength bytes of path */
+struct cacheRecord {
+	uint64_t size;
+	uint64_t inode;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	uint16_t pathLength;
+	uint8_t area;
+	uint8_t sha1[ROMHASH_SHA1_SIZE];
+};
+
+struct cacheEntry {
+	struct cacheRecord record;
+	char *path;
+};
+
+static struct cacheEntry *entries = NULL;
+static uint32_t entryCount = 0, entrySize = 0, *slots = NULL, slotMask = 0;
+static uint8_t cacheLoaded = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;	/* loaders and the library indexer share the cache */
+
+static inline void load_cache(void), rewrite_cache(void), insert_entry(struct cacheEntry *), fill_record(struct cacheRecord *, const char *, const struct stat *, RomArea);
+static inline uint32_t path_hash(const char *, RomArea);
+static inline int32_t find_entry(const char *, RomArea);
+static inline const char *canonical_path(const char *, char *);
+
+void rom_sha1(const char *path, const struct stat *romStat, RomArea area, const uint8_t *data, size_t size, uint8_t *sha1){
+	if(!romhash_lookup(path, romStat, area, sha1))
+		return;
+	romhash_compute(data, size, sha1);
+	romhash_store(path, romStat, area, sha1);
+}
+
+/* 0 and the hash on a hit */
+int romhash_lookup(const char *path, const struct stat *romStat, RomArea area, uint8_t *sha1){
+	char canonical[PATH_MAX];
+	struct cacheRecord current;
+	int32_t index;
+	int result = 1;
+	path = canonical_path(path, canonical);
+	fill_record(&current, path, romStat, area);
+	pthread_mutex_lock(&cacheLock);
+	load_cache();
+	if((index = find_entry(path, area)) >= 0){
+		struct cacheRecord *cached = &entries[index].record;
+		if(cached->size == current.size && cached->inode == current.inode && cached->mtimeSec == current.mtimeSec && cached->mtimeNsec == current.mtimeNsec){
+			memcpy(sha1, cached->sha1, ROMHASH_SHA1_SIZE);
+			result = 0;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return result;
+}
+
+void romhash_store(const char *path, const struct stat *romStat, RomArea area, const uint8_t *sha1){
+	char canonical[PATH_MAX];
+	struct cacheEntry entry;
+	path = canonical_path(path, canonical);
+	fill_record(&entry.record, path, romStat, area);
+	memcpy(entry.record.sha1, sha1, ROMHASH_SHA1_SIZE);
+	entry.path = strdup(path);
+	pthread_mutex_lock(&cacheLock);
+	load_cache();
+	insert_entry(&entry);
+	/* later records replace earlier ones when the cache is loaded */
+	FILE *file = fopen(ROMHASH_FILE, "ab");
+	if(file){
+		if(!ftell(file)){
+			struct cacheHeader header = { CACHE_MAGIC, CACHE_VERSION };
+			fwrite(&header, sizeof(header), 1, file);
+		}
+		fwrite(&entry.record, sizeof(entry.record), 1, file);
+		fwrite(entry.path, entry.record.pathLength, 1, file);
+		fclose(file);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/* streaming SHA-1, the page cache fills the next chunk while the current one is hashed */
+void romhash_compute(const uint8_t *data, size_t size, uint8_t *sha1){
+	uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+	size_t offset, chunk;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+	for(offset = 0; offset < size; offset += chunk){
+		chunk = (size - offset) < HASH_CHUNK ? (size - offset) : HASH_CHUNK;
+		if(offset + chunk < size){
+			uintptr_t next = (uintptr_t)(data + offset + chunk), ahead = next & ~pageMask;
+			size_t length = (size - offset - chunk) < HASH_CHUNK ? (size - offset - chunk) : HASH_CHUNK;
+			madvise((void *)ahead, length + (next - ahead), MADV_WILLNEED);
+		}
+		EVP_DigestUpdate(ctx, data + offset, chunk);
+	}
+	EVP_DigestFinal_ex(ctx, sha1, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+void fill_record(struct cacheRecord *record, const char *path, const struct stat *romStat, RomArea area){
+	memset(record, 0, sizeof(*record));
+	record->size = romStat->st_size;
+	record->inode = romStat->st_ino;
+	record->mtimeSec = romStat->st_mtim.tv_sec;
+	record->mtimeNsec = romStat->st_mtim.tv_nsec;
+	record->pathLength = strlen(path);
+	record->area = area;
+}
+
+const char *canonical_path(const char *path, char *buffer){
+	return realpath(path, buffer) ? buffer : path;
+}
+
+uint32_t path_hash(const char *path, RomArea area){
+	uint32_t hash = 2166136261u ^ area;
+	while(*path)
+		hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	return hash;
+}
+
+int32_t find_entry(const char *path, RomArea area){
+	if(!slots)
+		return -1;
+	for(uint32_t i = path_hash(path, area) & slotMask; slots[i]; i = (i + 1) & slotMask){
+		struct cacheEntry *entry = &entries[slots[i] - 1];
+		if(entry->record.area == area && !strcmp(entry->path, path))
+			return slots[i] - 1;
+	}
+	return -1;
+}
+
+/* takes ownership of entry->path, an entry for the same path and area is replaced */
+void insert_entry(struct cacheEntry *entry){
+	int32_t index = find_entry(entry->path, entry->record.area);
+	if(index >= 0){
+		free(entries[index].path);
+		entries[index] = *entry;
+		return;
+	}
+	if(entryCount == entrySize){
+		entrySize = entrySize ? (entrySize << 1) : 256;
+		entries = realloc(entries, entrySize * sizeof(struct cacheEntry));
+		/* slot table at twice the entry capacity keeps probes short */
+		free(slots);
+		slotMask = (entrySize << 1) - 1;
+		slots = calloc(slotMask + 1, sizeof(uint32_t));
+		if(!entries || !slots){
+			printf("Error: could not allocate ROM hash cache\n");
+			exit(EXIT_FAILURE);
+		}
+		for(uint32_t n = 0; n < entryCount; n++){
+			uint32_t i = path_hash(entries[n].path, entries[n].record.area) & slotMask;
+			while(slots[i])
+				i = (i + 1) & slotMask;
+			slots[i] = n + 1;
+		}
+	}
+	uint32_t i = path_hash(entry->path, entry->record.area) & slotMask;
+	while(slots[i])
+		i = (i + 1) & slotMask;
+	entries[entryCount] = *entry;
+	slots[i] = ++entryCount;
+}
+
+void load_cache(){
+	struct cacheHeader header;
+	struct cacheEntry entry;
+	uint32_t records = 0;
+	if(cacheLoaded)
+		return;
+	cacheLoaded = 1;
+	FILE *file = fopen(ROMHASH_FILE, "rb");
+	if(!file)
+		return;
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION){
+		fclose(file);
+		remove(ROMHASH_FILE);
+		return;
+	}
+	while(fread(&entry.record, sizeof(entry.record), 1, file) == 1){
+		entry.path = malloc(entry.record.pathLength + 1);
+		if(!entry.path || fread(entry.path, entry.record.pathLength, 1, file) != 1){
+			free(entry.path); /* torn append, the rest is dropped on rewrite */
+			records = UINT32_MAX;
+			break;
+		}
+		entry.path[entry.record.pathLength] = '\0';
+		insert_entry(&entry);
+		records++;
+	}
+	fclose(file);
+	/* drop replaced records once they outnumber the live ones */
+	if(records > (entryCount << 1) + 64)
+		rewrite_cache();
+}
+
+void rewrite_cache(){
+	char tmpFile[PATH_MAX];
+	struct cacheHeader header = { CACHE_MAGIC, CACHE_VERSION };
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", ROMHASH_FILE);
+	FILE *file = fopen(tmpFile, "wb");
+	if(!file)
+		return;
+	fwrite(&header, sizeof(header), 1, file);
+	for(uint32_t n = 0; n < entryCount; n++){
+		fwrite(&entries[n].record, sizeof(entries[n].record), 1, file);
+		fwrite(entries[n].path, entries[n].record.pathLength, 1, file);
+	}
+	if(fclose(file))
+		remove(tmpFile);
+	else
+		rename(tmpFile, ROMHASH_FILE);
+}
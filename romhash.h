@@ -0,0 +1,23 @@
+#ifndef ROMHASH_H_
+#define ROMHASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define ROMHASH_FILE		"softlist/romhash.cache"
+#define ROMHASH_SHA1_SIZE	20
+
+/* which part of an image a hash covers, a file can have one hash per area */
+typedef enum romArea {
+	AREA_NES_PRG = 0,
+	AREA_SMS_ROM = 1
+} RomArea;
+
+/* SHA-1 of data, taken from the cache when path, size, mtime and inode of the file
+ * still match, otherwise computed and stored */
+void rom_sha1(const char *, const struct stat *, RomArea, const uint8_t *, size_t, uint8_t *);
+int romhash_lookup(const char *, const struct stat *, RomArea, uint8_t *);
+void romhash_store(const char *, const struct stat *, RomArea, const uint8_t *), romhash_compute(const uint8_t *, size_t, uint8_t *);
+
+#endif /* ROMHASH_H_ */
@@ -0,0 +1,103 @@
+/* Run-ahead
+ *
+ * Games react to a button a frame or two after reading it. With run-ahead the
+ * real frame is emulated without being shown, the machine is saved and
+ * runAheadFrames more frames are run with the sound chips skipping, of which
+ * only the last one is presented (and reads the input). The snapshot then puts
+ * the machine back on the real timeline, so what is seen is where the game
+ * will be a few frames later with the input just read.
+ */
+
+#include "runahead.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "jemu.h"
+#include "my_sdl.h"
+#include "audio/mixer.h"
+
+#define STATS_FRAMES	60
+
+uint8_t runAheadFrames = 0, runAheadStats = 0, aheadFrame = 0;
+static uint8_t *snapshot = NULL;
+static size_t snapshotSize = 0;
+static struct timespec passClock;
+static double costSum = 0, costMax = 0;
+static int costFrames = 0;
+static inline void leave_ahead(void), count_cost(void);
+
+void run_ahead_frame(){
+	if(!aheadFrame){
+		if(!runAheadFrames){
+			frameSkip = 0;
+			return;
+		}
+		/* the real frame is done, keep it and look ahead */
+		size_t size = snapshot_size();
+		if(size != snapshotSize){
+			free(snapshot);
+			snapshotSize = size;
+			snapshot = malloc(snapshotSize);
+			if(!snapshot){
+				printf("Error: could not allocate run-ahead snapshot\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if(!save_snapshot(snapshot, snapshotSize))
+			return;
+		if(!passClock.tv_sec)
+			clock_gettime(CLOCK_MONOTONIC, &passClock);
+		audioSkip = 1;
+		aheadFrame = 1;
+		frameSkip = (aheadFrame < runAheadFrames);
+	}
+	else if(aheadFrame < runAheadFrames){
+		aheadFrame++;
+		frameSkip = (aheadFrame < runAheadFrames);
+	}
+	else{
+		/* the last frame was presented, back to the real one which stays hidden */
+		count_cost();
+		clock_gettime(CLOCK_MONOTONIC, &passClock);
+		leave_ahead();
+		frameSkip = 1;
+	}
+}
+
+/* the machine is reset, the snapshot no longer applies */
+void reset_run_ahead(){
+	aheadFrame = 0;
+	audioSkip = 0;
+	frameSkip = 0;
+	passClock.tv_sec = 0;
+}
+
+void close_run_ahead(){
+	if(aheadFrame)
+		leave_ahead();
+	reset_run_ahead();
+	free(snapshot);
+	snapshot = NULL;
+	snapshotSize = 0;
+}
+
+void leave_ahead(){
+	load_snapshot(snapshot, snapshotSize);
+	audioSkip = 0;
+	aheadFrame = 0;
+}
+
+/* emulation time of one host frame: restore, the real frame, the save and the frames ahead
+ * up to the one presented, but not the wait for the next frame */
+void count_cost(){
+	double cost = (presentClock.tv_sec - passClock.tv_sec) * 1000.0 + (presentClock.tv_nsec - passClock.tv_nsec) / 1000000.0;
+	costSum += cost;
+	if(cost > costMax)
+		costMax = cost;
+	if(++costFrames == STATS_FRAMES){
+		if(runAheadStats)
+			printf("run-ahead %d frames: %.2f ms average, %.2f ms max of %.2f ms\n", runAheadFrames, costSum / costFrames, costMax, frameTime / 1000000);
+		costSum = costMax = 0;
+		costFrames = 0;
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef RUNAHEAD_H_
+#define RUNAHEAD_H_
+
+#include <stdint.h>
+
+#define RUNAHEAD_MAX	4
+
+extern uint8_t runAheadFrames;	/* frames presented ahead of the real one, 0 is off */
+extern uint8_t runAheadStats;	/* print the host frame cost once a second */
+extern uint8_t aheadFrame;		/* frames run ahead so far, 0 on the real timeline */
+
+/* called by the machine between instructions once a frame is done */
+void run_ahead_frame(void), reset_run_ahead(void), close_run_ahead(void);
+
+#endif /* RUNAHEAD_H_ */
@@ -1,21 +1,118 @@
 function sine_generator()
-ENV_BITS = 10;
-ENV_LEN = bitshift(1,ENV_BITS);
-ENV_STEP = 128/ENV_LEN;
-SIN_BITS = 10;
-SIN_LEN  = bitshift(1,SIN_BITS);
-TL_RES_LEN = 256;
-TL_TAB_LEN = (11*2*TL_RES_LEN);
-sin_tab = [];
+% Writes the YM2413 lookup tables to audio/ym2413_tables.h
+% run from the repository root: octave --eval sine_generator
+f = fopen('audio/ym2413_tables.h', 'w');
 
 %x = 0..255, y = round(-log( sin( (x+0.5)*pi/256/2)) / log(2) * 256)
-x=256;
-m=[];
-o=[];
+x = 256;
+ls = zeros(1, 256);
+ex = zeros(1, 256);
+for i = 0:255
+    ls(i+1) = round(-log2(sin((i + .5) * (pi/2) / x)) * x);
+    ex(i+1) = round(2^(i / 256) * 1024) - 1024;
+end
+
+fprintf(f, '/* Generated by sine_generator.m, do not edit */\n\n#ifndef YM2413_TABLES_H_\n#define YM2413_TABLES_H_\n\n#include <stdint.h>\n\n');
+fprintf(f, '#define EG_ATTACK_INSTANT\t255\n\n');
+fprintf(f, '/* -log2(sin) over a full 10 bit period in 4.8 fixed point, bit 15 set for the negative half.\n * Waveform 1 is the half-rectified sine, its negative half is silent. */\n');
+fprintf(f, 'static const uint16_t ymLogSine[2][1024] = {\n');
+for wf = 0:1
+    v = zeros(1, 1024);
+    for i = 0:1023
+        if bitand(i, 256)
+            r = ls(bitxor(bitand(i, 255), 255) + 1);
+        else
+            r = ls(bitand(i, 255) + 1);
+        end
+        if bitand(i, 512)
+            if wf
+                r = 4095;
+            end
+            r = bitor(r, 32768);
+        end
+        v(i+1) = r;
+    end
+    fprintf(f, '{\n');
+    write_rows(f, v);
+    if wf
+        fprintf(f, '}\n');
+    else
+        fprintf(f, '},\n');
+    end
+end
+fprintf(f, '};\n\n');
 
+fprintf(f, '/* 2^(-x) for the fractional attenuation bits, 11 bit mantissa with the implied one */\n');
+fprintf(f, 'static const uint16_t ymExp[256] = {\n');
+v = zeros(1, 256);
 for i = 0:255
-    m(i+1) = sin((i+.5) * (pi/2)/x);
-    o(i+1) = -log2(m(i+1)) * x;
+    v(i+1) = bitor(bitshift(ex(bitxor(i, 255) + 1), 1), 2048);
+end
+write_rows(f, v);
+fprintf(f, '};\n\n');
+
+% envelope steps, 4 to 7 out of 8 counter ticks depending on the low rate bits
+egAdvance = [0 1 0 1 0 1 0 1; 0 1 0 1 1 1 0 1; 0 1 1 1 0 1 1 1; 0 1 1 1 1 1 1 1];
+decShift = zeros(1, 64); decMask = zeros(1, 64); dec = zeros(64, 16);
+atkShift = zeros(1, 64); atkMask = zeros(1, 64); atk = zeros(64, 16);
+for r = 0:63
+    group = bitshift(r, -2);
+    eg = egAdvance(bitand(r, 3) + 1, :);
+    for k = 0:15
+        % decay, sustain and release: amount added to the attenuation
+        if group == 0
+            dec(r+1, k+1) = 0;
+        elseif group == 13
+            dec(r+1, k+1) = eg(bitor(bitshift(bitand(k, 12), -1), bitand(k, 1)) + 1) + 1;
+        elseif group == 14
+            dec(r+1, k+1) = eg(bitshift(bitand(k, 12), -1) + 1) + 1;
+        elseif group == 15
+            dec(r+1, k+1) = 2;
+        else
+            dec(r+1, k+1) = eg(bitand(k, 7) + 1);
+        end
+        % attack: shift of the exponential step, 0 for no step
+        if group == 0 || group == 15
+            atk(r+1, k+1) = 255;
+        elseif group >= 12
+            atk(r+1, k+1) = 16 - group;
+        else
+            atk(r+1, k+1) = 4 * eg(bitand(k, 7) + 1);
+        end
+    end
+    if group >= 1 && group <= 12
+        decShift(r+1) = 13 - group;
+        decMask(r+1) = bitshift(1, decShift(r+1)) - 1;
+    end
+    if group >= 1 && group <= 11
+        atkShift(r+1) = 13 - group;
+        atkMask(r+1) = bitand(bitshift(1, atkShift(r+1)) - 1, bitcmp(3, 16));
+    end
+end
+fprintf(f, '/* Envelope steps per effective rate (0-63): a step is taken when the EG counter is clear\n * under the mask, the entry is picked by the counter bits from the shift upwards. */\n');
+fprintf(f, 'static const uint8_t ymEgDecayShift[64] = {\n'); write_rows(f, decShift); fprintf(f, '};\n\n');
+fprintf(f, 'static const uint16_t ymEgDecayMask[64] = {\n'); write_rows(f, decMask); fprintf(f, '};\n\n');
+fprintf(f, 'static const uint8_t ymEgDecay[64][16] = {\n'); write_matrix(f, dec); fprintf(f, '};\n\n');
+fprintf(f, 'static const uint8_t ymEgAttackShift[64] = {\n'); write_rows(f, atkShift); fprintf(f, '};\n\n');
+fprintf(f, 'static const uint16_t ymEgAttackMask[64] = {\n'); write_rows(f, atkMask); fprintf(f, '};\n\n');
+fprintf(f, 'static const uint8_t ymEgAttack[64][16] = {\n'); write_matrix(f, atk); fprintf(f, '};\n\n');
+fprintf(f, '#endif /* YM2413_TABLES_H_ */\n');
+fclose(f);
+end
+
+function write_rows(f, v)
+for i = 1:16:numel(v)
+    fprintf(f, '\t%s,\n', strjoin(arrayfun(@(n) sprintf('%d', n), v(i:min(i+15, numel(v))), 'UniformOutput', false), ', '));
+end
 end
 
-end
\ No newline at end of file
+function write_matrix(f, m)
+for r = 1:rows(m)
+    fprintf(f, '{%s}', strjoin(arrayfun(@(n) sprintf('%d', n), m(r, :), 'UniformOutput', false), ', '));
+    if r < rows(m)
+        fprintf(f, ',\n');
+    else
+        fprintf(f, '\n');
+    end
+end
+end
@@ -3,11 +3,15 @@
 #include <unistd.h>
 #include <stdlib.h>	/* malloc; exit */
 #include <string.h>
-#include "parser.h"
-#include "tree.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sha.h"
 #include "smsemu.h"
 #include "../jemu.h"
+#include "../softlist.h"
+#include "../romhash.h"
+#include "../state.h"
 
 #define EXPANSION_DISABLE	0x80
 #define CART_DISABLE		0x40
@@ -16,20 +20,23 @@
 #define BIOS_DISABLE		0x08
 #define IO_DISABLE			0x04
 
-static inline xmlChar * calculate_checksum(uint8_t *, int);
+static inline void apply_softlist(struct RomFile *);
 static inline uint8_t * read0(uint16_t), * read1(uint16_t), * read2(uint16_t), * read3(uint16_t), * empty(uint16_t);
 static inline void generic_mapper(), sega_mapper(), codemasters_mapper(), setup_banks(), free_rom(void);
-static inline void extract_xml_data(xmlNode *,struct RomFile *), xml_hash_compare(xmlNode *,struct RomFile *), parse_xml_file(xmlNode *,struct RomFile *);
 uint8_t fcr[3], *bank[3], cartRam[CARTRAM_SIZE], memControl, bramReg = 0, returnValue[1]={0}, systemRam[RAM_SIZE], ioEnabled;
 struct RomFile cartRom, cardRom, biosRom, expRom, *currentRom;
 char *xmlFile = "softlist/sms.xml", *bName;
 FILE *bFile;
-xmlDoc *smsXml;
+static struct softlist smsSoftlist;
+static uint8_t softlistOpen = 0;
 
 int init_slots(){
-	if(!(smsXml = xmlReadFile(xmlFile, NULL, 0))){
-		fprintf(stderr,"Error: %s could not be opened.\n",xmlFile);
-		exit(1);}
+	if(!softlistOpen){
+		if(open_softlist(&smsSoftlist, xmlFile, "rom")){
+			fprintf(stderr,"Error: %s could not be opened.\n",xmlFile);
+			exit(1);}
+		softlistOpen = 1;
+	}
 	free_rom();
 	biosRom = load_rom(biosFile);
 	if(biosRom.rom == NULL){
@@ -37,11 +44,12 @@ int init_slots(){
 		return 1;
 	}
 	cartRom = load_rom(currentMachine->cartFile);
+	memcpy(cartHash, cartRom.sha1, sizeof(cartHash));
 	cardRom = load_rom(cardFile);
 	expRom  = load_rom(expFile);
-	xmlFreeDoc(smsXml);
-	memory_control(EXPANSION_DISABLE | CART_DISABLE | CARD_DISABLE | IO_DISABLE);
-	if(currentRom->mapper == CODEMASTERS){
+	/* the paging of the previous game must not carry over, the BIOS is mapped first */
+	bramReg = 0;
+	if(biosRom.mapper == CODEMASTERS){
 		fcr[0] = 0;
 		fcr[1] = 1;
 		fcr[2] = 0;
@@ -50,6 +58,7 @@ int init_slots(){
 		fcr[1] = 1;
 		fcr[2] = 2;
 	}
+	memory_control(EXPANSION_DISABLE | CART_DISABLE | CARD_DISABLE | IO_DISABLE);
 	return 0;
 }
 
@@ -89,6 +98,17 @@ void memory_control(uint8_t value){ /* TODO: dependent on machine version: http:
 	ioEnabled = !(memControl & IO_DISABLE); /* shared with ym2413 */
 }
 
+/* RAM and mapper registers, the banks are mapped again from them on load */
+void cartridge_state(struct stateBuffer *state){
+	STATE(state, systemRam);
+	STATE(state, cartRam);
+	STATE(state, fcr);
+	STATE(state, bramReg);
+	STATE(state, memControl);
+	if(state->loading)
+		memory_control(memControl);
+}
+
 void generic_mapper(){
 	bank[0] = currentRom->rom;
 	bank[1] = currentRom->rom + BANK_SIZE;
@@ -155,26 +175,44 @@ uint8_t * read3(uint16_t address){
 }
 
 struct RomFile load_rom(char *r){/* TODO: add check for cart in card slot etc. */
-	FILE *rfile = fopen(r, "r");
-	if(rfile == NULL){
+	struct stat romStat;
+	int rfd = open(r, O_RDONLY);
+	if(rfd < 0 || fstat(rfd, &romStat) || !romStat.st_size){
+		if(rfd >= 0)
+			close(rfd);
+		struct RomFile output = { NULL };
+		return output;
+	}
+	int rsize = romStat.st_size;
+	size_t mapSize = rsize;
+	uint8_t *tmpRom;
+	/* banks point straight into a private mapping of the image, writable since the CPU writes
+	 * through the bank pointers; images smaller than the three banks are read into a zero
+	 * padded mapping so no bank reaches past it */
+	if(rsize >= (BANK_SIZE * 3))
+		tmpRom = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, rfd, 0);
+	else{
+		mapSize = BANK_SIZE * 3;
+		tmpRom = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(tmpRom != MAP_FAILED && pread(rfd, tmpRom, rsize, 0) != rsize){
+			munmap(tmpRom, mapSize);
+			tmpRom = MAP_FAILED;
+		}
+	}
+	close(rfd);
+	if(tmpRom == MAP_FAILED){
 		struct RomFile output = { NULL };
-		output.sha1 = NULL;
 		return output;
 	}
-	fseek(rfile, 0L, SEEK_END);
-	int rsize = ftell(rfile);
-	rewind(rfile);
-	uint8_t *tmpRom = malloc(rsize);
-	fread(tmpRom, rsize, 1, rfile);
 	uint8_t mask = ((rsize >> BANK_SHIFT) - 1);
-	struct RomFile output = { tmpRom, mask };
+	struct RomFile output = { tmpRom, mapSize, mask };
 	if(rsize > (BANK_SIZE * 3))
 		output.mapper = SEGA;
 	else
 		output.mapper = GENERIC;
 	output.battery=0;
-	output.sha1=calculate_checksum(tmpRom,rsize);
-	parse_xml_file(xmlDocGetRootElement(smsXml),&output);
+	rom_sha1(r, &romStat, AREA_SMS_ROM, tmpRom, rsize, output.sha1);
+	apply_softlist(&output);
 	if(output.battery){
 		bName = strdup(r);
 		sprintf(bName+strlen(bName)-3, "sav");
@@ -187,22 +225,14 @@ struct RomFile load_rom(char *r){/* TODO: add check for cart in card slot etc. *
 }
 
 void free_rom(){
-	if(cartRom.rom != NULL){
-		free(cartRom.rom);
-		free(cartRom.sha1);
-	}
-	if(biosRom.rom != NULL){
-		free(biosRom.rom);
-		free(biosRom.sha1);
-	}
-	if(cardRom.rom != NULL){
-		free(cardRom.rom);
-		free(cardRom.sha1);
-	}
-	if(expRom.rom != NULL){
-		free(expRom.rom);
-		free(expRom.sha1);
-	}
+	if(cartRom.rom != NULL)
+		munmap(cartRom.rom, cartRom.size);
+	if(biosRom.rom != NULL)
+		munmap(biosRom.rom, biosRom.size);
+	if(cardRom.rom != NULL)
+		munmap(cardRom.rom, cardRom.size);
+	if(expRom.rom != NULL)
+		munmap(expRom.rom, expRom.size);
 }
 void close_rom(){
 	free_rom();
@@ -213,63 +243,13 @@ void close_rom(){
 	}
 }
 
-xmlChar * calculate_checksum(uint8_t *data, int size){
-	unsigned char hash[SHA_DIGEST_LENGTH];
-	SHA1(data,size,hash);
-	xmlChar *shash = malloc(SHA_DIGEST_LENGTH*2+1);
-	for (int i = 0; i<sizeof(hash); i++)
-	{
-		sprintf((char *)shash+i*2, "%02x", hash[i]);
-	}
-	return shash;
-}
-
-void extract_xml_data(xmlNode * node, struct RomFile *rom){
-	xmlNode *cur_node = node->children;
-	xmlChar *nam, *val;
-	while (cur_node) {
-		if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (xmlChar *)"feature")) {
-			nam = xmlGetProp(cur_node, (xmlChar *)"name");
-			val = xmlGetProp(cur_node, (xmlChar *)"value");
-			if (!xmlStrcmp(nam,(xmlChar *)"slot")){
-				if (!xmlStrcmp(val,(xmlChar *)"codemasters"))
-					rom->mapper = CODEMASTERS;
-			}
-			else if (!xmlStrcmp(nam,(xmlChar *)"battery")){
-				if (!xmlStrcmp(val,(xmlChar *)"yes"))
-					rom->battery = 1;
-			}
-			xmlFree(nam);
-			xmlFree(val);
-		}
-		cur_node = cur_node->next;
-	}
-}
-
-void xml_hash_compare(xmlNode * node, struct RomFile *rom){
-	xmlNode *cur_node = NULL;
-	xmlChar *hashkey;
-	for (cur_node = node; cur_node; cur_node = cur_node->next){
-		if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (const xmlChar *) "rom")){
-		    hashkey = xmlGetProp(cur_node, (xmlChar *)"sha1");
-		    if (!xmlStrcmp(hashkey,rom->sha1)) {
-		    	extract_xml_data(cur_node->parent->parent, rom);
-		    }
-		    xmlFree(hashkey);
-		}
+void apply_softlist(struct RomFile *rom){
+	int matches;
+	const struct softlistEntry *entry = softlist_find(&smsSoftlist, rom->sha1, &matches);
+	for(int i = 0; i < matches; i++){
+		if(!strcmp(entry[i].slot, "codemasters"))
+			rom->mapper = CODEMASTERS;
+		if(entry[i].battery == 1)
+			rom->battery = 1;
 	}
 }
-void parse_xml_file(xmlNode * node, struct RomFile *rom){
-	xmlNode *cur_node = NULL;
-	xmlChar *key;
-    for (cur_node = node; cur_node; cur_node = cur_node->next) {
-    	if (cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (const xmlChar *) "dataarea")) {
-    		key = xmlGetProp(cur_node, (xmlChar *)"name");
-    		if (!xmlStrcmp(key, (xmlChar *)"rom")) {
-    			xml_hash_compare(cur_node->children, rom);
-    		}
-    		xmlFree(key);
-        }
-        parse_xml_file(cur_node->children, rom);
-    }
-}
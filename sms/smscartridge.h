@@ -1,8 +1,8 @@
 #ifndef CARTRIDGE_H_
 #define CARTRIDGE_H_
 #include <stdint.h>
+#include <stddef.h>
 #include "sha.h"
-#include "parser.h"
 
 #define RAM_SIZE			0x2000
 #define CARTRAM_SIZE		(RAM_SIZE << 2) //maximum supported size
@@ -18,8 +18,9 @@ typedef enum _mapper{
 
 struct RomFile {
 	uint8_t *rom;
+	size_t size;
 	uint8_t mask;
-	xmlChar *sha1;
+	uint8_t sha1[SHA_DIGEST_LENGTH];
 	Mapper mapper;
 	uint8_t battery;
 };
@@ -28,9 +29,11 @@ extern uint8_t fcr[3], *bank[3], cartRam[CARTRAM_SIZE], memControl, bramReg, sys
 Mapper mapper;
 extern struct RomFile cartRom, *currentRom;
 
+struct stateBuffer;
+
 struct RomFile load_rom(char *);
 int init_slots();
-void close_rom(), memory_control(uint8_t);
+void close_rom(), memory_control(uint8_t), cartridge_state(struct stateBuffer *);
 uint8_t * (*read_bank0)(uint16_t),
 		* (*read_bank1)(uint16_t),
 		* (*read_bank2)(uint16_t),
@@ -6,9 +6,15 @@
 #include "../video/vdp.h"
 #include "../audio/sn79489.h"
 #include "../audio/ym2413.h"
+#include "../audio/resampler.h"
+#include "../audio/soundthread.h"
 #include "smscartridge.h"
 #include "../jemu.h"
 #include "../my_sdl.h"
+#include "../state.h"
+#include "../rewind.h"
+#include "../runahead.h"
+#include "../movie.h"
 
 /* Compatibility:
  * zool - hangs at game start (interrupts?) discussion here: http://www.smspower.org/forums/9366-IRQAndIperiodNightmare
@@ -26,7 +32,13 @@
  * -port access behavior differs between consoles (open bus)
  * -randomize startup vcounter? - some game rely on "random" R reg values: http://www.smspower.org/forums/11329-ImpossibleMissionAndTheAbuseOfTheRRegister#87153
  */
-static inline void init_video(void), init_audio(void), sms_reset_emulation(void);
+#define SOUND_BATCH		512	/* PSG clocks queued to the sound thread without a write */
+#define SMS_STATE_VERSION	3
+
+enum { PSG_CHIP, FM_CHIP };
+
+static inline void init_video(void), init_audio(void), sms_reset_emulation(void), sound_write(void (*)(uint8_t), uint8_t), post_sound(void (*)(uint8_t), uint8_t);
+static void set_mute(uint8_t), sms_state(struct stateBuffer *), sms_read_pads(uint8_t *), sms_write_pads(const uint8_t *);
 char cardFile[PATH_MAX], expFile[PATH_MAX], biosFile[PATH_MAX];
 uint8_t ioPort1, ioPort2, ioControl, region, reset = 0, failure = 0;
 uint8_t sms_read_z80_register(uint8_t), * sms_read_z80_memory(uint16_t);
@@ -40,6 +52,7 @@ struct machine ntsc_us =  { SMS,		"mpr-10052.ic2",	"",		NTSC_MASTER,		NTSC,		EXP
 
 static void sms_p1b1(uint8_t), sms_p1b2(uint8_t), sms_reset(uint8_t), sms_p1up(uint8_t), sms_p1down(uint8_t), sms_p1left(uint8_t), sms_p1right(uint8_t), sms_pause(uint8_t);
 int vdpCyclesToRun = 0;
+static int psgAccumulatedCycles = 0, fmAccumulatedCycles = 0, soundCycles[SOUND_MAX_CHIPS];
 //FILE *logfile;
 
 int smsemu(){
@@ -51,6 +64,11 @@ int smsemu(){
 */
 	//hook up general
 	reset_emulation = &sms_reset_emulation;
+	snapshot_size = &sms_state_size;
+	save_snapshot = &sms_save_snapshot;
+	load_snapshot = &sms_load_snapshot;
+	read_pads = &sms_read_pads;
+	write_pads = &sms_write_pads;
 
 	//hook up CPU
 	read_z80_memory = &sms_read_z80_memory;
@@ -73,14 +91,37 @@ int smsemu(){
 	sms_reset_emulation();
 	if(failure)
 		return 1;
+	start_movie();
 	while (quit == 0){
 		run_z80();
+		if(frameDone){
+			frameDone = 0;
+			if(!aheadFrame)
+				movie_frame();
+			if(!movieMode){
+				if(!aheadFrame)
+					rewind_frame();
+				run_ahead_frame();
+			}
+		}
 		if(reset){
 			reset = 0;
 			sms_reset_emulation();
 		}
+		if(stateLoad){
+			stateLoad = 0;
+			load_state();
+		}
+		else if(stateSave){
+			stateSave = 0;
+			save_state();
+		}
 	}
 //	fclose(logfile);
+	stop_movie();
+	close_run_ahead();
+	close_rewind();
+	close_sound_thread();
 	close_rom();
 	close_vdp();
 	close_sn79489();
@@ -88,6 +129,9 @@ int smsemu(){
 }
 
 void sms_reset_emulation(){
+	stop_movie();
+	reset_rewind();
+	reset_run_ahead();
 	ioPort1 = ioPort2 = 0xff;
 	init_video();
 	init_audio();
@@ -98,6 +142,56 @@ void sms_reset_emulation(){
 	set_timings(1);
 }
 
+size_t sms_state_size(){
+	struct stateBuffer state = { NULL, 0, 0, 0, 0 };
+	sms_state(&state);
+	return sizeof(struct stateHeader) + state.pos;
+}
+
+/* returns the snapshot size or 0 if it does not fit */
+size_t sms_save_snapshot(uint8_t *data, size_t size){
+	struct stateHeader header = { STATE_MAGIC, SMS_STATE_VERSION, SMS, sms_state_size() };
+	struct stateBuffer state = { data, size, 0, 0, 0 };
+	if(size < header.size)
+		return 0;
+	memcpy(header.romSha1, cartHash, sizeof(header.romSha1));
+	STATE(&state, header);
+	sms_state(&state);
+	return state.pos;
+}
+
+/* the machine is left untouched unless the snapshot matches the loaded cartridge */
+int sms_load_snapshot(const uint8_t *data, size_t size){
+	struct stateBuffer state = { (uint8_t *)data, size, sizeof(struct stateHeader), 1, 0 };
+	if(state_check(data, size, SMS_STATE_VERSION, SMS, sms_state_size(), cartHash))
+		return 1;
+	sms_state(&state);
+	return state.error;
+}
+
+void sms_state(struct stateBuffer *state){
+	/* the sound thread has to catch up and go idle before its chips are touched */
+	if(state->data && soundThreadRunning){
+		post_sound(NULL, 0);
+		sound_flush();
+	}
+	z80_state(state);
+	/* the buttons held stay as they are, only the port pins driven by the console are restored */
+	STATE(state, ioControl);
+	if(state->loading)
+		iocontrol_write(ioControl);
+	STATE(state, vdpCyclesToRun);
+	STATE(state, psgAccumulatedCycles);
+	STATE(state, fmAccumulatedCycles);
+	STATE(state, soundCycles);
+	cartridge_state(state);
+	vdp_state(state);
+	sn79489_state(state);
+	ym2413_state(state);
+	if(state->loading)
+		set_mute(muteControl);
+}
+
 void set_timings(uint8_t mode){
 	if(mode == 1){ /* set FPS */
 		clockRate = currentMachine->masterClock;
@@ -108,6 +202,7 @@ void set_timings(uint8_t mode){
 	}
 	frameTime = (float)((1/fps) * 1000000000);
 	init_time(frameTime);
+	sound_flush();
 	set_timings_sn79489(PSG_CLOCK_DIV * settings.audioFrequency, clockRate);
 	set_timings_ym2413(FM_CLOCK_DIV * settings.audioFrequency, clockRate);
 }
@@ -135,14 +230,22 @@ void init_video(){
 }
 
 void init_audio(){
+	close_sound_thread();
 	sn79489_mute = 0;
 	ym2413_mute = 1;
 	settings.audioFrequency = 48000;
 	settings.channels = 1;
 	settings.audioBufferSize = 2048;
-	init_sn79489(settings.audioBufferSize);
-	init_ym2413(settings.audioBufferSize);
+	settings.audioQuality = RESAMPLER_MEDIUM;
 	init_sdl_audio();
+	init_sn79489(settings.audioBufferSize);
+	init_ym2413(settings.audioBufferSize, settings.audioQuality);
+	psgAccumulatedCycles = fmAccumulatedCycles = soundCycles[PSG_CHIP] = soundCycles[FM_CHIP] = 0;
+	if(settings.audioThread){
+		sound_add_chip(&run_sn79489);
+		sound_add_chip(&run_ym2413);
+		init_sound_thread();
+	}
 }
 
 // Z80 interfacing instructions:
@@ -163,7 +266,7 @@ uint8_t * sms_read_z80_memory(uint16_t address){
 void sms_write_z80_memory(uint16_t address, uint_fast8_t value){
 	if (address >= 0xc000) /* writing to RAM */
 		systemRam[address & 0x1fff] = value;
-	else if (address < 0xc000 && address >= 0x8000 && (bramReg & 0x8)){
+	else if (address < 0xc000 && address >= 0x8000 && (bramReg & 0x8) && currentRom->mapper == SEGA){
 		bank[address >> 14][address & VRAM_MASK] = value;
 	}
 	if(address == 0x0000 && currentRom->mapper == CODEMASTERS){
@@ -210,10 +313,8 @@ uint8_t sms_read_z80_register(uint8_t reg){
 		return hCounter;
 	case 0x80: /* Read VDP Data Port */
 		return read_vdp_data();
-	case 0x81: ;/* Read VDP Control Port */
-		uint8_t value = statusFlags;
-		statusFlags = controlFlag = lineInt = z80_irqPulled = 0;
-		return value;
+	case 0x81: /* Read VDP Control Port */
+		return read_vdp_status();
 	case 0xc0:
 		/* reads from F2 detects FM */
 		if(reg == 0xf2 && currentMachine->region == JAPAN)
@@ -240,7 +341,7 @@ void sms_write_z80_register(uint8_t reg, uint8_t value){
 		break;
 	case 0x40:
 	case 0x41:
-		write_sn79489(value);
+		sound_write(&write_sn79489, value);
 		break;
 	case 0x80:
 		write_vdp_data(value);
@@ -250,32 +351,15 @@ void sms_write_z80_register(uint8_t reg, uint8_t value){
 		break;
 	case 0xc0: /* YM2413 access; Keyboard support? */
 		if(reg == 0xf0 && currentMachine->region == JAPAN)
-			write_ym2413_register(value);
+			sound_write(&write_ym2413_register, value);
 		else if(reg == 0xf2 && currentMachine->region == JAPAN){
 			muteControl = (value & 0x03);
-			switch(muteControl){
-			case 0:
-				sn79489_mute = 0;
-				ym2413_mute = 1;
-				break;
-			case 1:
-				sn79489_mute = 1;
-				ym2413_mute = 0;
-				break;
-			case 2:
-				sn79489_mute = 1;
-				ym2413_mute = 1;
-				break;
-			case 3:
-				sn79489_mute = 0;
-				ym2413_mute = 0;
-				break;
-			}
+			sound_write(&set_mute, muteControl);
 		}
 		break;
 	case 0xc1:
 		if(reg == 0xf1 && currentMachine->region == JAPAN)
-			write_ym2413_data(value);
+			sound_write(&write_ym2413_data, value);
 		break;
 	}
 }
@@ -284,20 +368,62 @@ void sms_addcycles(uint8_t val){
 	psgAccumulatedCycles += val;
 	fmAccumulatedCycles += val;
 	while(psgAccumulatedCycles > PSG_CLOCK_RATIO){
-		audioCyclesToRun++;
+		soundCycles[PSG_CHIP]++;
 		psgAccumulatedCycles -= PSG_CLOCK_RATIO;
 	}
 	while(fmAccumulatedCycles > FM_CLOCK_RATIO){
-		fmCyclesToRun++;
+		soundCycles[FM_CHIP]++;
 		fmAccumulatedCycles -= FM_CLOCK_RATIO;
 	}
 }
 void sms_synchronize(int cycles){
 	run_vdp(vdpCyclesToRun - (cycles * VDP_CLOCK_RATIO));
 	vdpCyclesToRun = cycles * VDP_CLOCK_RATIO;
-	run_sn79489();
+	if(soundThreadRunning){
+		if(soundCycles[PSG_CHIP] >= SOUND_BATCH)
+			post_sound(NULL, 0);
+		return;
+	}
+	run_sn79489(soundCycles[PSG_CHIP]);
 	if(currentMachine->expansionSound)
-		run_ym2413();
+		run_ym2413(soundCycles[FM_CHIP]);
+	soundCycles[PSG_CHIP] = soundCycles[FM_CHIP] = 0;
+}
+
+/* register writes go through the queue when the chips run on the sound thread */
+void sound_write(void (*write)(uint8_t), uint8_t value){
+	if(soundThreadRunning)
+		post_sound(write, value);
+	else
+		(*write)(value);
+}
+
+void post_sound(void (*write)(uint8_t), uint8_t value){
+	if(!currentMachine->expansionSound)
+		soundCycles[FM_CHIP] = 0;
+	sound_post(soundCycles, write, value);
+	soundCycles[PSG_CHIP] = soundCycles[FM_CHIP] = 0;
+}
+
+void set_mute(uint8_t control){
+	switch(control){
+	case 0:
+		sn79489_mute = 0;
+		ym2413_mute = 1;
+		break;
+	case 1:
+		sn79489_mute = 1;
+		ym2413_mute = 0;
+		break;
+	case 2:
+		sn79489_mute = 1;
+		ym2413_mute = 1;
+		break;
+	case 3:
+		sn79489_mute = 0;
+		ym2413_mute = 0;
+		break;
+	}
 }
 
 //Input functions
@@ -310,6 +436,17 @@ void sms_p1down		(uint8_t buttonDown) { buttonDown ? (ioPort1 &= ~IO1_PORTA_DOWN
 void sms_p1left		(uint8_t buttonDown) { buttonDown ? (ioPort1 &= ~IO1_PORTA_LEFT ) : (ioPort1 |= IO1_PORTA_LEFT ); }
 void sms_p1right	(uint8_t buttonDown) { buttonDown ? (ioPort1 &= ~IO1_PORTA_RIGHT) : (ioPort1 |= IO1_PORTA_RIGHT); }
 
+/* the TH pins of port 2 are left to the console */
+void sms_read_pads(uint8_t *pads){
+	pads[0] = ioPort1;
+	pads[1] = ioPort2 & ~(IO2_PORTA_TH | IO2_PORTB_TH);
+}
+
+void sms_write_pads(const uint8_t *pads){
+	ioPort1 = pads[0];
+	ioPort2 = (ioPort2 & (IO2_PORTA_TH | IO2_PORTB_TH)) | (pads[1] & ~(IO2_PORTA_TH | IO2_PORTB_TH));
+}
+
 /* trace zexdoc.log,0,noloop,{tracelog "%04x,%04x,%04x,%04x,%04x,%04x,%04x,%04x,",pc,(af&ffd7),bc,de,hl,ix,iy,sp}*/
 /*	logfile = fopen("/home/jonas/git/logfile.txt","w");
 	if (logfile==NULL){
@@ -8,6 +8,7 @@
 #ifndef SMSEMU_H_
 #define SMSEMU_H_
 #include <stdint.h>
+#include <stddef.h>
 #include <linux/limits.h>
 #include "../video/vdp.h"
 
@@ -54,6 +55,8 @@ extern char cartFile[PATH_MAX], cardFile[PATH_MAX], expFile[PATH_MAX], biosFile[
 extern FILE *logfile;
 extern struct machine ntsc_us, ntsc_jp, pal1, pal2;
 void set_timings(uint8_t), iocontrol_write(uint8_t), machine_menu_option(int);
+size_t sms_state_size(void), sms_save_snapshot(uint8_t *, size_t);
+int sms_load_snapshot(const uint8_t *, size_t);
 int smsemu(void);
 
 #endif /* SMSEMU_H_ */
@@ -0,0 +1,279 @@
+/* Binary softlist index
+ *
+ * The softlists are MAME style XML files of several thousand lines, parsing
+ * them into a DOM on every ROM load is slow. The parts a cartridge loader can
+ * match are extracted once into fixed size records sorted by SHA-1, written
+ * next to the XML (foo.xml -> foo.idx) and memory mapped from then on. The
+ * index is rebuilt whenever the XML is newer than it.
+ */
+
+#include "softlist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "parser.h"
+#include "tree.h"
+
+#define INDEX_MAGIC		0x494c534a	/* "JSLI" */
+#define INDEX_VERSION	2
+
+struct indexHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entrySize;
+	uint32_t count;
+};
+
+struct entryList {
+	struct softlistEntry *entries;
+	uint32_t count, size;
+};
+
+static inline int map_index(struct softlist *, const char *), build_index(struct softlist *, const char *, const char *, const char *), compare_entries(const void *, const void *);
+static inline void collect_entries(xmlNode *, const char *, struct entryList *), parse_part(xmlNode *, struct softlistEntry *), parse_software(xmlNode *, struct softlistEntry *), write_index(const char *, struct entryList *);
+
+int open_softlist(struct softlist *list, const char *xmlFile, const char *area){
+	char indexFile[PATH_MAX];
+	struct stat xmlStat, indexStat;
+	const char *ext = strrchr(xmlFile, '.');
+	int length = ext ? (int)(ext - xmlFile) : (int)strlen(xmlFile);
+	memset(list, 0, sizeof(*list));
+	if(snprintf(indexFile, sizeof(indexFile), "%.*s.idx", length, xmlFile) >= (int)sizeof(indexFile)){
+		printf("Error: softlist path %s is too long\n", xmlFile);
+		return 1;
+	}
+	if(stat(xmlFile, &xmlStat)){
+		/* a shipped index is still usable without its XML */
+		return map_index(list, indexFile);
+	}
+	if(!stat(indexFile, &indexStat) && indexStat.st_mtime >= xmlStat.st_mtime && !map_index(list, indexFile))
+		return 0;
+	return build_index(list, xmlFile, indexFile, area);
+}
+
+/* first entry for the hash, count is set to the number of entries sharing it */
+const struct softlistEntry *softlist_find(const struct softlist *list, const uint8_t *sha1, int *count){
+	uint32_t low = 0, high = list->count, mid, end;
+	while(low < high){
+		mid = low + ((high - low) >> 1);
+		if(memcmp(list->entries[mid].sha1, sha1, SOFTLIST_SHA1_SIZE) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for(end = low; end < list->count && !memcmp(list->entries[end].sha1, sha1, SOFTLIST_SHA1_SIZE); end++);
+	*count = end - low;
+	return *count ? &list->entries[low] : NULL;
+}
+
+int map_index(struct softlist *list, const char *indexFile){
+	struct stat indexStat;
+	struct indexHeader *header;
+	int fd = open(indexFile, O_RDONLY);
+	if(fd < 0)
+		return 1;
+	if(fstat(fd, &indexStat) || indexStat.st_size < (off_t)sizeof(struct indexHeader)){
+		close(fd);
+		return 1;
+	}
+	void *map = mmap(NULL, indexStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 1;
+	header = map;
+	if(header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || header->entrySize != sizeof(struct softlistEntry) ||
+			indexStat.st_size != (off_t)(sizeof(struct indexHeader) + (size_t)header->count * sizeof(struct softlistEntry))){
+		munmap(map, indexStat.st_size);
+		return 1;
+	}
+	list->map = map;
+	list->mapSize = indexStat.st_size;
+	list->entries = (const struct softlistEntry *)(header + 1);
+	list->count = header->count;
+	return 0;
+}
+
+int build_index(struct softlist *list, const char *xmlFile, const char *indexFile, const char *area){
+	struct entryList found = { NULL, 0, 0 };
+	xmlDoc *doc = xmlReadFile(xmlFile, NULL, 0);
+	if(!doc)
+		return 1;
+	collect_entries(xmlDocGetRootElement(doc), area, &found);
+	xmlFreeDoc(doc); /* no xmlCleanupParser, the library indexer may be parsing on its own thread */
+	qsort(found.entries, found.count, sizeof(struct softlistEntry), compare_entries);
+	printf("Indexed %u softlist entries from %s\n", found.count, xmlFile);
+	write_index(indexFile, &found);
+	if(!map_index(list, indexFile)){
+		free(found.entries);
+		return 0;
+	}
+	/* read-only softlist directory, keep the table on the heap */
+	list->entries = found.entries;
+	list->count = found.count;
+	return 0;
+}
+
+void write_index(const char *indexFile, struct entryList *found){
+	char tmpFile[PATH_MAX];
+	struct indexHeader header = { INDEX_MAGIC, INDEX_VERSION, sizeof(struct softlistEntry), found->count };
+	/* unique name, the library indexer may build the same index concurrently */
+	if(snprintf(tmpFile, sizeof(tmpFile), "%s.XXXXXX", indexFile) >= (int)sizeof(tmpFile))
+		return; /* a truncated template is no temporary next to the index */
+	int fd = mkstemp(tmpFile);
+	if(fd < 0)
+		return;
+	fchmod(fd, 0644);
+	FILE *file = fdopen(fd, "wb");
+	if(!file){
+		close(fd);
+		remove(tmpFile);
+		return;
+	}
+	if(fwrite(&header, sizeof(header), 1, file) != 1 ||
+			fwrite(found->entries, sizeof(struct softlistEntry), found->count, file) != found->count){
+		fclose(file);
+		remove(tmpFile);
+		return;
+	}
+	fclose(file);
+	rename(tmpFile, indexFile); /* readers never see a partial index */
+}
+
+int compare_entries(const void *a, const void *b){
+	const struct softlistEntry *ea = a, *eb = b;
+	int result = memcmp(ea->sha1, eb->sha1, SOFTLIST_SHA1_SIZE);
+	if(result)
+		return result;
+	return (ea->order > eb->order) - (ea->order < eb->order);
+}
+
+/* every rom in a matching dataarea becomes an entry for the part around it */
+void collect_entries(xmlNode *node, const char *area, struct entryList *found){
+	xmlNode *cur_node, *rom;
+	xmlChar *key;
+	for(cur_node = node; cur_node; cur_node = cur_node->next){
+		if(cur_node->type == XML_ELEMENT_NODE && !xmlStrcmp(cur_node->name, (const xmlChar *)"dataarea")){
+			key = xmlGetProp(cur_node, (xmlChar *)"name");
+			if(!xmlStrcmp(key, (const xmlChar *)area)){
+				for(rom = cur_node->children; rom; rom = rom->next){
+					if(rom->type != XML_ELEMENT_NODE || xmlStrcmp(rom->name, (const xmlChar *)"rom"))
+						continue;
+					xmlChar *hash = xmlGetProp(rom, (xmlChar *)"sha1");
+					if(hash && strlen((char *)hash) == SOFTLIST_SHA1_SIZE * 2){
+						if(found->count == found->size){
+							found->size = found->size ? (found->size << 1) : 1024;
+							found->entries = realloc(found->entries, found->size * sizeof(struct softlistEntry));
+							if(!found->entries){
+								printf("Error: could not allocate softlist index\n");
+								exit(EXIT_FAILURE);
+							}
+						}
+						struct softlistEntry *entry = &found->entries[found->count];
+						for(int i = 0; i < SOFTLIST_SHA1_SIZE; i++)
+							sscanf((char *)hash + (i << 1), "%2hhx", &entry->sha1[i]);
+						entry->order = found->count++;
+						parse_part(rom->parent->parent, entry);
+					}
+					xmlFree(hash);
+				}
+			}
+			xmlFree(key);
+		}
+		collect_entries(cur_node->children, area, found);
+	}
+}
+
+void parse_part(xmlNode *part, struct softlistEntry *entry){
+	xmlNode *cur_node;
+	xmlChar *nam, *val;
+	memset((uint8_t *)entry + offsetof(struct softlistEntry, title), 0, sizeof(*entry) - offsetof(struct softlistEntry, title));
+	entry->mirroring = entry->battery = SOFTLIST_UNSET;
+	entry->vrc24Prg1 = entry->vrc24Prg0 = entry->vrc24Chr = entry->vrc6Prg1 = entry->vrc6Prg0 = SOFTLIST_UNSET;
+	entry->prgSize = entry->chrSize = entry->wramSize = entry->bwramSize = entry->vramSize = entry->vram2Size = SOFTLIST_UNSET;
+	if(part->parent)
+		parse_software(part->parent, entry);
+	for(cur_node = part->children; cur_node; cur_node = cur_node->next){
+		if(cur_node->type != XML_ELEMENT_NODE)
+			continue;
+		if(!xmlStrcmp(cur_node->name, (xmlChar *)"feature")){
+			nam = xmlGetProp(cur_node, (xmlChar *)"name");
+			val = xmlGetProp(cur_node, (xmlChar *)"value");
+			if(!nam || !val)
+				;
+			else if(!xmlStrcmp(nam, (xmlChar *)"slot"))
+				snprintf(entry->slot, sizeof(entry->slot), "%s", (char *)val);
+			else if(!xmlStrcmp(nam, (xmlChar *)"pcb"))
+				snprintf(entry->pcb, sizeof(entry->pcb), "%s", (char *)val);
+			else if(!xmlStrcmp(nam, (xmlChar *)"mmc1_type") || !xmlStrcmp(nam, (xmlChar *)"mmc3_type"))
+				snprintf(entry->subtype, sizeof(entry->subtype), "%s", (char *)val);
+			else if(!xmlStrcmp(nam, (xmlChar *)"battery"))
+				entry->battery = !xmlStrcmp(val, (xmlChar *)"yes");
+			else if(!xmlStrcmp(nam, (xmlChar *)"vrc2-pin3") || !xmlStrcmp(nam, (xmlChar *)"vrc4-pin3"))
+				entry->vrc24Prg1 = strtol((char *)val + 5, NULL, 10); /* "PRG Ax" */
+			else if(!xmlStrcmp(nam, (xmlChar *)"vrc2-pin4") || !xmlStrcmp(nam, (xmlChar *)"vrc4-pin4"))
+				entry->vrc24Prg0 = strtol((char *)val + 5, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"vrc2-pin21"))
+				entry->vrc24Chr = xmlStrcmp(val, (xmlChar *)"NC") ? 1 : 0;
+			else if(!xmlStrcmp(nam, (xmlChar *)"vrc6-pin9"))
+				entry->vrc6Prg1 = strtol((char *)val + 5, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"vrc6-pin10"))
+				entry->vrc6Prg0 = strtol((char *)val + 5, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"mirroring")){
+				if(!xmlStrcmp(val, (xmlChar *)"horizontal"))
+					entry->mirroring = 0;
+				else if(!xmlStrcmp(val, (xmlChar *)"vertical"))
+					entry->mirroring = 1;
+				else if(!xmlStrcmp(val, (xmlChar *)"high"))
+					entry->mirroring = 3;
+				else if(!xmlStrcmp(val, (xmlChar *)"4screen"))
+					entry->mirroring = 4;
+				else if(!xmlStrcmp(val, (xmlChar *)"pcb_controlled"))
+					entry->mirroring = 5;
+			}
+			xmlFree(nam);
+			xmlFree(val);
+		}
+		else if(!xmlStrcmp(cur_node->name, (xmlChar *)"dataarea")){
+			nam = xmlGetProp(cur_node, (xmlChar *)"name");
+			val = xmlGetProp(cur_node, (xmlChar *)"size");
+			if(!nam || !val)
+				;
+			else if(!xmlStrcmp(nam, (xmlChar *)"prg"))
+				entry->prgSize = strtol((char *)val, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"chr"))
+				entry->chrSize = strtol((char *)val, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"wram"))
+				entry->wramSize = strtol((char *)val, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"bwram"))
+				entry->bwramSize = strtol((char *)val, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"vram"))
+				entry->vramSize = strtol((char *)val, NULL, 10);
+			else if(!xmlStrcmp(nam, (xmlChar *)"vram2"))
+				entry->vram2Size = strtol((char *)val, NULL, 10);
+			xmlFree(nam);
+			xmlFree(val);
+		}
+	}
+}
+
+void parse_software(xmlNode *software, struct softlistEntry *entry){
+	xmlNode *cur_node;
+	xmlChar *content;
+	for(cur_node = software->children; cur_node; cur_node = cur_node->next){
+		if(cur_node->type != XML_ELEMENT_NODE)
+			continue;
+		content = NULL;
+		if(!xmlStrcmp(cur_node->name, (xmlChar *)"description") && (content = xmlNodeGetContent(cur_node)))
+			snprintf(entry->title, sizeof(entry->title), "%s", (char *)content);
+		else if(!xmlStrcmp(cur_node->name, (xmlChar *)"year") && (content = xmlNodeGetContent(cur_node)))
+			snprintf(entry->year, sizeof(entry->year), "%s", (char *)content);
+		else if(!xmlStrcmp(cur_node->name, (xmlChar *)"publisher") && (content = xmlNodeGetContent(cur_node)))
+			snprintf(entry->publisher, sizeof(entry->publisher), "%s", (char *)content);
+		xmlFree(content);
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef SOFTLIST_H_
+#define SOFTLIST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SOFTLIST_UNSET		-1
+#define SOFTLIST_SHA1_SIZE	20
+
+/* what a cartridge loader takes from a softlist part, fields not given in the XML are
+ * SOFTLIST_UNSET or an empty string */
+struct softlistEntry {
+	uint8_t sha1[SOFTLIST_SHA1_SIZE];
+	uint32_t order;		/* position in the XML, duplicates keep their order */
+	char title[112];	/* description, year and publisher of the software */
+	char year[8];
+	char publisher[48];
+	char slot[20];
+	char pcb[30];
+	char subtype[20];
+	int8_t mirroring;
+	int8_t battery;
+	int8_t vrc24Prg1, vrc24Prg0, vrc24Chr, vrc6Prg1, vrc6Prg0;
+	int32_t prgSize, chrSize, wramSize, bwramSize, vramSize, vram2Size;
+};
+
+struct softlist {
+	const struct softlistEntry *entries;	/* sorted by sha1 */
+	uint32_t count;
+	void *map;			/* mmap'ed index, or NULL when the entries are on the heap */
+	size_t mapSize;
+};
+
+/* area is the dataarea whose rom hashes are indexed */
+int open_softlist(struct softlist *, const char *, const char *);
+const struct softlistEntry *softlist_find(const struct softlist *, const uint8_t *, int *);
+
+#endif /* SOFTLIST_H_ */
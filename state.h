@@ -0,0 +1,58 @@
+#ifndef STATE_H_
+#define STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "romhash.h"
+
+#define STATE_MAGIC		0x5453454a	/* "JEST" */
+
+/* Machine snapshots: every module walks its variables through state_field in a fixed
+ * order. The same walk saves, restores or, without a buffer, only measures, so the
+ * layout can't differ between the directions. */
+struct stateBuffer {
+	uint8_t *data;		/* NULL to only count bytes */
+	size_t size;
+	size_t pos;
+	uint8_t loading;
+	uint8_t error;		/* ran past the buffer or found a value that can't be restored */
+};
+
+struct stateHeader {
+	uint32_t magic;
+	uint16_t version;	/* layout version of the machine */
+	uint16_t machine;
+	uint32_t size;		/* whole snapshot, header included */
+	uint8_t romSha1[ROMHASH_SHA1_SIZE];	/* game the snapshot was taken of */
+};
+
+static inline void state_field(struct stateBuffer *state, void *field, size_t size)
+{
+	if (state->data) {
+		if (state->pos + size > state->size) {
+			state->error = 1;
+			return;
+		}
+		if (state->loading)
+			memcpy(field, state->data + state->pos, size);
+		else
+			memcpy(state->data + state->pos, field, size);
+	}
+	state->pos += size;
+}
+
+/* 0 when data holds a whole snapshot of this machine, layout and game */
+static inline int state_check(const uint8_t *data, size_t size, uint16_t version, uint16_t machine, size_t expected, const uint8_t *rom)
+{
+	struct stateHeader header;
+	if (size < sizeof(header))
+		return 1;
+	memcpy(&header, data, sizeof(header));
+	return header.magic != STATE_MAGIC || header.version != version || header.machine != machine
+			|| header.size != expected || size < expected || memcmp(header.romSha1, rom, ROMHASH_SHA1_SIZE);
+}
+
+#define STATE(state, variable)	state_field((state), &(variable), sizeof(variable))
+
+#endif /* STATE_H_ */
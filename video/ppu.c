@@ -16,6 +16,7 @@
 #include "../nes/mapper.h" //CHR_RAM; chrSource; mapperInt
 #include "../cpu/6502.h" //irqPulled
 #include "../nes/nescartridge.h" //cart
+#include "../state.h"
 
 struct ppuDisplayMode ntscMode = { 256, 240, NTSC_SCANLINES };
 struct ppuDisplayMode  palMode = { 256, 240,  PAL_SCANLINES };
@@ -26,6 +27,8 @@ static uint8_t vblank_period;
 static uint8_t nmiSuppressed;
 static uint8_t secOam[0x20];
        uint32_t *ppuScreenBuffer = NULL;
+       uint8_t ppuDirtyLines[240];
+static uint32_t lineHash[240];
 static uint8_t spriteBuffer[256], zeroBuffer[256], priorityBuffer[256], isSpriteZero = 0xff;
 
 //PPU internal registers
@@ -93,6 +96,7 @@ static inline void horizontal_t_to_v();
 static inline void vertical_t_to_v();
 static inline void ppu_render();
 static inline void reload_tile_shifter();
+static inline void hash_scanline();
 static inline void ppuwrite(uint16_t, uint8_t);
 static inline uint8_t * ppuread(uint16_t);
 static inline void none(), seZ(), seRD(), seWD(), seRR(), seWW(), tfNT(), tfAT(), tfLT(), tfHT(), sfNT(), sfAT(), sfLT(), sfHT(), dfNT(), hINC(), vINC();
@@ -101,6 +105,7 @@ static inline void none(), seZ(), seRD(), seWD(), seRR(), seWW(), tfNT(), tfAT()
 void init_ppu() {
     free(ppuScreenBuffer);
     ppuScreenBuffer = malloc(ppuCurrentMode->height * ppuCurrentMode->width * sizeof(uint32_t));
+    memset(ppuDirtyLines, 1, sizeof(ppuDirtyLines));
     frame = 0;
     nmiFlipFlop = 0;
     ppucc = 0;
@@ -232,8 +237,10 @@ void run_ppu (uint16_t ntimes) {
                 (*spriteEvaluation[ppudot])();
             }
             ppu_render();
-            if (ppudot == 257)
+            if (ppudot == 257) {
                 horizontal_t_to_v();
+                hash_scanline();
+            }
         }
         ntimes--;
     }
@@ -478,6 +485,18 @@ void ppu_render() {
     }
 }
 
+//Flag the finished line as dirty if it differs from the previous frame
+void hash_scanline() {
+    uint32_t hash = 2166136261;
+    uint32_t *line = &ppuScreenBuffer[ppu_vCounter * ppuCurrentMode->width];
+    for (int i = 0; i < ppuCurrentMode->width; i++)
+        hash = (hash ^ line[i]) * 16777619;
+    if (hash != lineHash[ppu_vCounter]) {
+        lineHash[ppu_vCounter] = hash;
+        ppuDirtyLines[ppu_vCounter] = 1;
+    }
+}
+
 void horizontal_t_to_v() {
     if (ppuMask & 0x18) {
         ppuV = (ppuV & 0xfbe0) | (ppuT & 0x41f); //reset x scroll
@@ -656,3 +675,62 @@ void check_nmi() {
         nmiFlipFlop = ppucc;
     }
 }
+
+//Everything but the frame buffer, which is fully redrawn every frame
+void ppu_state(struct stateBuffer *state) {
+    uint8_t spriteOffset = sprite ? (sprite - secOam) : 0;
+    STATE(state, ppudot);
+    STATE(state, ppu_vCounter);
+    STATE(state, vblank_period);
+    STATE(state, nmiSuppressed);
+    STATE(state, secOam);
+    STATE(state, spriteBuffer);
+    STATE(state, zeroBuffer);
+    STATE(state, priorityBuffer);
+    STATE(state, isSpriteZero);
+    STATE(state, ppuW);
+    STATE(state, ppuX);
+    STATE(state, ppuT);
+    STATE(state, ppuV);
+    STATE(state, ppuController);
+    STATE(state, ppuMask);
+    STATE(state, ppuData);
+    STATE(state, ppuStatusNmi);
+    STATE(state, ppuStatusSpriteZero);
+    STATE(state, ppuStatusOverflow);
+    STATE(state, ppuStatusNmiDelay);
+    STATE(state, oam);
+    STATE(state, ciRam);
+    STATE(state, palette);
+    STATE(state, ppuOamAddress);
+    STATE(state, ppu_drawFrame);
+    STATE(state, nmiFlipFlop);
+    STATE(state, frame);
+    STATE(state, ppucc);
+    STATE(state, ntData);
+    STATE(state, attData);
+    STATE(state, tileLow);
+    STATE(state, tileHigh);
+    STATE(state, spriteLow);
+    STATE(state, spriteHigh);
+    STATE(state, tileShifterLow);
+    STATE(state, tileShifterHigh);
+    STATE(state, attShifterHigh);
+    STATE(state, attShifterLow);
+    STATE(state, oamOverflow1);
+    STATE(state, oamOverflow2);
+    STATE(state, nSprite1);
+    STATE(state, nSprite2);
+    STATE(state, nData);
+    STATE(state, data);
+    STATE(state, nData2);
+    STATE(state, foundSprites);
+    STATE(state, cSprite);
+    STATE(state, spriteOffset);
+    STATE(state, spriteRow);
+    STATE(state, patternOffset);
+    STATE(state, ppureg);
+    STATE(state, vbuff);
+    if (state->loading)
+        sprite = secOam + (spriteOffset & 0x1c);
+}
@@ -30,10 +30,13 @@ uint32_t frame;
 int32_t ppucc;
 extern int16_t ppu_vCounter;
 extern uint32_t *ppuScreenBuffer;
+extern uint8_t ppuDirtyLines[];
 extern struct ppuDisplayMode ntscMode;
 extern struct ppuDisplayMode palMode;
        struct ppuDisplayMode *ppuCurrentMode;
 
+struct stateBuffer;
+
 uint8_t* (*ppu_read_chr)(uint16_t);
 uint8_t* (*ppu_read_nt)(uint16_t);
 void    (*ppu_write_chr)(uint16_t, uint8_t);
@@ -43,4 +46,5 @@ void    init_ppu();
 void    run_ppu(uint16_t);
 uint8_t ppu_read(uint16_t);
 uint8_t read_ppu_register(uint16_t);
+void    ppu_state(struct stateBuffer *);
 #endif
@@ -39,6 +39,7 @@
 #include "../cpu/z80.h"
 #include "../my_sdl.h"
 #include "../jemu.h"
+#include "../state.h"
 
 uint16_t lineCounter, lineReload;
 uint8_t controlFlag = 0, statusFlags = 0, readBuffer = 0, bgColor = 0, textColor, bgXScroll, bgYScroll, lineInt = 0;
@@ -55,27 +56,39 @@ int16_t vdpdot;
 uint16_t controlWord, vCounter = 0, hCounter = 0, addReg, ntAddress, ntMask, sgAddress, saAddress, ctAddress, pgAddress, pgMask;
 /* Mapped memory */					/* TODO: dynamically allocate screenBuffer */
 uint32_t *vdpScreenBuffer;
+uint8_t vdpDirtyLines[VDP_MAX_LINES];
+static uint32_t lineHash[VDP_MAX_LINES];
 uint8_t vram[VRAM_SIZE], cram[CRAM_SIZE], smsColor[0xc0],
 colorTable[0x30] = {  0,   0,   0,   0,   0,   0,  33, 200,  66,  94, 220, 120,
 					 84,  85, 237, 125, 118, 252, 212,  82,  77,  66, 235, 245,
 					252,  85,  84, 255, 121, 120, 212, 193,  84, 230, 206, 128,
 					 33, 176,  59, 201,  91, 186, 204, 204, 204, 255, 255, 255 };
 uint8_t *currentClut;
-static inline void render_scanline(void), set_video_mode(void);
+/* Mode 4 tiles decoded to one color index per pixel, plus a horizontally mirrored copy */
+static uint8_t tileCache[TILE_COUNT][8][8], tileCacheFlipped[TILE_COUNT][8][8], tileDirty[TILE_COUNT >> 3];
+/* ARGB value of every CRAM entry in Mode 4, of the 16 fixed colors (mirrored) in TMS modes */
+static uint32_t colorCache[CRAM_SIZE];
+/* Shadow of the Sprite Attribute Table and the sprites found on each line, in SAT order */
+static int16_t satY[64];
+static uint8_t satX[64], satN[64], satAttr[32], spriteBin[256][8], spriteCount[256], satDirty = 1;
+static inline void render_scanline(void), set_video_mode(void), hash_scanline(uint16_t), decode_tile(uint16_t), update_color(uint8_t), update_irq(void), build_sprite_bins(void);
+static inline uint8_t * tile_row(uint16_t, uint8_t, uint8_t);
 
 void init_vdp(){
-	set_video_mode();
 	for (int i = 0; i < 0x40; i++) {
 		smsColor[i*3]     = (((i & 0x03) << 6) | ((i & 0x03) << 4) | ((i & 0x03) << 2) | (i & 0x03));
 		smsColor[(i*3)+1] = (((i & 0x0c) << 4) | ((i & 0x0c) << 2) | ((i & 0x0c) >> 2) | (i & 0x0c));
 		smsColor[(i*3)+2] = (((i & 0x30) << 2) | ((i & 0x30) >> 4) | ((i & 0x30) >> 2) | (i & 0x30));
 	}
+	set_video_mode();
 	pgAddress = 0;
 	vdpdot = -94;
 	if(vdpScreenBuffer)
 		free(vdpScreenBuffer);
 	vdpScreenBuffer = (uint32_t*)malloc(vdpCurrentMode->height * vdpCurrentMode->width * sizeof(uint32_t));
 	memset(vdpScreenBuffer, 0xff0000ff, vdpCurrentMode->height * vdpCurrentMode->width * sizeof(uint32_t));
+	memset(vdpDirtyLines, 1, sizeof(vdpDirtyLines));
+	memset(tileDirty, 0xff, sizeof(tileDirty));
 
 	/* TODO: can this be simplfied by thinking of v counter as signed 8 bit? */
 	if(!ntsc192.vcount){
@@ -152,6 +165,15 @@ void set_video_mode(){
 		currentClut = smsColor;
 	else
 		currentClut = colorTable;
+	for (uint8_t i = 0; i < CRAM_SIZE; i++)
+		update_color(i);
+	satDirty = 1; /* sprite size, zoom and the 0xd0 terminator depend on the mode */
+}
+
+/* Lines are rendered whole, so a CRAM write takes effect from the next line on */
+void update_color(uint8_t index){
+	uint8_t cidx = ((videoMode & 0x08) ? (cram[index] & 0x3f) : (index & 0x0f)) * 3;
+	colorCache[index] = (0xff000000 | (currentClut[cidx] << 16) | (currentClut[cidx + 1] << 8) | currentClut[cidx + 2]);
 }
 
 void write_vdp_control(uint8_t value){
@@ -178,6 +200,7 @@ if (!controlFlag){
 			spriteShift = (modeControl1 & 0x08);		/* mode 4 only */
 			externalSync = (modeControl1 & 0x01); 		/* external video */
 			set_video_mode();
+			update_irq();
 			break;
 		case 0x0100: /* Mode Control No. 2 */
 			modeControl2 = (controlWord & 0xff);
@@ -187,6 +210,7 @@ if (!controlFlag){
 			spriteSize = (controlWord & 0x02);			/* dependent on video mode */
 			spriteZoom = (controlWord & 0x01);			/* buggy in 315-5124 only */
 			set_video_mode();
+			update_irq();
 			break;
 		case 0x0200: /* Name Table Base Address */
 			ntMask = ((controlWord << 10) & NT_MASK); /* TODO: set to 0xf in newer vdp versions */
@@ -207,6 +231,7 @@ if (!controlFlag){
 			break;
 		case 0x0500: /* Sprite Attribute Table Base Address */
 			saAddress = ((controlWord & 0x7e) << 7); /* TODO: mask should depend on mode */
+			satDirty = 1;
 			break;
 		case 0x0600: /* Sprite Pattern Generator Base Address */
 			if(videoMode & 0x08)
@@ -238,10 +263,16 @@ if (!controlFlag){
 
 void write_vdp_data(uint8_t value){
 	/* addressing works differently in 4k mode */
-	if(codeReg < 3)
+	if(codeReg < 3){
+		tileDirty[(addReg & VRAM_MASK) >> 8] |= (1 << ((addReg >> 5) & 7));
+		if((uint16_t)((addReg & VRAM_MASK) - saAddress) < 0x100)
+			satDirty = 1;
 		vram[addReg++ & VRAM_MASK] = value;
-	else if(codeReg == 3)
-		cram[addReg++ & CRAM_MASK] = value;
+	}
+	else if(codeReg == 3){
+		cram[addReg & CRAM_MASK] = value;
+		update_color(addReg++ & CRAM_MASK);
+	}
 	readBuffer = value;
 	controlFlag = 0;
 }
@@ -253,8 +284,64 @@ uint8_t read_vdp_data(){
 	return value;
 }
 
+/* Display mode, palette and the tile and sprite caches are derived from the registers again on load */
+void vdp_state(struct stateBuffer *state){
+	STATE(state, modeControl1);
+	STATE(state, modeControl2);
+	STATE(state, codeReg);
+	STATE(state, controlWord);
+	STATE(state, controlFlag);
+	STATE(state, statusFlags);
+	STATE(state, readBuffer);
+	STATE(state, addReg);
+	STATE(state, vScrollLock);
+	STATE(state, hScrollLock);
+	STATE(state, columnMask);
+	STATE(state, lineInterrupt);
+	STATE(state, spriteShift);
+	STATE(state, externalSync);
+	STATE(state, displayEnable);
+	STATE(state, frameInterrupt);
+	STATE(state, spriteSize);
+	STATE(state, spriteZoom);
+	STATE(state, ntAddress);
+	STATE(state, ntMask);
+	STATE(state, ctAddress);
+	STATE(state, pgAddress);
+	STATE(state, pgMask);
+	STATE(state, saAddress);
+	STATE(state, sgAddress);
+	STATE(state, textColor);
+	STATE(state, bgColor);
+	STATE(state, bgXScroll);
+	STATE(state, bgYScroll);
+	STATE(state, lineReload);
+	STATE(state, lineCounter);
+	STATE(state, lineInt);
+	STATE(state, vdpdot);
+	STATE(state, vCounter);
+	STATE(state, hCounter);
+	STATE(state, sframe);
+	STATE(state, vram);
+	STATE(state, cram);
+	if(state->loading){
+		set_video_mode();
+		memset(tileDirty, 0xff, sizeof(tileDirty));
+	}
+}
+
+/* Reading the status acknowledges both interrupt sources */
+uint8_t read_vdp_status(){
+	uint8_t value = statusFlags;
+	statusFlags = controlFlag = lineInt = 0;
+	update_irq();
+	return value;
+}
+
+/* Only a handful of dots per line change any state, so jump straight from one to the next */
 void run_vdp(int cycles){
-while (cycles) {
+int16_t nextEvent;
+while (cycles > 0) {
 	if(vdpdot == 590){//HCOUNT jumps in the middle of HBLANK
 		vdpdot = -94;
 		if(vCounter < vdpCurrentMode->height)
@@ -267,7 +354,7 @@ while (cycles) {
 		sframe++;
 		vCounter = 0;
 		z80_irqPulled = 0;
-		render_frame(vdpScreenBuffer);
+		render_frame(vdpScreenBuffer, vdpDirtyLines);
 	}
 	else if ((vCounter == vdpCurrentMode->vactive) && (vdpdot == -52)){
 		statusFlags |= INT;
@@ -281,20 +368,34 @@ while (cycles) {
 	}
 	else if ((vCounter > vdpCurrentMode->vactive) && (vdpdot == -51))
 		lineCounter = lineReload;
-	if (( ((statusFlags & INT) && frameInterrupt) || ((lineInt) && lineInterrupt) ) && !z80_irqPulled)
-		z80_irqPulled = 1;
-	else if ((!frameInterrupt /*|| (!(mode1 & 0x10))*/) && z80_irqPulled)/* TODO: disabling line interrupt should deassert the IRQ line */
-			z80_irqPulled = 0;
-	cycles--;
-	vdpdot++;
+	update_irq();
+	if(vdpdot < -52)
+		nextEvent = -52;
+	else if(vdpdot < -51)
+		nextEvent = -51;
+	else if(vdpdot < -48)
+		nextEvent = -48;
+	else
+		nextEvent = 590;
+	if((nextEvent - vdpdot) > cycles){
+		vdpdot += cycles;
+		break;
+	}
+	cycles -= (nextEvent - vdpdot);
+	vdpdot = nextEvent;
+}
 }
+
+/* The IRQ line is the OR of both interrupt sources, each gated by its enable bit */
+void update_irq(){
+	z80_irqPulled = ((((statusFlags & INT) && frameInterrupt) || (lineInt && lineInterrupt)) ? 1 : 0);
 }
+
 uint8_t blank=0x15, black=0x00;
 void render_scanline(){
-	uint8_t pixel, tileRow, ntColumn, tileColumn, ntRow, spriteX, spriteI, spriteBuffer = 0, spriteMask[vdpCurrentMode->width], priorityMask[vdpCurrentMode->width], transMask[vdpCurrentMode->width], color, cidx;
+	uint8_t pixel, tileRow, ntColumn, tileColumn, ntRow, spriteX, spriteI, spriteRow, *spritePixels, spriteMask[vdpCurrentMode->width], priorityMask[vdpCurrentMode->width], transMask[vdpCurrentMode->width], color, cidx;
 	int16_t spriteY;
 	uint16_t ntData, pgOffset, ctOffset, sgOffset, ntOffset;
-	memset(spriteMask, 0, vdpCurrentMode->width*sizeof(uint8_t));
 	memset(priorityMask, 0, vdpCurrentMode->width*sizeof(uint8_t));
 	memset(transMask, 0, vdpCurrentMode->width*sizeof(uint8_t));
 	uint16_t yOffset = vCounter + (vdpCurrentMode->tborder - vdpCurrentMode->tblank);
@@ -324,8 +425,6 @@ void render_scanline(){
 			/* Find the address of the corresponding pattern generator */
 			if(videoMode == 2)
 				pgOffset = (pgAddress + (((vCounter & 0xc0) << 5) & pgMask) + ((ntData & 0xff) << 3));
-			else if(videoMode & 0x08)
-				pgOffset = ((ntData & 0x1ff) << 5);
 
 			/* Find the address of the corresponding color (not mode 4) */
 			if(videoMode == 2)
@@ -334,101 +433,93 @@ void render_scanline(){
 			/* Generate the current row of the pattern */
 			tileRow = ((ntData & 0x400) && (videoMode & 0x08)) ? 7-(ntRow & 7) : (ntRow & 7);
 			int targetPixel;
+			uint8_t *tilePixels = NULL;
+			if(videoMode & 0x08)
+				tilePixels = tile_row(ntData & 0x1ff, tileRow, ((ntData & 0x200) ? 1 : 0));
 			for (uint8_t pixelIndex = 0; pixelIndex < 8; pixelIndex++){
-				tileColumn = ((ntData & 0x200) && (videoMode & 0x08)) ? pixelIndex : 7-pixelIndex;
-				pixel  = (vram[pgOffset + (tileRow << ((videoMode & 0x08) ? 2 : 0))] & (1 << tileColumn)) ? 1:0;
-				if(videoMode & 0x08){ /* 4bpp */
-					pixel |= (vram[pgOffset + (tileRow << 2) + 1] & (1 << tileColumn)) ? 2:0;
-					pixel |= (vram[pgOffset + (tileRow << 2) + 2] & (1 << tileColumn)) ? 4:0;
-					pixel |= (vram[pgOffset + (tileRow << 2) + 3] & (1 << tileColumn)) ? 8:0;
+				if(videoMode & 0x08) /* 4bpp, pre-decoded */
+					pixel = tilePixels[pixelIndex];
+				else{
+					tileColumn = 7-pixelIndex;
+					pixel = (vram[pgOffset + tileRow] & (1 << tileColumn)) ? 1:0;
 				}
 
 				/* Output the pattern to the screen buffer */
 				if(videoMode == 2){
 					targetPixel = (((screenColumn << 3) + pixelIndex) & 0xff);
 					color = (vram[ctOffset + tileRow] ? vram[ctOffset + tileRow] : bgColor);
-					cidx = ((pixel ? (color >> 4) : (color & 0xf)) * 3);
+					cidx = (pixel ? (color >> 4) : (color & 0xf));
 				}
 				else{
 					targetPixel = (((screenColumn << 3) + pixelIndex + (scroll & 7)) & 0xff);
-					cidx = ((cram[pixel + ((ntData & 0x800) ? 0x10 : 0)] & 0x3f) * 3);
+					cidx = (pixel + ((ntData & 0x800) ? 0x10 : 0));
 				}
-				vdpScreenBuffer[(yOffset * vdpCurrentMode->width) + targetPixel] = (0xff000000 | (currentClut[cidx] << 16) | (currentClut[cidx + 1] << 8) | currentClut[cidx + 2]);
+				vdpScreenBuffer[(yOffset * vdpCurrentMode->width) + targetPixel] = colorCache[cidx];
 				priorityMask[targetPixel] = ((ntData & 0x1000) >> 8);
 				transMask[targetPixel] = pixel ? 1 : 0;
-				if(columnMask && (videoMode & 0x08)){
-					cidx = ((cram[bgColor + 0x10] & 0x3f) * 3);
-					vdpScreenBuffer[(yOffset*vdpCurrentMode->width) + ((pixelIndex+scroll) & 7)] = (0xff000000 | (currentClut[cidx] << 16) | (currentClut[cidx + 1] << 8) | currentClut[cidx + 2]);
-				}
+				if(columnMask && (videoMode & 0x08))
+					vdpScreenBuffer[(yOffset*vdpCurrentMode->width) + ((pixelIndex+scroll) & 7)] = colorCache[bgColor + 0x10];
 			}
 		}
 
 		/* Sprite rendering */
-		int listSize = ((videoMode & 0x08) ? 64 : 32);
 		int spriteLimit = ((videoMode & 0x08) ? 8 : 4);
-		uint8_t spriteHeight = ((spriteSize ? 16 : 8) << spriteZoom);
 		uint8_t spriteWidth = (((spriteSize && !(videoMode & 0x08)) ? 16 : 8) << spriteZoom);
-		/* Parse the Sprite Attribute Table, looking for sprites on the current scanline */
-		for(uint8_t s = 0; s < listSize; s++){
-			spriteY = (vram[saAddress + ((videoMode & 0x08)? s : s << 2)] + 1);
-			if((spriteY == (0xd0 + 1)) && (vdpCurrentMode->vactive == 192))
-				break;
-			if(spriteY >= (256 - spriteHeight + 1))
-				spriteY = (0 - (256 - spriteY)); /* negative Y offset (sprites go offscreen from top) */
-
-			/* Decode the attributes for the sprite, unless sprite limit has been reached */
-			if ((vCounter >= spriteY) && (vCounter < (spriteY + spriteHeight))){
-				spriteBuffer++;
-				if (spriteBuffer > spriteLimit)
-					statusFlags |= OVR;
+		if(satDirty)
+			build_sprite_bins();
+		if(spriteCount[vCounter] > spriteLimit)
+			statusFlags |= OVR;
+		/* A lone sprite can not collide with anything */
+		uint8_t collision = (spriteCount[vCounter] > 1);
+		if(collision)
+			memset(spriteMask, 0, vdpCurrentMode->width*sizeof(uint8_t));
+		for(uint8_t i = 0; (i < spriteCount[vCounter]) && (i < spriteLimit); i++){
+			uint8_t s = spriteBin[vCounter][i];
+			spriteY = satY[s];
+			spriteX = satX[s];
+			spriteI = satN[s];
+			if(videoMode & 0x08){
+				sgOffset = sgAddress + ((spriteSize ? (spriteI & 0xfe) : spriteI) << 5);
+				spriteRow = ((vCounter - spriteY) >> spriteZoom);
+				spritePixels = tile_row((sgOffset >> 5) + (spriteRow >> 3), (spriteRow & 7), 0);
+			}
+			else{
+				sgOffset = sgAddress + ((spriteSize ? (spriteI & 0xfc) : spriteI) << 3);
+				spriteShift = ((satAttr[s] & 0x80) >> 4);
+			}
+
+			/* Generate the current row of the sprite */
+			for (uint8_t pixelIndex = 0; pixelIndex < (spriteWidth << spriteZoom); pixelIndex++){
+				/* TODO: split for different video modes to keep readability */
+				if(videoMode & 0x08){
+					if((pixelIndex >> spriteZoom) > 7) /* nothing left of the 8 pixel wide pattern */
+						break;
+					pixel = spritePixels[pixelIndex >> spriteZoom];
+					cidx = (pixel + 0x10);
+				}
 				else{
-					if(videoMode & 0x08){
-						spriteX = vram[saAddress + (s << 1) + 128];
-						spriteI = vram[saAddress + (s << 1) + 129];
-						sgOffset = sgAddress + ((spriteSize ? (spriteI & 0xfe) : spriteI) << 5);
-					}
-					else{
-						spriteX = vram[saAddress + (s << 2) + 1];
-						spriteI = vram[saAddress + (s << 2) + 2];
-						sgOffset = sgAddress + ((spriteSize ? (spriteI & 0xfc) : spriteI) << 3);
-						spriteShift = ((vram[saAddress + (s << 2) + 3] & 0x80) >> 4);
-					}
+					pixel  = (vram[sgOffset + ((((pixelIndex & 0x08) << 1) + (vCounter - spriteY)) >> spriteZoom)] & (1 << (7 - ((pixelIndex & 7) >> spriteZoom)))) ? 1:0;
+					cidx = ((satAttr[s] & 0xf) ? (satAttr[s] & 0xf) : bgColor);
+				}
+				int pixelOffset = (pixelIndex + spriteX - spriteShift); /* must be signed int */
 
-					/* Generate the current row of the sprite */
-					for (uint8_t pixelIndex = 0; pixelIndex < (spriteWidth << spriteZoom); pixelIndex++){
-						/* TODO: split for different video modes to keep readability */
-						if(videoMode & 0x08){
-							pixel  = (vram[sgOffset + (((vCounter - spriteY) >> spriteZoom) << 2)    ] & (1 << (7 - (pixelIndex >> spriteZoom)))) ? 1:0;
-							pixel |= (vram[sgOffset + (((vCounter - spriteY) >> spriteZoom) << 2) + 1] & (1 << (7 - (pixelIndex >> spriteZoom)))) ? 2:0;
-							pixel |= (vram[sgOffset + (((vCounter - spriteY) >> spriteZoom) << 2) + 2] & (1 << (7 - (pixelIndex >> spriteZoom)))) ? 4:0;
-							pixel |= (vram[sgOffset + (((vCounter - spriteY) >> spriteZoom) << 2) + 3] & (1 << (7 - (pixelIndex >> spriteZoom)))) ? 8:0;
-							cidx = (cram[pixel+0x10] & 0x3f);
-						}
-						else{
-							pixel  = (vram[sgOffset + ((((pixelIndex & 0x08) << 1) + (vCounter - spriteY)) >> spriteZoom)] & (1 << (7 - ((pixelIndex & 7) >> spriteZoom)))) ? 1:0;
-							cidx = ((vram[saAddress + (s << 2) + 3] & 0xf) ? (vram[saAddress + (s << 2) + 3] & 0xf) : bgColor);
-						}
-						int pixelOffset = (pixelIndex + spriteX - spriteShift); /* must be signed int */
-
-						if(pixel && pixelOffset < vdpCurrentMode->width && pixelOffset >= columnMask){
-							if (spriteMask[pixelOffset])
-								statusFlags |= COL; /* set sprite collision flag */
-							else{
-								if((!priorityMask[pixelOffset]) || (!transMask[pixelOffset])){
-									vdpScreenBuffer[(yOffset*vdpCurrentMode->width) + pixelOffset] = (0xff000000|(currentClut[cidx * 3]<<16)|(currentClut[cidx * 3 + 1]<<8)|currentClut[cidx * 3 + 2]);
-								}
-								spriteMask[pixelOffset]= pixel ? 1 : 0;
-							}
+				if(pixel && pixelOffset < vdpCurrentMode->width && pixelOffset >= columnMask){
+					if (collision && spriteMask[pixelOffset])
+						statusFlags |= COL; /* set sprite collision flag */
+					else{
+						if((!priorityMask[pixelOffset]) || (!transMask[pixelOffset])){
+							vdpScreenBuffer[(yOffset*vdpCurrentMode->width) + pixelOffset] = colorCache[cidx];
 						}
+						spriteMask[pixelOffset]= pixel ? 1 : 0;
 					}
 				}
 			}
 		}
 	}
 	else{
-		uint8_t fillValue;
+		uint32_t fillValue, *line = &vdpScreenBuffer[((yOffset) % vdpCurrentMode->height)*vdpCurrentMode->width];
 		if(vCounter < (vdpCurrentMode->bborder))
-			fillValue = (cram[bgColor + 0x10] & 0x3f);
+			fillValue = colorCache[bgColor + 0x10];
 		/*else if(vCounter < (currentMode->bblank))
 			fillValue = blank;
 		else if(vCounter < (currentMode->vblank))
@@ -436,13 +527,83 @@ void render_scanline(){
 		else if(vCounter < (currentMode->tblank))
 			fillValue = blank;*/
 		else if(vCounter < (vdpCurrentMode->tborder))
-			fillValue = (cram[bgColor + 0x10] & 0x3f);
+			fillValue = colorCache[bgColor + 0x10];
 		else
-			fillValue = 0;
-		for (uint16_t p = 0; p<256; p++){
-			vdpScreenBuffer[(((yOffset) % vdpCurrentMode->height)*vdpCurrentMode->width) + p]
-						 = (0xff000000|(currentClut[fillValue * 3]<<16)|(currentClut[fillValue * 3 + 1]<<8)|currentClut[fillValue * 3 + 2]);
+			fillValue = 0xff000000;
+		for (uint16_t p = 0; p<256; p++)
+			line[p] = fillValue;
+	}
+	hash_scanline(yOffset % vdpCurrentMode->height);
+}
+
+/* Parse the Sprite Attribute Table once and sort the sprites into per line bins */
+void build_sprite_bins(){
+	int listSize = ((videoMode & 0x08) ? 64 : 32);
+	int spriteLimit = ((videoMode & 0x08) ? 8 : 4);
+	uint8_t spriteHeight = ((spriteSize ? 16 : 8) << spriteZoom);
+	int16_t spriteY;
+	memset(spriteCount, 0, sizeof(spriteCount));
+	for(uint8_t s = 0; s < listSize; s++){
+		if(videoMode & 0x08){
+			spriteY = (vram[saAddress + s] + 1);
+			satX[s] = vram[saAddress + (s << 1) + 128];
+			satN[s] = vram[saAddress + (s << 1) + 129];
 		}
+		else{
+			spriteY = (vram[saAddress + (s << 2)] + 1);
+			satX[s] = vram[saAddress + (s << 2) + 1];
+			satN[s] = vram[saAddress + (s << 2) + 2];
+			satAttr[s] = vram[saAddress + (s << 2) + 3];
+		}
+		if((spriteY == (0xd0 + 1)) && (vdpCurrentMode->vactive == 192))
+			break;
+		if(spriteY >= (256 - spriteHeight + 1))
+			spriteY = (0 - (256 - spriteY)); /* negative Y offset (sprites go offscreen from top) */
+		satY[s] = spriteY;
+		/* Counts stop at one past the limit, enough to flag an overflow */
+		for(int line = (spriteY < 0 ? 0 : spriteY); (line < (spriteY + spriteHeight)) && (line < 256); line++){
+			if(spriteCount[line] < spriteLimit)
+				spriteBin[line][spriteCount[line]] = s;
+			if(spriteCount[line] <= spriteLimit)
+				spriteCount[line]++;
+		}
+	}
+	satDirty = 0;
+}
+
+/* Returns one decoded row of a Mode 4 tile, refreshing the cache if VRAM changed */
+uint8_t * tile_row(uint16_t tile, uint8_t row, uint8_t hFlip){
+	tile &= (TILE_COUNT - 1);
+	if(tileDirty[tile >> 3] & (1 << (tile & 7)))
+		decode_tile(tile);
+	return hFlip ? tileCacheFlipped[tile][row] : tileCache[tile][row];
+}
+
+void decode_tile(uint16_t tile){
+	uint8_t *pattern = &vram[tile << 5], pixel;
+	for (uint8_t row = 0; row < 8; row++){
+		for (uint8_t column = 0; column < 8; column++){
+			pixel  = ((pattern[0] >> (7 - column)) & 1);
+			pixel |= ((pattern[1] >> (7 - column)) & 1) << 1;
+			pixel |= ((pattern[2] >> (7 - column)) & 1) << 2;
+			pixel |= ((pattern[3] >> (7 - column)) & 1) << 3;
+			tileCache[tile][row][column] = pixel;
+			tileCacheFlipped[tile][row][7 - column] = pixel;
+		}
+		pattern += 4;
+	}
+	tileDirty[tile >> 3] &= ~(1 << (tile & 7));
+}
+
+/* Flag the finished line as dirty if it differs from the previous frame */
+void hash_scanline(uint16_t line){
+	uint32_t hash = 2166136261;
+	uint32_t *pixels = &vdpScreenBuffer[line * vdpCurrentMode->width];
+	for (int i = 0; i < vdpCurrentMode->width; i++)
+		hash = (hash ^ pixels[i]) * 16777619;
+	if (hash != lineHash[line]){
+		lineHash[line] = hash;
+		vdpDirtyLines[line] = 1;
 	}
 }
 
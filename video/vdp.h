@@ -14,6 +14,9 @@
 #define VRAM_MASK	(VRAM_SIZE - 1)
 #define CRAM_SIZE	0x20
 #define CRAM_MASK	(CRAM_SIZE - 1)
+#define TILE_COUNT	(VRAM_SIZE >> 5) /* 4bpp 8x8 tiles */
+
+#define VDP_MAX_LINES	288 /* PAL height */
 
 #define NT_MASK 0x3c00
 #define PG_MASK 0x3800
@@ -49,12 +52,16 @@ struct vdpDisplayMode {
 
 extern uint8_t controlFlag, statusFlags, lineInt, smsColor[0xc0];
 extern uint32_t *vdpScreenBuffer;
+extern uint8_t vdpDirtyLines[VDP_MAX_LINES];
 extern int16_t vdpdot;
 extern uint16_t vCounter, hCounter;
 extern struct vdpDisplayMode *vdpCurrentMode, ntsc192, pal192;
 extern int sframe;
 
+struct stateBuffer;
+
 void write_vdp_control(uint8_t), run_vdp(int), write_vdp_data(uint8_t), init_vdp(), reset_vdp(), close_vdp(), latch_hcounter(uint8_t), default_video_mode();
-uint8_t read_vdp_data(void);
+uint8_t read_vdp_data(void), read_vdp_status(void);
+void vdp_state(struct stateBuffer *);
 
 #endif /* VDP_H_ */